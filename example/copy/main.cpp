@@ -103,7 +103,7 @@ int main(int argc, char *argv[]) {
         if (i % 100 == 0) {
             std::cout << "step: " << i
                       << ", loss: " << loss.template item<double>()
-                      << ", acc: " << acc << std::endl;
+                      << ", acc: " << acc.template item<double>() << std::endl;
         }
     }
 }
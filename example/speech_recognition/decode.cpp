@@ -1,16 +1,22 @@
 #include <torch/torch.h>
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
 #include <random>
 #include <iostream>
 #include <cstddef>
 #include <iostream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <kaldi-io.h>
 
 #include <thxx/net.hpp>
+#include <thxx/frozen.hpp>
 #include <thxx/chrono.hpp>
 #include <thxx/optim.hpp>
 #include <thxx/dataset.hpp>
@@ -21,6 +27,9 @@ struct Config : thxx::net::transformer::Config
     // new config
     std::mt19937::result_type seed = 0;
     bool use_cuda = false;
+    std::int64_t n_jobs = 1;
+    bool quantize = false;
+    bool freeze = false;
 
     std::string model = "model.pt";
     std::string char_list = "espnet/egs/an4/asr1/data/lang_1char/train_nodev_units.txt";
@@ -56,17 +65,30 @@ struct Config : thxx::net::transformer::Config
         parser.add("--d_model", d_model, "the number of the entire model dim.");
         parser.add("--d_ff", d_ff, "the number of the feed-forward layer dim.");
         parser.add("--heads", heads, "the number of heads in the attention layer.");
+        parser.add("--d_head", d_head, "the dim of each attention head (0 for d_model / heads).");
         parser.add("--elayers", elayers, "the number of encoder layers.");
         parser.add("--dlayers", dlayers, "the number of decoder layers.");
+        parser.add("--subsampling", subsampling, "time subsampling rate of the input layer (4, 6 or 8).");
         parser.add("--dropout_rate", dropout_rate, "dropout rate.");
         parser.add("--label_smoothing", label_smoothing, "label smoothing penalty.");
+        parser.add("--ctc_weight", ctc_weight, "weight of the CTC loss used in training (> 0 to load the CTC head).");
+        parser.add("--exit_interval", exit_interval, "encoder layers between early exit heads used in training.");
+        parser.add("--draft_dlayers", draft_dlayers, "layers of the draft decoder used in training.");
+        parser.add("--draft_d_ff", draft_d_ff, "feed-forward dim of the draft decoder used in training.");
 
         // decode setting
         parser.add("--use_cuda", use_cuda, "use cuda for training.");
-        parser.add("--beam_size", batch_size, "beam size.");
+        parser.add("--beam_size", beam_size, "beam size.");
         parser.add("--batch_size", batch_size, "minibatch size.");
+        parser.add("--n_jobs", n_jobs, "the number of decoding threads sharing one model.");
+        parser.add("--quantize", quantize, "use int8 weights in linear layers (CPU only).");
+        parser.add("--freeze", freeze, "decode with an inference-only copy of the model (see thxx::frozen).");
         parser.add("--max_len_ratio", max_len_ratio, "max length ratio for output/input sequence.");
-        parser.add("--max_len_ratio", min_len_ratio, "min length ratio for output/input sequence.");
+        parser.add("--min_len_ratio", min_len_ratio, "min length ratio for output/input sequence.");
+        parser.add("--penalty", penalty, "insertion penalty added to the score of each token.");
+        parser.add("--ctc_decode", ctc_decode, "decode with the CTC head only (no decoder steps).");
+        parser.add("--exit_threshold", exit_threshold, "stop encoding at an exit head more confident than this (0 runs all the layers).");
+        parser.add("--speculative_tokens", speculative_tokens, "tokens proposed by the draft decoder per greedy step (0 does not use it).");
 
         if (parser.help_wanted)
         {
@@ -117,14 +139,116 @@ int main(int argc, const char *argv[])
     std::cout << "idim: " << idim << ", odim: " << odim << std::endl;
     using InputLayer = thxx::net::transformer::Conv2dSubsampling;
     thxx::net::Transformer<InputLayer> model(idim, odim, config);
+    torch::load(model, config.model);
     model->to(device);
+    model->eval();
+    if (config.quantize)
+    {
+        thxx::net::quantize_dynamic(*model);
+    }
+    // inference-only copy shared by the decoding threads
+    std::unique_ptr<thxx::frozen::Transformer<InputLayer>> frozen_model;
+    if (config.freeze)
+    {
+        frozen_model = std::make_unique<thxx::frozen::Transformer<InputLayer>>(thxx::frozen::freeze(model));
+    }
+
+    // minibatches are decoded by n_jobs threads sharing the read-only model
+    struct Job {
+        std::vector<std::string> keys;
+        std::vector<torch::Tensor> feats;
+        std::vector<std::string> preds;
+    };
+    auto decode = [&](Job& job) {
+        const auto& feats = job.feats;
+        std::vector<std::int64_t> lengths;
+        std::int64_t max_len = 0;
+        for (const auto& f : feats) {
+            lengths.push_back(f.size(0));
+            max_len = std::max(max_len, f.size(0));
+        }
+        auto batch = at::zeros({static_cast<std::int64_t>(feats.size()), max_len, idim});
+        for (size_t i = 0; i < feats.size(); ++i) {
+            batch[i].slice(0, 0, lengths[i]) = feats[i];
+        }
+        auto x = torch::autograd::make_variable(batch).to(device);
+        auto results = frozen_model ? frozen_model->recognize_batch(x, lengths) : model->recognize_batch(x, lengths);
+        for (const auto& r : results) {
+            job.preds.push_back(r.front().to_string(char_list));
+        }
+        job.feats.clear();
+    };
+    auto print = [&](const Job& job) {
+        for (size_t i = 0; i < job.keys.size(); ++i) {
+            std::cout << job.keys[i] << std::endl;
+            std::cout << "gold: " << (*decode_json)["utts"][job.keys[i].c_str()]["output"][0]["text"].GetString() << std::endl;
+            std::cout << "pred: " << job.preds[i] << std::endl;
+        }
+    };
+
+    // jobs are read while the workers decode the previous ones. at most max_jobs jobs are read
+    // and not printed yet, and the results are printed in the reading order as soon as they are ready
+    auto n_workers = std::max<std::int64_t>(1, config.n_jobs);
+    auto max_jobs = static_cast<size_t>(2 * n_workers);
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::pair<size_t, Job>> queue;
+    std::map<size_t, Job> finished;
+    size_t n_read = 0, n_printed = 0;
+    bool reading = true;
+
+    std::vector<std::thread> workers;
+    for (std::int64_t n = 0; n < n_workers; ++n) {
+        workers.emplace_back([&]() {
+            // grad mode is thread local
+            torch::NoGradGuard no_grad;
+            while (true) {
+                std::pair<size_t, Job> job;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [&]() { return !queue.empty() || !reading; });
+                    if (queue.empty()) return;
+                    job = std::move(queue.front());
+                    queue.pop_front();
+                }
+                decode(job.second);
+                std::lock_guard<std::mutex> lock(mutex);
+                finished.emplace(job.first, std::move(job.second));
+                for (auto it = finished.find(n_printed); it != finished.end(); it = finished.find(n_printed)) {
+                    print(it->second);
+                    finished.erase(it);
+                    ++n_printed;
+                }
+                cv.notify_all();
+            }
+        });
+    }
+
+    Job job;
+    auto submit = [&]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return n_read - n_printed < max_jobs; });
+        queue.emplace_back(n_read++, std::move(job));
+        job = Job();
+        cv.notify_all();
+    };
     for (; !decode_scp.Done(); decode_scp.Next()) {
-        auto key = decode_scp.Key();
-        std::cout << key << std::endl;
+        job.keys.push_back(decode_scp.Key());
         auto ptr = std::make_shared<kaldi::Matrix<float>>(decode_scp.Value());
-        torch::NoGradGuard no_grad;
-        auto n_best = model->recognize(torch::autograd::make_variable(thxx::memory::make_tensor(ptr)));
-        std::cout << "gold: " << (*decode_json)["utts"][key.c_str()]["output"][0]["text"].GetString() << std::endl;
-        std::cout << "pred: " << n_best.front().to_string(char_list) << std::endl;
+        job.feats.push_back(thxx::memory::make_tensor(ptr));
+        if (static_cast<std::int64_t>(job.keys.size()) >= config.batch_size) {
+            submit();
+        }
+    }
+    if (!job.keys.empty()) {
+        submit();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        reading = false;
+    }
+    cv.notify_all();
+    for (auto& w : workers) {
+        w.join();
     }
 }
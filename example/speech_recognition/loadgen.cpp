@@ -0,0 +1,156 @@
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <kaldi-io.h>
+
+#include <thxx/dataset.hpp>
+#include <thxx/serve.hpp>
+#include <typed_argparser.hpp>
+
+/// load generator of server.out reporting the latency percentiles and the throughput
+struct Config
+{
+    std::mt19937::result_type seed = 0;
+    std::string socket = "/tmp/thxx_asr.sock";
+    std::string decode_scp = "espnet/egs/an4/asr1/dump/train_dev/deltafalse/feats.scp";
+    std::int64_t n_requests = 1000;
+    std::int64_t concurrency = 16;
+    float rate = 0;
+
+    std::string json;
+    typed_argparser::ArgParser parser;
+
+    // parse cmd args
+    void parse(int argc, const char *const argv[])
+    {
+        parser = typed_argparser::ArgParser(argc, argv);
+
+        parser.add("--json", json);
+        if (!json.empty())
+        {
+            parser.from_json(json);
+        }
+
+        parser.add("--seed", seed, "random generator seed.");
+        parser.add("--socket", socket, "unix domain socket path of the server.");
+        parser.add("--decode_scp", decode_scp, "utterances sent in round robin.");
+        parser.add("--n_requests", n_requests, "the number of requests.");
+        parser.add("--concurrency", concurrency, "the number of connections (requests in flight).");
+        parser.add("--rate", rate, "poisson arrival rate of requests per second (0 sends back to back).");
+
+        if (parser.help_wanted)
+        {
+            std::cout << parser.help_message() << std::endl;
+            std::exit(0);
+        }
+
+        json = parser.to_json();
+    }
+};
+
+double percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty()) return 0;
+    auto i = static_cast<size_t>(p * (sorted.size() - 1));
+    return sorted[i];
+}
+
+int main(int argc, const char *argv[])
+{
+    using Clock = std::chrono::steady_clock;
+
+    Config config;
+    config.parse(argc, argv);
+    std::cout << "[config] " << config.json << std::endl;
+
+    std::vector<torch::Tensor> feats;
+    for (kaldi::SequentialBaseFloatMatrixReader reader("scp:" + config.decode_scp); !reader.Done(); reader.Next())
+    {
+        auto ptr = std::make_shared<kaldi::Matrix<float>>(reader.Value());
+        feats.push_back(thxx::memory::make_tensor(ptr));
+    }
+    AT_ASSERT(!feats.empty());
+
+    // open loop: request i is due at arrival[i] regardless of the responses, so queueing in the
+    // client is also counted as latency. closed loop (rate = 0): every connection sends back to back
+    std::vector<Clock::duration> arrival(config.n_requests, Clock::duration::zero());
+    if (config.rate > 0)
+    {
+        std::mt19937 engine(config.seed);
+        std::exponential_distribution<double> interval(config.rate);
+        double t = 0;
+        for (auto& a : arrival)
+        {
+            t += interval(engine);
+            a = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(t));
+        }
+    }
+
+    std::atomic<std::int64_t> next(0), n_frames(0), n_failed(0), n_rejected(0);
+    std::vector<std::vector<double>> latencies(config.concurrency);
+    auto start = Clock::now();
+    std::vector<std::thread> clients;
+    for (std::int64_t c = 0; c < config.concurrency; ++c)
+    {
+        clients.emplace_back([&, c]() {
+            auto fd = thxx::serve::wire::connect_unix(config.socket);
+            if (fd < 0)
+            {
+                std::cerr << "cannot connect " << config.socket << std::endl;
+                return;
+            }
+            for (auto i = next++; i < config.n_requests; i = next++)
+            {
+                auto due = start + arrival[i];
+                std::this_thread::sleep_until(due);
+                const auto& x = feats[i % feats.size()];
+                auto sent = config.rate > 0 ? due : Clock::now();
+                thxx::net::Hypothesis h;
+                if (!thxx::serve::wire::send_features(fd, x) || !thxx::serve::wire::receive_hypothesis(fd, h))
+                {
+                    ++n_failed;
+                    break;
+                }
+                if (h.tokens.empty() && std::isinf(h.score))
+                {
+                    ++n_rejected;
+                }
+                latencies[c].push_back(std::chrono::duration<double>(Clock::now() - sent).count());
+                n_frames += x.size(0);
+            }
+            ::close(fd);
+        });
+    }
+    for (auto& c : clients)
+    {
+        c.join();
+    }
+    auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<double> all;
+    for (const auto& l : latencies)
+    {
+        all.insert(all.end(), l.begin(), l.end());
+    }
+    std::sort(all.begin(), all.end());
+    std::cout << "requests: " << all.size() << ", failed: " << n_failed << ", rejected: " << n_rejected
+              << ", elapsed: " << elapsed << " sec" << std::endl;
+    std::cout << "throughput: " << all.size() / elapsed << " utt/sec, "
+              << n_frames / elapsed << " frames/sec" << std::endl;
+    std::cout << "latency p50: " << 1e3 * percentile(all, 0.5)
+              << " ms, p90: " << 1e3 * percentile(all, 0.9)
+              << " ms, p99: " << 1e3 * percentile(all, 0.99)
+              << " ms, max: " << 1e3 * (all.empty() ? 0 : all.back()) << " ms" << std::endl;
+}
@@ -5,6 +5,7 @@
 #include <iostream>
 #include <cstddef>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -21,6 +22,7 @@ struct Config : thxx::net::transformer::Config
     // new config
     std::mt19937::result_type seed = 0;
     bool use_cuda = false;
+    std::int64_t log_interval = 100;
 
     std::string train_json = "espnet/egs/an4/asr1/dump/train_nodev/deltafalse/data.json";
     std::string dev_json = "espnet/egs/an4/asr1/dump/train_dev/deltafalse/data.json";
@@ -56,18 +58,27 @@ struct Config : thxx::net::transformer::Config
         parser.add("--d_model", d_model, "the number of the entire model dim.");
         parser.add("--d_ff", d_ff, "the number of the feed-forward layer dim.");
         parser.add("--heads", heads, "the number of heads in the attention layer.");
+        parser.add("--d_head", d_head, "the dim of each attention head (0 for d_model / heads).");
         parser.add("--elayers", elayers, "the number of encoder layers.");
         parser.add("--dlayers", dlayers, "the number of decoder layers.");
+        parser.add("--subsampling", subsampling, "time subsampling rate of the input layer (4, 6 or 8).");
         parser.add("--dropout_rate", dropout_rate, "dropout rate.");
         parser.add("--label_smoothing", label_smoothing, "label smoothing penalty.");
+        parser.add("--ctc_weight", ctc_weight, "weight of the CTC loss on the encoder output (0 for no CTC head).");
+        parser.add("--exit_interval", exit_interval, "add an early exit head every this number of encoder layers (0 for none).");
+        parser.add("--draft_dlayers", draft_dlayers, "layers of a draft decoder for speculative decoding (0 for none).");
+        parser.add("--draft_d_ff", draft_d_ff, "feed-forward dim of the draft decoder.");
+        parser.add("--layer_drop", layer_drop, "probability to skip each encoder layer in training.");
 
         // training setting
         parser.add("--use_cuda", use_cuda, "use cuda for training.");
+        parser.add("--log_interval", log_interval, "the number of iterations between reading training metrics.");
         parser.add("--lr", lr, "learning rate.");
         parser.add("--warmup_steps", warmup_steps, "warmup steps for lr scheduler.");
         parser.add("--batch_size", batch_size, "minibatch size.");
         parser.add("--max_len_in", max_len_in, "max length for input sequence.");
         parser.add("--max_len_out", max_len_out, "max length for output sequence.");
+        parser.add("--mixed_precision", mixed_precision, "train in half with fp32 master weights (CUDA only).");
 
         if (parser.help_wanted)
         {
@@ -108,6 +119,12 @@ int main(int argc, const char *argv[])
         device_type = torch::kCPU;
     }
     torch::Device device(device_type);
+    if (config.mixed_precision && device_type == torch::kCPU)
+    {
+        // libtorch 1.0 has neither bf16 nor half GEMM on CPU
+        std::cerr << "--mixed_precision needs CUDA (libtorch 1.0 has no bf16 on CPU)" << std::endl;
+        return 1;
+    }
 
     auto train_json = thxx::dataset::read_json(config.train_json);
     auto dev_json = thxx::dataset::read_json(config.dev_json);
@@ -123,8 +140,13 @@ int main(int argc, const char *argv[])
     using InputLayer = thxx::net::transformer::Conv2dSubsampling;
     thxx::net::Transformer<InputLayer> model(idim, odim, config);
     model->to(device);
+    std::unique_ptr<thxx::optim::MixedPrecision> mixed;
+    if (config.mixed_precision)
+    {
+        mixed = std::make_unique<thxx::optim::MixedPrecision>(model->parameters());
+    }
     // torch::optim::Adam optimizer(model->parameters(), 0.01);
-    thxx::optim::Noam optimizer(model->parameters(), config.noam_options());
+    thxx::optim::Noam optimizer(mixed ? mixed->master_parameters : model->parameters(), config.noam_options());
 
     using torch::autograd::make_variable;
 
@@ -136,52 +158,78 @@ int main(int argc, const char *argv[])
         std::shuffle(train_batch.begin(), train_batch.end(), engine);
         model->train();
 
-        double sum_train_acc = 0;
-        size_t sum_train_sample = 0;
+        model->metrics.reset();
+        model->draft_metrics.reset();
         size_t n_iter = 0;
         thxx::chrono::StopWatch sw;
         for (auto batch : train_batch)
         {
             thxx::dataset::MiniBatch mb(batch);
-            optimizer.zero_grad();
-            auto [loss, acc] = model->forward(
+            mb.prepare(model->sos, model->eos, model->ignore_index);
+            if (mixed)
+            {
+                mixed->zero_grad();
+            }
+            else
+            {
+                optimizer.zero_grad();
+            }
+            auto [loss, acc] = model->forward_shifted(
                 make_variable(*mb.inputs).to(device),
                 mb.input_lengths,
-                make_variable(*mb.targets).to(device),
-                mb.target_lengths);
-            loss.backward();
-            optimizer.step();
-
-            auto samples = mb.input_lengths[0];
-            sum_train_acc += acc * samples;
-            sum_train_sample += samples;
+                make_variable(*mb.target_in).to(device),
+                make_variable(*mb.target_out).to(device),
+                mb.target_lengths,
+                *mb.input_mask,
+                *mb.target_mask);
+            if (mixed)
+            {
+                mixed->scale(loss).backward();
+                mixed->step(optimizer);
+            }
+            else
+            {
+                loss.backward();
+                optimizer.step();
+            }
+
             ++n_iter;
-            std::cout << "[train epoch: " << epoch << ", iter: " << n_iter << "/" << train_batch.size() <<  "]"
-                      << " loss: " << loss.item<double>()
-                      << ", acc: " << acc
-                      << ", elapsed: " << sw.elapsed()
-                      << ", iter/sec: " << (static_cast<double>(n_iter) / sw.elapsed()) << std::endl;
+            // metrics stay on device until they are read here
+            if (static_cast<std::int64_t>(n_iter) % std::max<std::int64_t>(1, config.log_interval) == 0 || n_iter == train_batch.size())
+            {
+                std::cout << "[train epoch: " << epoch << ", iter: " << n_iter << "/" << train_batch.size() <<  "]"
+                          << " loss: " << model->metrics.loss()
+                          << ", acc: " << model->metrics.accuracy();
+                if (!model->draft.is_empty())
+                {
+                    std::cout << ", draft loss: " << model->draft_metrics.loss()
+                              << ", draft acc: " << model->draft_metrics.accuracy();
+                }
+                std::cout << ", elapsed: " << sw.elapsed()
+                          << ", iter/sec: " << (static_cast<double>(n_iter) / sw.elapsed()) << std::endl;
+            }
         }
-        std::cout << "[train] average acc: " << sum_train_acc / sum_train_sample << std::endl;
+        std::cout << "[train] average acc: " << model->metrics.accuracy() << std::endl;
 
         model->eval();
         torch::NoGradGuard no_grad;
-        double sum_dev_acc = 0;
-        size_t sum_dev_sample = 0;
+        model->metrics.reset();
         for (auto batch : dev_batch)
         {
             thxx::dataset::MiniBatch mb(batch);
+            mb.prepare(model->sos, model->eos, model->ignore_index);
 
-            auto [loss, acc] = model->forward(
+            // accumulated in model->metrics
+            model->forward_shifted(
                 make_variable(*mb.inputs).to(device),
                 mb.input_lengths,
-                make_variable(*mb.targets).to(device),
-                mb.target_lengths);
-            auto samples = mb.input_lengths[0];
-            sum_dev_acc += acc * samples;
-            sum_dev_sample += samples;
+                make_variable(*mb.target_in).to(device),
+                make_variable(*mb.target_out).to(device),
+                mb.target_lengths,
+                *mb.input_mask,
+                *mb.target_mask);
         }
-        double dev_acc = sum_dev_acc / sum_dev_sample;
+        double dev_acc = model->metrics.accuracy();
         std::cout << "[dev] average acc: " << dev_acc << std::endl;
 
         if (dev_acc > best_acc)
@@ -0,0 +1,143 @@
+#include <torch/torch.h>
+
+#include <cstddef>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <kaldi-io.h>
+
+#include <thxx/net.hpp>
+#include <thxx/prune.hpp>
+#include <thxx/dataset.hpp>
+#include <typed_argparser.hpp>
+
+/// prune attention heads and feed-forward neurons of a trained model scored by the loss on a calibration set
+struct Config : thxx::net::transformer::Config
+{
+    // new config
+    std::mt19937::result_type seed = 0;
+    bool use_cuda = false;
+    std::int64_t n_calibration = 100;
+    std::int64_t prune_heads = 0;
+    std::int64_t prune_d_ff = 0;
+
+    std::string model = "model.pt";
+    std::string output = "pruned.pt";
+    std::string char_list = "espnet/egs/an4/asr1/data/lang_1char/train_nodev_units.txt";
+    std::string calibration_json = "espnet/egs/an4/asr1/dump/train_dev/deltafalse/data.json";
+    std::string calibration_scp = "espnet/egs/an4/asr1/dump/train_dev/deltafalse/feats.scp";
+
+    std::string json;
+    typed_argparser::ArgParser parser;
+
+    // parse cmd args
+    void parse(int argc, const char *const argv[])
+    {
+        parser = typed_argparser::ArgParser(argc, argv);
+
+        parser.add("--json", json);
+        if (!json.empty())
+        {
+            parser.from_json(json);
+        }
+
+        // data setting
+        parser.add("--char_list", char_list, "character (token) list for model output.");
+        parser.add("--calibration_json", calibration_json, "labels of the utterances scoring heads and neurons.");
+        parser.add("--calibration_scp", calibration_scp, "features of the utterances scoring heads and neurons.");
+        parser.add("--n_calibration", n_calibration, "the max number of calibration minibatches.");
+        parser.add("--batch_size", batch_size, "minibatch size.");
+
+        // model setting
+        parser.add("--model", model, "trained model path");
+        parser.add("--output", output, "pruned model path");
+        parser.add("--seed", seed, "random generator seed.");
+        parser.add("--d_model", d_model, "the number of the entire model dim.");
+        parser.add("--d_ff", d_ff, "the number of the feed-forward layer dim.");
+        parser.add("--heads", heads, "the number of heads in the attention layer.");
+        parser.add("--d_head", d_head, "the dim of each attention head (0 for d_model / heads).");
+        parser.add("--elayers", elayers, "the number of encoder layers.");
+        parser.add("--dlayers", dlayers, "the number of decoder layers.");
+        parser.add("--subsampling", subsampling, "time subsampling rate of the input layer (4, 6 or 8).");
+        parser.add("--ctc_weight", ctc_weight, "weight of the CTC loss used in training (> 0 to load the CTC head).");
+        parser.add("--exit_interval", exit_interval, "encoder layers between early exit heads used in training.");
+        parser.add("--draft_dlayers", draft_dlayers, "layers of the draft decoder used in training.");
+        parser.add("--draft_d_ff", draft_d_ff, "feed-forward dim of the draft decoder used in training.");
+
+        // pruning setting
+        parser.add("--use_cuda", use_cuda, "use cuda for calibration.");
+        parser.add("--max_len_ratio", max_len_ratio, "max length ratio for output/input sequence.");
+        parser.add("--prune_heads", prune_heads, "heads kept in every attention layer (0 keeps all).");
+        parser.add("--prune_d_ff", prune_d_ff, "neurons kept in every feed-forward layer (0 keeps all).");
+
+        if (parser.help_wanted)
+        {
+            std::cout << parser.help_message() << std::endl;
+            std::exit(0);
+        }
+
+        json = parser.to_json();
+    }
+};
+
+std::int64_t numel(const torch::nn::Module& module)
+{
+    std::int64_t n = 0;
+    for (const auto& p : module.parameters())
+    {
+        n += p.numel();
+    }
+    return n;
+}
+
+int main(int argc, const char *argv[])
+{
+    Config config;
+    config.parse(argc, argv);
+    std::cout << "[config] " << config.json << std::endl;
+
+    torch::manual_seed(config.seed);
+    torch::Device device(torch::cuda::is_available() && config.use_cuda ? torch::kCUDA : torch::kCPU);
+
+    auto char_list = thxx::dataset::read_char_list(std::ifstream(config.char_list));
+    auto calibration_json = thxx::dataset::read_json(config.calibration_json);
+    auto calibration_scp = thxx::dataset::open_scp(config.calibration_scp);
+    auto calibration_batch = thxx::dataset::make_batchset(calibration_json, calibration_scp, config.batch_size);
+
+    auto idim = calibration_batch[0][0].idim;
+    auto odim = char_list.size();
+    using InputLayer = thxx::net::transformer::Conv2dSubsampling;
+    thxx::net::Transformer<InputLayer> model(idim, odim, config);
+    torch::load(model, config.model);
+    model->to(device);
+    model->eval();
+
+    // gradients of the loss without dropout
+    thxx::prune::Calibration calibration(*model);
+    for (const auto& batch : calibration_batch)
+    {
+        if (calibration.count() >= config.n_calibration) break;
+        thxx::dataset::MiniBatch mb(batch);
+        model->zero_grad();
+        auto [loss, acc] = model->forward(
+            torch::autograd::make_variable(*mb.inputs).to(device),
+            mb.input_lengths,
+            torch::autograd::make_variable(*mb.targets).to(device),
+            mb.target_lengths);
+        loss.backward();
+        calibration.accumulate();
+    }
+    std::cout << "calibrated by " << calibration.count() << " minibatches" << std::endl;
+
+    auto heads = config.prune_heads > 0 ? config.prune_heads : config.heads;
+    auto d_ff = config.prune_d_ff > 0 ? config.prune_d_ff : config.d_ff;
+    auto pruned = thxx::prune::prune(model, calibration, heads, d_ff);
+    torch::save(pruned, config.output);
+    std::cout << "parameters: " << numel(*model) << " -> " << numel(*pruned) << std::endl;
+    std::cout << "decode with: --model " << config.output
+              << " --heads " << pruned->config.heads
+              << " --d_head " << pruned->config.d_head
+              << " --d_ff " << pruned->config.d_ff << std::endl;
+}
@@ -0,0 +1,203 @@
+#include <torch/torch.h>
+
+#include <cstddef>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <thxx/net.hpp>
+#include <thxx/frozen.hpp>
+#include <thxx/optim.hpp>
+#include <thxx/dataset.hpp>
+#include <thxx/serve.hpp>
+#include <typed_argparser.hpp>
+
+struct Config : thxx::net::transformer::Config
+{
+    // new config
+    std::mt19937::result_type seed = 0;
+    bool use_cuda = false;
+    bool quantize = false;
+    bool freeze = false;
+    std::string socket = "/tmp/thxx_asr.sock";
+    std::int64_t max_batch = 32;
+    std::int64_t max_frames = 16000;
+    float max_latency_ms = 20;
+    std::int64_t max_utterance_frames = 100000;
+
+    std::string model = "model.pt";
+    std::string char_list = "espnet/egs/an4/asr1/data/lang_1char/train_nodev_units.txt";
+    std::int64_t idim = 83;
+
+    std::string json;
+    typed_argparser::ArgParser parser;
+
+    // parse cmd args
+    void parse(int argc, const char *const argv[])
+    {
+        parser = typed_argparser::ArgParser(argc, argv);
+
+        // update default values
+        lr = 10;
+        warmup_steps = 25000;
+
+        parser.add("--json", json);
+        if (!json.empty())
+        {
+            parser.from_json(json);
+        }
+
+        // data setting
+        parser.add("--char_list", char_list, "character (token) list for model output.");
+        parser.add("--idim", idim, "the number of input feature dim.");
+
+        // model setting
+        parser.add("--model", model, "trained model path");
+        parser.add("--seed", seed, "random generator seed.");
+        parser.add("--d_model", d_model, "the number of the entire model dim.");
+        parser.add("--d_ff", d_ff, "the number of the feed-forward layer dim.");
+        parser.add("--heads", heads, "the number of heads in the attention layer.");
+        parser.add("--d_head", d_head, "the dim of each attention head (0 for d_model / heads).");
+        parser.add("--elayers", elayers, "the number of encoder layers.");
+        parser.add("--dlayers", dlayers, "the number of decoder layers.");
+        parser.add("--subsampling", subsampling, "time subsampling rate of the input layer (4, 6 or 8).");
+        parser.add("--dropout_rate", dropout_rate, "dropout rate.");
+        parser.add("--label_smoothing", label_smoothing, "label smoothing penalty.");
+        parser.add("--ctc_weight", ctc_weight, "weight of the CTC loss used in training (> 0 to load the CTC head).");
+        parser.add("--exit_interval", exit_interval, "encoder layers between early exit heads used in training.");
+        parser.add("--draft_dlayers", draft_dlayers, "layers of the draft decoder used in training.");
+        parser.add("--draft_d_ff", draft_d_ff, "feed-forward dim of the draft decoder used in training.");
+
+        // decode setting
+        parser.add("--use_cuda", use_cuda, "use cuda for decoding.");
+        parser.add("--beam_size", beam_size, "beam size.");
+        parser.add("--socket", socket, "unix domain socket path to listen.");
+        parser.add("--max_batch", max_batch, "the max number of utterances in a dynamic batch.");
+        parser.add("--max_frames", max_frames, "the max number of padded input frames in a dynamic batch.");
+        parser.add("--max_latency_ms", max_latency_ms, "milliseconds an utterance can wait for a batch to fill up.");
+        parser.add("--max_utterance_frames", max_utterance_frames, "the max number of frames of a request (longer closes the connection).");
+        parser.add("--quantize", quantize, "use int8 weights in linear layers (CPU only).");
+        parser.add("--freeze", freeze, "decode with an inference-only copy of the model (see thxx::frozen).");
+        parser.add("--max_len_ratio", max_len_ratio, "max length ratio for output/input sequence.");
+        parser.add("--min_len_ratio", min_len_ratio, "min length ratio for output/input sequence.");
+        parser.add("--penalty", penalty, "insertion penalty added to the score of each token.");
+        parser.add("--ctc_decode", ctc_decode, "decode with the CTC head only (no decoder steps).");
+        parser.add("--exit_threshold", exit_threshold, "stop encoding at an exit head more confident than this (0 runs all the layers).");
+        parser.add("--speculative_tokens", speculative_tokens, "tokens proposed by the draft decoder per greedy step (0 does not use it).");
+
+        if (parser.help_wanted)
+        {
+            std::cout << parser.help_message() << std::endl;
+            std::exit(0);
+        }
+
+        // parser.check();
+
+        json = parser.to_json();
+        std::ofstream ofs("server.json");
+        ofs << json;
+    }
+
+    thxx::optim::NoamOptions noam_options() const {
+        return {d_model, lr, warmup_steps};
+    }
+};
+
+int main(int argc, const char *argv[])
+{
+    Config config;
+    config.parse(argc, argv);
+    std::cout << "[config] " << config.json << std::endl;
+
+    torch::manual_seed(config.seed);
+
+    torch::DeviceType device_type;
+    if (torch::cuda::is_available() && config.use_cuda)
+    {
+        std::cout << "CUDA available! Serving on GPU" << std::endl;
+        device_type = torch::kCUDA;
+    }
+    else
+    {
+        std::cout << "Serving on CPU" << std::endl;
+        device_type = torch::kCPU;
+    }
+    torch::Device device(device_type);
+
+    auto char_list = thxx::dataset::read_char_list(std::ifstream(config.char_list));
+    auto odim = char_list.size();
+    std::cout << "idim: " << config.idim << ", odim: " << odim << std::endl;
+    using InputLayer = thxx::net::transformer::Conv2dSubsampling;
+    thxx::net::Transformer<InputLayer> model(config.idim, odim, config);
+    torch::load(model, config.model);
+    model->to(device);
+    model->eval();
+    if (config.quantize)
+    {
+        thxx::net::quantize_dynamic(*model);
+    }
+    // inference-only copy used instead of the model
+    std::unique_ptr<thxx::frozen::Transformer<InputLayer>> frozen_model;
+    if (config.freeze)
+    {
+        frozen_model = std::make_unique<thxx::frozen::Transformer<InputLayer>>(thxx::frozen::freeze(model));
+    }
+
+    // the model is only used by the batcher thread
+    thxx::serve::BatcherOptions options;
+    options.max_batch = config.max_batch;
+    options.max_frames = config.max_frames;
+    options.max_latency = config.max_latency_ms * 1e-3;
+    thxx::serve::DynamicBatcher batcher(
+        [&](torch::Tensor x, at::IntList lengths) {
+            x = x.to(device);
+            return frozen_model ? frozen_model->recognize_batch(x, lengths) : model->recognize_batch(x, lengths);
+        },
+        options);
+
+    auto listener = thxx::serve::wire::listen_unix(config.socket);
+    if (listener < 0)
+    {
+        std::cerr << "cannot listen " << config.socket << std::endl;
+        return 1;
+    }
+    std::cout << "listening " << config.socket << std::endl;
+
+    // utterances without an output frame of the input layer are not queued
+    auto min_frames = model->encoder->input_layer->context;
+
+    // one thread per connection waits for the results of its requests in order
+    while (true)
+    {
+        auto fd = ::accept(listener, nullptr, nullptr);
+        if (fd < 0) continue;
+        std::thread([&batcher, &config, min_frames, fd]() {
+            for (auto x = thxx::serve::wire::receive_features(fd, config.idim, config.max_utterance_frames); x.defined();
+                 x = thxx::serve::wire::receive_features(fd, config.idim, config.max_utterance_frames))
+            {
+                auto h = thxx::serve::wire::rejected();
+                if (x.size(0) >= min_frames)
+                {
+                    // a failed batch fails only its requests
+                    try
+                    {
+                        auto result = batcher.submit(x).get();
+                        if (!result.empty()) h = result.front();
+                    }
+                    catch (const std::exception& e)
+                    {
+                        std::cerr << "recognition failed: " << e.what() << std::endl;
+                    }
+                }
+                if (!thxx::serve::wire::send_hypothesis(fd, h)) break;
+            }
+            ::close(fd);
+        }).detach();
+    }
+}
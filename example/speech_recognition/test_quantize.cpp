@@ -0,0 +1,71 @@
+#include <thxx/testing.hpp>
+#include <thxx/dataset.hpp>
+#include <thxx/net.hpp>
+
+using namespace thxx;
+
+
+/// relative error ||a - b|| / ||b||
+static double relative_error(torch::Tensor a, torch::Tensor b) {
+    return ((a - b).norm() / b.norm()).template item<double>();
+}
+
+TEST_CASE( "int8 quantized Transformer vs fp32", "[quantize]" ) {
+    namespace T = net::transformer;
+    auto json = dataset::read_json("test_data/data.1.json");
+    auto scp = dataset::open_scp("test_data/feats.1.scp");
+    auto batchset = dataset::make_batchset(json, scp, 5);
+    REQUIRE(!batchset.empty());
+    auto idim = batchset[0][0].idim;
+    auto odim = batchset[0][0].odim;
+
+    T::Config conf;
+    conf.elayers = 2;
+    conf.dlayers = 2;
+    torch::manual_seed(0);
+    net::Transformer<T::Conv2dSubsampling> model(idim, odim, conf);
+    {
+        // trained weights have wider ranges than the initial ones
+        torch::optim::Adam optimizer(model->parameters(), 0.001);
+        for (int epoch = 0; epoch < 5; ++epoch) {
+            for (auto& bs : batchset) {
+                dataset::MiniBatch mb(bs);
+                optimizer.zero_grad();
+                auto x = torch::autograd::make_variable(*mb.inputs);
+                auto t = torch::autograd::make_variable(*mb.targets);
+                auto [loss, acc] = model->forward(x, mb.input_lengths, t, mb.target_lengths);
+                loss.backward();
+                optimizer.step();
+            }
+        }
+    }
+    // the same trained weights
+    net::Transformer<T::Conv2dSubsampling> quantized(idim, odim, conf);
+    std::stringstream ss;
+    torch::save(model, ss);
+    torch::load(quantized, ss);
+    model->eval();
+    quantized->eval();
+    torch::NoGradGuard no_grad;
+    net::quantize_dynamic(*quantized);
+
+    for (auto& bs : batchset) {
+        dataset::MiniBatch mb(bs);
+        auto x = torch::autograd::make_variable(*mb.inputs);
+        auto x_mask = net::pad_mask(mb.input_lengths).unsqueeze(-2);
+        auto [h32, h32_mask] = model->encoder->forward(x, x_mask);
+        auto [h8, h8_mask] = quantized->encoder->forward(x, x_mask);
+        CHECK(relative_error(h8, h32) < 0.05);
+
+        auto t = torch::autograd::make_variable(*mb.targets);
+        auto t_mask = net::pad_mask(mb.target_lengths).unsqueeze(-2).__and__(net::subsequent_mask(t.size(1)).unsqueeze(0));
+        auto [y32, y32_mask] = model->decoder->forward(t, t_mask, h32, h32_mask);
+        auto [y8, y8_mask] = quantized->decoder->forward(t, t_mask, h32, h32_mask);
+        auto logp32 = y32.log_softmax(-1);
+        auto logp8 = y8.log_softmax(-1);
+        CHECK(relative_error(logp8, logp32) < 0.05);
+        // the same best tokens for almost all the positions
+        auto agree = (logp8.argmax(-1) == logp32.argmax(-1)).to(at::kFloat).mean().template item<float>();
+        CHECK(agree > 0.95);
+    }
+}
@@ -12,6 +12,7 @@
 #include <torch/torch.h>
 
 #include <thxx/traits.hpp>
+#include <thxx/net.hpp>
 
 /// for kaldi
 #include <kaldi-io.h>
@@ -124,7 +125,7 @@ namespace thxx {
         };
 
         /// Gather input and target in sorted order by the length, and combine them into minibatch
-        std::vector<std::vector<Sample>>
+        inline std::vector<std::vector<Sample>>
         make_batchset(DocPtr doc, InputReaderPtr reader, size_t batch_size=32,
                       size_t max_length_in=800, size_t max_length_out=150,
                       size_t max_num_batches=std::numeric_limits<size_t>::max()) {
@@ -192,12 +193,40 @@ namespace thxx {
                 }
             }
 
+            /// precompute decoder input/output and padding masks on CPU for net::TransformerImpl::forward_shifted
+            void prepare(std::int64_t sos, std::int64_t eos, std::int64_t ignore_index) {
+                auto mb_size = this->targets->size(0);
+                auto max_olen = this->targets->size(1);
+                auto max_ilen = this->inputs->size(1);
+                if (max_olen > 0) {
+                    // the same decoder input/output as net::TransformerImpl::forward
+                    auto [t_in, t_out] = net::shift_targets(torch::autograd::make_variable(*this->targets),
+                                                            this->target_lengths, sos, eos, ignore_index);
+                    this->target_in = memory::make_unique<at::Tensor>(kernel::autograd::data(t_in));
+                    this->target_out = memory::make_unique<at::Tensor>(kernel::autograd::data(t_out));
+                } else {
+                    // no target in the minibatch
+                    this->target_in = memory::make_unique<at::Tensor>(at::empty({mb_size, 0}, at::kLong));
+                    this->target_out = memory::make_unique<at::Tensor>(at::empty({mb_size, 0}, at::kLong));
+                }
+                this->input_mask = memory::make_unique<at::Tensor>(at::zeros({mb_size, max_ilen}, at::kByte));
+                this->target_mask = memory::make_unique<at::Tensor>(at::zeros({mb_size, max_olen}, at::kByte));
+                auto i_mask = this->input_mask->data<std::uint8_t>();
+                auto t_mask = this->target_mask->data<std::uint8_t>();
+                for (std::int64_t b = 0; b < mb_size; ++b) {
+                    std::fill(t_mask + b * max_olen, t_mask + b * max_olen + this->target_lengths[b], 1);
+                    std::fill(i_mask + b * max_ilen, i_mask + b * max_ilen + this->input_lengths[b], 1);
+                }
+            }
+
             std::unique_ptr<at::Tensor> inputs, targets;
             std::vector<std::int64_t> input_lengths, target_lengths;
+            /// filled by prepare()
+            std::unique_ptr<at::Tensor> target_in, target_out, input_mask, target_mask;
         };
 
         /// read a json from a filename
-        std::shared_ptr<rapidjson::Document> read_json(const std::string& filename) {
+        inline std::shared_ptr<rapidjson::Document> read_json(const std::string& filename) {
             auto doc = std::make_shared<rapidjson::Document>();
             std::ifstream ifs(filename);
             rapidjson::IStreamWrapper isw(ifs);
@@ -205,12 +234,12 @@ namespace thxx {
             return doc;
         }
 
-        std::shared_ptr<kaldi::RandomAccessBaseFloatMatrixReader>
+        inline std::shared_ptr<kaldi::RandomAccessBaseFloatMatrixReader>
         open_scp(const std::string& filename) {
             return std::make_shared<kaldi::RandomAccessBaseFloatMatrixReader>("scp:" + filename);
         }
 
-        std::vector<std::string> read_char_list(std::ifstream file) {
+        inline std::vector<std::string> read_char_list(std::ifstream file) {
             std::string s = "";
             std::int64_t i = 0;
             std::int64_t n = 1;
@@ -0,0 +1,565 @@
+#pragma once
+
+/**
+   Frozen inference models
+
+   freeze(model) copies a trained net::Transformer into a read-only object of plain at::Tensors:
+   - no autograd Variable is created or dispatched inside the model (only the logits handed to the searches are wrapped)
+   - dropout is removed and the relu Lambda of the feed-forward block runs in place
+   - LayerNorm scale/bias are folded into the Linear layers reading the normalized output
+   - sqrt(d_model) of the positional encoding is folded into the input projection and the embedding table
+   - GEMM weights are stored transposed (in, out) and contiguous, and self-attention q/k/v are packed into one GEMM.
+     net::quantize_dynamic models keep int8 weights (re-quantized after folding)
+
+   A frozen model is never modified after construction, so threads can share it without locks.
+ */
+
+#include <torch/torch.h>
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <tuple>
+#include <vector>
+
+#include "kernel.hpp"
+#include "net.hpp"
+
+namespace thxx {
+    namespace frozen {
+
+        using kernel::autograd::data;
+
+        /// y = x W^T + b with W stored as a contiguous (in, out) matrix, i.e., the non-transposed GEMM operand
+        class Linear {
+        public:
+            /// (in, out) fp32/fp16 weight. undefined when quantized
+            at::Tensor weight_t;
+            at::Tensor bias;
+            kernel::QuantizedWeight quantized;
+
+            Linear() = default;
+
+            /// `weight` (out, in) and `bias` (out) or undefined. `quantize` keeps int8 weights for CPU fp32 inputs
+            Linear(at::Tensor weight, at::Tensor bias, bool quantize = false) {
+                weight = data(weight);
+                if (quantize && !weight.is_cuda() && weight.scalar_type() == at::kFloat) {
+                    this->quantized = kernel::quantize_per_channel(weight);
+                } else {
+                    this->weight_t = weight.t().contiguous();
+                }
+                if (bias.defined()) {
+                    this->bias = data(bias).clone();
+                }
+            }
+
+            explicit Linear(const net::LinearImpl& l)
+                : Linear(l.weight, l.bias, l.quantized.defined()) {}
+
+            /// Linear `l` reading the output of `norm`: W LN(x) + b = (W diag(scale)) LN'(x) + (W shift + b)
+            /// where LN' is the normalization without the affine transform. folded in double
+            Linear(const net::LinearImpl& l, const net::LayerNormImpl& norm)
+                : Linear(fold(l.weight, l.bias, norm), l.quantized.defined()) {}
+
+            Linear(std::tuple<at::Tensor, at::Tensor> weight_bias, bool quantize)
+                : Linear(std::get<0>(weight_bias), std::get<1>(weight_bias), quantize) {}
+
+            static std::tuple<at::Tensor, at::Tensor> fold(at::Tensor weight, at::Tensor bias, const net::LayerNormImpl& norm) {
+                auto dtype = weight.scalar_type();
+                auto w = data(weight).to(at::kDouble);
+                auto scale = data(norm.scale).to(at::kDouble);
+                auto shift = data(norm.bias).to(at::kDouble);
+                auto b = w.mv(shift);
+                if (bias.defined()) {
+                    b += data(bias).to(at::kDouble);
+                }
+                return std::make_tuple((w * scale.unsqueeze(0)).to(dtype), b.to(dtype));
+            }
+
+            bool defined() const {
+                return this->weight_t.defined() || this->quantized.defined();
+            }
+
+            std::int64_t out_features() const {
+                return this->quantized.defined() ? this->quantized.weight.size(0) : this->weight_t.size(1);
+            }
+
+            at::Tensor forward(const at::Tensor& x) const {
+                if (this->quantized.defined() && !x.is_cuda() && x.scalar_type() == at::kFloat) {
+                    return data(kernel::quantized_linear(x, this->quantized, this->bias));
+                }
+                AT_ASSERT(this->weight_t.defined());
+                auto x2d = x.contiguous().view({-1, x.size(-1)});
+                auto y = this->bias.defined() ? at::addmm(this->bias, x2d, this->weight_t) : x2d.mm(this->weight_t);
+                auto sizes = x.sizes().vec();
+                sizes.back() = y.size(1);
+                return y.view(sizes);
+            }
+        };
+
+
+        /// net::LayerNorm (unbiased std without eps). folded ones keep no scale nor bias and only normalize
+        class LayerNorm {
+        public:
+            /// undefined if folded
+            at::Tensor scale;
+            at::Tensor bias;
+
+            LayerNorm() = default;
+
+            explicit LayerNorm(const net::LayerNormImpl& norm, bool folded = false) {
+                if (!folded) {
+                    this->scale = data(norm.scale).clone();
+                    this->bias = data(norm.bias).clone();
+                }
+            }
+
+            at::Tensor forward(const at::Tensor& x) const {
+                if (!x.is_cuda() && x.scalar_type() == at::kFloat) {
+                    return data(std::get<0>(kernel::layer_norm(x, {}, this->scale, this->bias)));
+                }
+                auto h = x.to(at::kFloat);
+                auto mean = h.mean(-1, true);
+                auto std = h.std(-1, true).unsqueeze(-1);
+                auto y = (h - mean) / std;
+                if (this->scale.defined()) {
+                    y = this->scale.to(at::kFloat) * y + this->bias.to(at::kFloat);
+                }
+                return y.to(x.scalar_type());
+            }
+
+            /// returns (x + residual, forward(x + residual))
+            std::tuple<at::Tensor, at::Tensor> forward_residual(const at::Tensor& x, const at::Tensor& residual) const {
+                if (!x.is_cuda() && x.scalar_type() == at::kFloat) {
+                    auto [y, v] = kernel::layer_norm(x, residual, this->scale, this->bias);
+                    return std::make_tuple(data(v), data(y));
+                }
+                auto v = x + residual;
+                return std::make_tuple(v, this->forward(v));
+            }
+        };
+
+
+        /// net::MultiHeadedAttention with packed projections
+        class Attention {
+        public:
+            std::int64_t heads = 0;
+            std::int64_t d_model = 0;
+            std::int64_t d_k = 0;
+            /// query/key/value of self-attention in one GEMM
+            Linear qkv;
+            /// query and key/value of source-attention
+            Linear q;
+            Linear kv;
+            Linear out;
+
+            Attention() = default;
+
+            /// self-attention reading the output of `norm`
+            static Attention self(const net::MultiHeadedAttentionImpl& m, const net::LayerNormImpl& norm) {
+                auto ret = Attention(m);
+                std::vector<at::Tensor> ws, bs;
+                for (std::int64_t i = 0; i < 3; ++i) {
+                    auto [w, b] = m.projection_parameters(i);
+                    ws.push_back(data(w));
+                    bs.push_back(data(b));
+                }
+                auto quantize = m.linear_out->quantized.defined();
+                ret.qkv = Linear(Linear::fold(at::cat(ws, 0), at::cat(bs, 0), norm), quantize);
+                return ret;
+            }
+
+            /// source-attention whose query reads the output of `norm` and key/value read the encoder output
+            static Attention source(const net::MultiHeadedAttentionImpl& m, const net::LayerNormImpl& norm) {
+                auto ret = Attention(m);
+                auto [wq, bq] = m.projection_parameters(0);
+                auto [wk, bk] = m.projection_parameters(1);
+                auto [wv, bv] = m.projection_parameters(2);
+                auto quantize = m.linear_out->quantized.defined();
+                ret.q = Linear(Linear::fold(wq, bq, norm), quantize);
+                ret.kv = Linear(at::cat({data(wk), data(wv)}, 0), at::cat({data(bk), data(bv)}, 0), quantize);
+                return ret;
+            }
+
+            /// (batch, time, n * heads * d_k) -> n tensors of (batch, heads, time, d_k)
+            std::vector<at::Tensor> split_heads(const at::Tensor& x, std::int64_t n) const {
+                auto y = x.view({x.size(0), x.size(1), n, this->heads, this->d_k}).permute({2, 0, 3, 1, 4});
+                std::vector<at::Tensor> ret;
+                for (std::int64_t i = 0; i < n; ++i) {
+                    ret.push_back(y[i]);
+                }
+                return ret;
+            }
+
+            std::tuple<at::Tensor, at::Tensor, at::Tensor> forward_qkv(const at::Tensor& x) const {
+                auto qkv = this->split_heads(this->qkv.forward(x), 3);
+                return std::make_tuple(qkv[0], qkv[1], qkv[2]);
+            }
+
+            std::tuple<at::Tensor, at::Tensor> forward_kv(const at::Tensor& memory) const {
+                auto kv = this->split_heads(this->kv.forward(memory), 2);
+                return std::make_tuple(kv[0], kv[1]);
+            }
+
+            at::Tensor forward_q(const at::Tensor& x) const {
+                return this->split_heads(this->q.forward(x), 1)[0];
+            }
+
+            /// attend projected (batch, heads, time, d_k) query/key/value and apply the output projection
+            at::Tensor attend(const at::Tensor& q, const at::Tensor& k, const at::Tensor& v, const at::Tensor& mask) const {
+                auto n_batch = q.size(0);
+                auto q_len = q.size(2);
+                at::Tensor weighted;
+                if (!q.is_cuda() && q.scalar_type() == at::kFloat) {
+                    weighted = data(kernel::attention(q, k, v, mask));
+                } else {
+                    auto scores = (q.matmul(k.transpose(-2, -1)) / std::sqrt(this->d_k)).to(at::kFloat);
+                    if (mask.defined()) {
+                        scores.masked_fill_(mask.unsqueeze(1) == 0, std::numeric_limits<float>::lowest());
+                    }
+                    weighted = scores.softmax(-1).to(v.scalar_type()).matmul(v);
+                }
+                return this->out.forward(weighted.transpose(1, 2).contiguous().view({n_batch, q_len, this->heads * this->d_k}));
+            }
+
+        private:
+            explicit Attention(const net::MultiHeadedAttentionImpl& m)
+                : heads(m.heads), d_model(m.d_model), d_k(m.d_k), out(*m.linear_out) {}
+        };
+
+
+        /// positionwise_feedforward without dropout: Linear -> relu (in place) -> Linear
+        class FeedForward {
+        public:
+            Linear w_1;
+            Linear w_2;
+
+            FeedForward() = default;
+
+            /// `pff` made by net::transformer::positionwise_feedforward reading the output of `norm`
+            FeedForward(const torch::nn::Module& pff, const net::LayerNormImpl& norm) {
+                auto [w_1, w_2] = net::transformer::feedforward_linears(pff);
+                this->w_1 = Linear(*w_1, norm);
+                this->w_2 = Linear(*w_2);
+            }
+
+            at::Tensor forward(const at::Tensor& x) const {
+                return this->w_2.forward(this->w_1.forward(x).relu_());
+            }
+        };
+
+
+        /// positional encoding of (batch, time, d_model) inputs already scaled by sqrt(d_model)
+        inline at::Tensor add_positional_encoding(at::Tensor x, std::int64_t offset, std::int64_t reserve) {
+            auto pe = net::transformer::PositionalEncodingTable::instance().get(
+                offset, x.size(1), x.size(2), x.scalar_type(), x.device(), reserve);
+            return x.add_(data(pe));
+        }
+
+
+        /// net::transformer::Conv2dSubsampling with sqrt(d_model) folded into `out`
+        class Conv2dSubsampling {
+        public:
+            struct Conv {
+                /// (out, in, freq, time) kernel for (b, c, f, t) inputs
+                at::Tensor weight;
+                at::Tensor bias;
+                std::vector<std::int64_t> stride;
+                std::vector<std::int64_t> padding;
+            };
+
+            std::int64_t context;
+            std::int64_t stride;
+            std::int64_t max_len;
+            std::vector<Conv> convs;
+            Linear out;
+
+            explicit Conv2dSubsampling(const net::transformer::Conv2dSubsamplingImpl& m)
+                : context(m.context), stride(m.stride), max_len(m.pe->max_len) {
+                for (const auto& conv : m.convs) {
+                    const auto& o = conv->options;
+                    this->convs.push_back({data(conv->weight).transpose(2, 3).contiguous(), data(conv->bias).clone(),
+                                           at::IntList(o.stride_).vec(), at::IntList(o.padding_).vec()});
+                }
+                auto scale = m.pe->scale;
+                auto bias = m.out->with_bias ? data(m.out->bias) * scale : at::Tensor();
+                this->out = Linear(data(m.out->weight) * scale, bias);
+            }
+
+            /// (b, t, f) with mask (b, 1, t) -> (b, t', d_model) with mask (b, 1, t')
+            std::tuple<at::Tensor, at::Tensor> forward(const at::Tensor& x, const at::Tensor& mask) const {
+                auto h = x.transpose(1, 2).unsqueeze(1);
+                for (const auto& c : this->convs) {
+                    h = at::conv2d(h, c.weight, c.bias, c.stride, c.padding).relu_();
+                }
+                auto n_batch = h.size(0);
+                auto n_time = h.size(3);
+                h = h.view({n_batch, -1, n_time});
+                auto y = at::bmm(h.transpose(1, 2), this->out.weight_t.expand({n_batch, -1, -1}));
+                if (this->out.bias.defined()) {
+                    y.add_(this->out.bias);
+                }
+                y = add_positional_encoding(y, 0, this->max_len);
+                return std::make_tuple(y, net::transformer::Conv2dSubsamplingImpl::subsample_mask(mask, this->context, this->stride));
+            }
+        };
+
+
+        /// net::transformer::PositonalEmbedding with sqrt(d_model) folded into the table
+        class Embedding {
+        public:
+            /// (vocab, d_model)
+            at::Tensor table;
+            std::int64_t max_len;
+
+            explicit Embedding(const net::transformer::PositonalEmbeddingImpl& m)
+                : table(data(m.embed->weight) * m.pe->scale), max_len(m.pe->max_len) {}
+
+            /// (b, t) tokens -> (b, t, d_model). `offset` is the position of x[:, 0]
+            std::tuple<at::Tensor, at::Tensor> forward(const at::Tensor& x, const at::Tensor& mask,
+                                                       std::int64_t offset = 0) const {
+                auto e = this->table.index_select(0, x.reshape({-1})).view({x.size(0), x.size(1), -1});
+                return std::make_tuple(add_positional_encoding(e, offset, this->max_len), mask);
+            }
+        };
+
+
+        /// frozen type of each input layer of net::transformer::Encoder
+        template <typename InputLayer> struct InputOf;
+        template <> struct InputOf<net::transformer::Conv2dSubsampling> { using type = Conv2dSubsampling; };
+        template <> struct InputOf<net::transformer::PositonalEmbedding> { using type = Embedding; };
+
+
+        class EncoderLayer {
+        public:
+            Attention self_attn;
+            FeedForward pff;
+            LayerNorm norm1;
+            LayerNorm norm2;
+
+            explicit EncoderLayer(const net::transformer::EncoderLayerImpl& m)
+                : self_attn(Attention::self(*m.self_attn, *m.norm1)), pff(*m.pff, *m.norm2),
+                  norm1(*m.norm1, true), norm2(*m.norm2, true) {}
+
+            at::Tensor forward(at::Tensor x, const at::Tensor& mask) const {
+                auto nx = this->norm1.forward(x);
+                auto [q, k, v] = this->self_attn.forward_qkv(nx);
+                std::tie(x, nx) = this->norm2.forward_residual(x, this->self_attn.attend(q, k, v, mask));
+                return x.add_(this->pff.forward(nx));
+            }
+        };
+
+
+        template <typename Input>
+        class Encoder {
+        public:
+            Input input_layer;
+            std::vector<EncoderLayer> layers;
+            /// not folded because the encoder output is read by the decoder and the CTC head
+            LayerNorm norm;
+            /// exit heads reading `norm` and the layer index each of them follows
+            std::vector<Linear> exits;
+            std::vector<std::int64_t> exit_layers;
+            float exit_threshold;
+            std::int64_t stream_chunk;
+            std::int64_t stream_left_chunks;
+
+            template <typename InputLayer>
+            explicit Encoder(const net::transformer::EncoderImpl<InputLayer>& m)
+                : input_layer(*m.input_layer), norm(*m.norm), exit_threshold(m.config.exit_threshold),
+                  stream_chunk(m.config.stream_chunk), stream_left_chunks(m.config.stream_left_chunks) {
+                for (size_t i = 0; i < m.layers.size(); ++i) {
+                    this->layers.emplace_back(*m.layers[i]);
+                    auto e = m.exit_index(i);
+                    if (e >= 0) {
+                        this->exits.emplace_back(*m.exits[e]);
+                        this->exit_layers.push_back(i);
+                    }
+                }
+            }
+
+            /// the same as net::transformer::EncoderImpl::forward in eval mode (padded frames are encoded too)
+            std::tuple<at::Tensor, at::Tensor> forward(at::Tensor x, at::Tensor mask) const {
+                std::tie(x, mask) = this->input_layer.forward(x, mask);
+                auto layer_mask = mask;
+                if (this->stream_chunk > 0) {
+                    auto c = net::transformer::chunk_mask(x.size(1), this->stream_chunk, this->stream_left_chunks, x.device());
+                    layer_mask = mask.__and__(c.unsqueeze(0));
+                }
+                size_t e = 0;
+                for (size_t i = 0; i < this->layers.size(); ++i) {
+                    x = this->layers[i].forward(x, layer_mask);
+                    if (this->exit_threshold > 0 && e < this->exits.size() && this->exit_layers[e] == static_cast<std::int64_t>(i)) {
+                        auto h = this->norm.forward(x);
+                        if (net::transformer::exit_confidence(this->exits[e++].forward(h), mask) > this->exit_threshold) {
+                            return std::make_tuple(h, mask);
+                        }
+                    }
+                }
+                return std::make_tuple(this->norm.forward(x), mask);
+            }
+        };
+
+
+        /// net::transformer::DecoderState of plain tensors. indices from the searches can be variables
+        struct DecoderState : net::transformer::DecoderState {
+            void index_select(torch::Tensor index) {
+                net::transformer::DecoderState::index_select(data(index));
+            }
+        };
+
+
+        class DecoderLayer {
+        public:
+            Attention self_attn;
+            Attention src_attn;
+            FeedForward pff;
+            LayerNorm norm1;
+            LayerNorm norm2;
+            LayerNorm norm3;
+
+            explicit DecoderLayer(const net::transformer::DecoderLayerImpl& m)
+                : self_attn(Attention::self(*m.self_attn, *m.norm1)), src_attn(Attention::source(*m.src_attn, *m.norm2)),
+                  pff(*m.pff, *m.norm3), norm1(*m.norm1, true), norm2(*m.norm2, true), norm3(*m.norm3, true) {}
+
+            /// the same as net::transformer::DecoderLayerImpl::forward_incremental
+            at::Tensor forward_incremental(const at::Tensor& tgt, const at::Tensor& tgt_mask,
+                                           net::transformer::DecoderLayerCache& cache, const at::Tensor& memory_mask) const {
+                auto nx = this->norm1.forward(tgt);
+                auto [q, k, v] = this->self_attn.forward_qkv(nx);
+                if (cache.self_k.defined()) {
+                    k = at::cat({cache.self_k, k}, 2);
+                    v = at::cat({cache.self_v, v}, 2);
+                }
+                cache.self_k = k;
+                cache.self_v = v;
+                at::Tensor x;
+                std::tie(x, nx) = this->norm2.forward_residual(tgt, this->self_attn.attend(q, k, v, tgt_mask));
+                std::tie(x, nx) = this->norm3.forward_residual(
+                    x, this->src_attn.attend(this->src_attn.forward_q(nx), cache.src_k, cache.src_v, memory_mask));
+                return x.add_(this->pff.forward(nx));
+            }
+        };
+
+
+        class Decoder {
+        public:
+            Embedding embed;
+            std::vector<DecoderLayer> layers;
+            /// output_layer with output_norm folded
+            Linear output;
+
+            explicit Decoder(const net::transformer::DecoderImpl& m)
+                : embed(*m.embed), output(*m.output_layer, *m.output_norm) {
+                for (const auto& l : m.layers) {
+                    this->layers.emplace_back(*l);
+                }
+            }
+
+            DecoderState init_state(torch::Tensor memory, torch::Tensor memory_mask) const {
+                memory = data(memory);
+                DecoderState state;
+                state.memory_mask = data(memory_mask);
+                state.layers.reserve(this->layers.size());
+                for (const auto& l : this->layers) {
+                    auto [k, v] = l.src_attn.forward_kv(memory);
+                    state.layers.push_back({{}, {}, k, v});
+                }
+                return state;
+            }
+
+            /// returns (batch, time, odim) output of the newest tokens `tgt`. the output is wrapped as a variable
+            /// without history because net::greedy_search and net::beam_search mix it with their own variables
+            torch::Tensor forward_incremental(torch::Tensor tgt, DecoderState& state) const {
+                AT_ASSERT(state.layers.size() == this->layers.size());
+                auto n = tgt.size(1);
+                at::Tensor mask;
+                if (n > 1) {
+                    mask = net::subsequent_mask(state.offset + n, tgt.device()).slice(0, state.offset).unsqueeze(0);
+                }
+                auto x = std::get<0>(this->embed.forward(data(tgt), mask, state.offset));
+                for (size_t i = 0; i < this->layers.size(); ++i) {
+                    x = this->layers[i].forward_incremental(x, mask, state.layers[i], state.memory_mask);
+                }
+                state.offset += n;
+                return torch::autograd::make_variable(this->output.forward(x), false);
+            }
+        };
+
+
+        /// inference-only net::Transformer made by freeze()
+        template <typename InputLayer>
+        class Transformer {
+        public:
+            std::int64_t idim;
+            std::int64_t odim;
+            net::transformer::Config config;
+            std::int64_t sos;
+            std::int64_t eos;
+            at::ScalarType dtype;
+
+            Encoder<typename InputOf<InputLayer>::type> encoder;
+            Decoder decoder;
+            /// null without the draft decoder
+            std::shared_ptr<const Decoder> draft;
+            /// undefined without the CTC head
+            Linear ctc;
+
+            explicit Transformer(const net::TransformerImpl<InputLayer>& m)
+                : idim(m.idim), odim(m.odim), config(m.config), sos(m.sos), eos(m.eos), dtype(m.dtype()),
+                  encoder(*m.encoder), decoder(*m.decoder) {
+                if (!m.ctc.is_empty()) {
+                    this->ctc = Linear(*m.ctc);
+                }
+                if (!m.draft.is_empty()) {
+                    this->draft = std::make_shared<const Decoder>(*m.draft);
+                }
+            }
+
+            /// encode padded `src` (batch, time, feat) into padded memory and its mask
+            std::tuple<at::Tensor, at::Tensor> encode(torch::Tensor src, at::IntList src_length) const {
+                auto x = data(src);
+                if (at::isFloatingType(x.scalar_type())) {
+                    x = x.to(this->dtype);
+                }
+                auto mask = data(net::pad_mask(src_length, x.device())).unsqueeze(-2);
+                return this->encoder.forward(x, mask);
+            }
+
+            /// the same as net::TransformerImpl::recognize_batch
+            std::vector<std::vector<net::Hypothesis>> recognize_batch(torch::Tensor src, at::IntList src_length) const {
+                AT_ASSERT(src.dim() == 3); // "input shape should be (batch, time, feat)");
+                AT_ASSERT(src.size(0) == static_cast<std::int64_t>(src_length.size()));
+                // the CTC head is not trained on the memory of exit layers
+                AT_ASSERT(!this->config.ctc_decode || this->config.exit_threshold == 0);
+                auto [mem, mem_mask] = this->encode(src, src_length);
+                if (this->config.ctc_decode) {
+                    AT_ASSERT(this->ctc.defined()); // "ctc_decode needs a model trained with ctc_weight > 0"
+                    auto logp = this->ctc.forward(mem).to(at::kFloat).log_softmax(-1);
+                    return net::ctc_search(logp, mem_mask, this->sos, this->eos, this->config.beam_size);
+                }
+                auto decoder = &this->decoder;
+                if (this->draft && this->config.speculative_tokens > 0 && this->config.beam_size == 1) {
+                    auto draft = this->draft.get();
+                    return net::speculative_search(decoder, draft, mem, mem_mask, this->sos, this->eos, this->config, src_length);
+                }
+                return net::autoregressive_search(decoder, mem, mem_mask, this->sos, this->eos, this->config, src_length);
+            }
+
+            /// returns n-best hypotheses of a single utterance `src` (time, feat)
+            std::vector<net::Hypothesis> recognize(torch::Tensor src) const {
+                AT_ASSERT(src.dim() == 2); // "input shape should be (time, feat)");
+                return this->recognize_batch(src.unsqueeze(0), {src.size(0)}).front();
+            }
+        };
+
+        /// inference-only copy of a trained `model` on its current device. later updates of `model` are not reflected
+        template <typename InputLayer>
+        Transformer<InputLayer> freeze(const net::Transformer<InputLayer>& model) {
+            torch::NoGradGuard no_grad;
+            return Transformer<InputLayer>(*model);
+        }
+
+    } // namespace frozen
+} // namespace thxx
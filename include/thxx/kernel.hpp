@@ -0,0 +1,1246 @@
+/**
+   Hand-written CPU kernels with their autograd functions.
+
+   NOTE:
+   - autograd::Function is the libtorch 1.0 way to define backward in C++
+   https://github.com/pytorch/pytorch/blob/v1.0.0/torch/csrc/autograd/function.h
+   - SIMD loops are enabled by compiler flags, e.g., -march=native in RELEASE=true build
+*/
+#pragma once
+
+#include <torch/torch.h>
+#include <torch/csrc/autograd/engine.h>
+#include <torch/csrc/autograd/function.h>
+#include <torch/csrc/autograd/functions/utils.h>
+#include <ATen/Parallel.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+namespace thxx {
+
+    namespace kernel {
+
+        namespace simd {
+#if defined(__AVX__)
+            inline __m256 fmadd(__m256 a, __m256 b, __m256 c) {
+#if defined(__FMA__)
+                return _mm256_fmadd_ps(a, b, c);
+#else
+                return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+            }
+
+            inline float reduce_add(__m256 x) {
+                auto s = _mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+                s = _mm_hadd_ps(s, s);
+                s = _mm_hadd_ps(s, s);
+                return _mm_cvtss_f32(s);
+            }
+#endif
+
+            /// sum_i a[i] * b[i]
+            inline float dot(const float* a, const float* b, std::int64_t n) {
+                std::int64_t i = 0;
+                float ret = 0;
+#if defined(__AVX__)
+                auto acc = _mm256_setzero_ps();
+                for (; i + 8 <= n; i += 8) {
+                    acc = fmadd(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc);
+                }
+                ret = reduce_add(acc);
+#endif
+                for (; i < n; ++i) {
+                    ret += a[i] * b[i];
+                }
+                return ret;
+            }
+
+            /// y[i] += alpha * x[i]
+            inline void axpy(float alpha, const float* x, float* y, std::int64_t n) {
+                std::int64_t i = 0;
+#if defined(__AVX__)
+                auto a = _mm256_set1_ps(alpha);
+                for (; i + 8 <= n; i += 8) {
+                    _mm256_storeu_ps(y + i, fmadd(a, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+                }
+#endif
+                for (; i < n; ++i) {
+                    y[i] += alpha * x[i];
+                }
+            }
+
+            /// y[i] *= alpha
+            inline void scale(float alpha, float* y, std::int64_t n) {
+                std::int64_t i = 0;
+#if defined(__AVX__)
+                auto a = _mm256_set1_ps(alpha);
+                for (; i + 8 <= n; i += 8) {
+                    _mm256_storeu_ps(y + i, _mm256_mul_ps(a, _mm256_loadu_ps(y + i)));
+                }
+#endif
+                for (; i < n; ++i) {
+                    y[i] *= alpha;
+                }
+            }
+
+            /**
+               c[r][j] = sum_i a[r * lda + i] * b[j * ldb + i] of R rows of 16-bit activations and C rows of
+               8-bit weights in 32-bit integers. every loaded activation (weight) is used by C (R) products.
+            */
+            template <int R, int C>
+            inline void dot_tile(const std::int16_t* a, std::int64_t lda, const std::int8_t* b, std::int64_t ldb,
+                                 std::int64_t n, std::int32_t (&c)[R][C]) {
+                std::int64_t i = 0;
+                for (int r = 0; r < R; ++r) {
+                    for (int j = 0; j < C; ++j) {
+                        c[r][j] = 0;
+                    }
+                }
+#if defined(__AVX2__)
+                // R * C accumulators + R activations + 1 weight fit 16 ymm registers for R * C <= 8
+                __m256i acc[R][C];
+                for (int r = 0; r < R; ++r) {
+                    for (int j = 0; j < C; ++j) {
+                        acc[r][j] = _mm256_setzero_si256();
+                    }
+                }
+                for (; i + 16 <= n; i += 16) {
+                    __m256i va[R];
+                    for (int r = 0; r < R; ++r) {
+                        va[r] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + r * lda + i));
+                    }
+                    for (int j = 0; j < C; ++j) {
+                        auto vb = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j * ldb + i)));
+                        for (int r = 0; r < R; ++r) {
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+                            acc[r][j] = _mm256_dpwssd_epi32(acc[r][j], va[r], vb);
+#else
+                            acc[r][j] = _mm256_add_epi32(acc[r][j], _mm256_madd_epi16(va[r], vb));
+#endif
+                        }
+                    }
+                }
+                for (int r = 0; r < R; ++r) {
+                    for (int j = 0; j < C; ++j) {
+                        auto s = _mm_add_epi32(_mm256_castsi256_si128(acc[r][j]), _mm256_extracti128_si256(acc[r][j], 1));
+                        s = _mm_hadd_epi32(s, s);
+                        s = _mm_hadd_epi32(s, s);
+                        c[r][j] = _mm_cvtsi128_si32(s);
+                    }
+                }
+#endif
+                for (; i < n; ++i) {
+                    for (int r = 0; r < R; ++r) {
+                        for (int j = 0; j < C; ++j) {
+                            c[r][j] += static_cast<std::int32_t>(a[r * lda + i]) * b[j * ldb + i];
+                        }
+                    }
+                }
+            }
+
+            /// max_i |x[i]|
+            inline float max_abs(const float* x, std::int64_t n) {
+                std::int64_t i = 0;
+                float ret = 0;
+#if defined(__AVX__)
+                auto sign = _mm256_set1_ps(-0.0f);
+                auto acc = _mm256_setzero_ps();
+                for (; i + 8 <= n; i += 8) {
+                    acc = _mm256_max_ps(acc, _mm256_andnot_ps(sign, _mm256_loadu_ps(x + i)));
+                }
+                float lanes[8];
+                _mm256_storeu_ps(lanes, acc);
+                ret = *std::max_element(lanes, lanes + 8);
+#endif
+                for (; i < n; ++i) {
+                    ret = std::max(ret, std::abs(x[i]));
+                }
+                return ret;
+            }
+        } // namespace simd
+
+
+        namespace random {
+            /// counter-based hash so that the same (seed, counter) gives the same number in forward and backward
+            inline std::uint64_t splitmix64(std::uint64_t x) {
+                x += 0x9e3779b97f4a7c15ULL;
+                x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+                return x ^ (x >> 31);
+            }
+
+            /// uniform [0, 1) float
+            inline float uniform(std::uint64_t seed, std::uint64_t counter) {
+                return (splitmix64(seed ^ splitmix64(counter)) >> 40) * (1.0f / (1 << 24));
+            }
+
+            /// draw a seed from the global generator, so that torch::manual_seed controls it
+            inline std::uint64_t seed() {
+                return static_cast<std::uint64_t>(
+                    at::randint(std::numeric_limits<std::int64_t>::max(), {1}, at::kLong).template item<std::int64_t>());
+            }
+        } // namespace random
+
+
+        namespace autograd {
+            using torch::autograd::Variable;
+            using torch::autograd::variable_list;
+
+            /// tensor data without autograd history
+            inline at::Tensor data(at::Tensor t) {
+                return t.defined() && t.is_variable() ? torch::autograd::as_variable_ref(t).data() : t;
+            }
+
+            inline bool requires_grad(const std::vector<at::Tensor>& inputs) {
+                if (!torch::autograd::GradMode::is_enabled()) return false;
+                for (const auto& t : inputs) {
+                    if (t.defined() && t.is_variable() && t.requires_grad()) return true;
+                }
+                return false;
+            }
+
+            /// wrap `outputs` as variables whose grad_fn is `fn` when any of `inputs` requires grad
+            inline variable_list make_outputs(std::shared_ptr<torch::autograd::Function> fn,
+                                              std::vector<at::Tensor> inputs, std::vector<at::Tensor> outputs) {
+                variable_list ret;
+                ret.reserve(outputs.size());
+                for (auto& o : outputs) {
+                    ret.push_back(o.defined() ? torch::autograd::make_variable(o, false) : Variable());
+                }
+                if (requires_grad(inputs)) {
+                    variable_list vs;
+                    for (auto& t : inputs) {
+                        vs.push_back(t.defined() && t.is_variable() ? torch::autograd::as_variable_ref(t) : Variable());
+                    }
+                    fn->set_next_edges(torch::autograd::collect_next_edges(vs));
+                    for (auto& r : ret) {
+                        if (r.defined()) {
+                            torch::autograd::set_history(r, fn);
+                        }
+                    }
+                }
+                return ret;
+            }
+        } // namespace autograd
+
+
+        namespace detail {
+            /// one (batch, head) of scaled dot product attention. all the pointers are row-major with given row strides.
+            struct AttentionProblem {
+                const float* q;
+                const float* k;
+                const float* v;
+                std::int64_t q_len, kv_len, q_stride, kv_stride;
+                /// optional (q_len or 1, kv_len) byte mask. mask_stride = 0 for broadcasting a row
+                const std::uint8_t* mask;
+                std::int64_t mask_stride;
+                /// counter offset of dropout random numbers
+                std::uint64_t counter;
+            };
+
+            /// K/V are streamed in tiles of this size with online softmax
+            constexpr std::int64_t attention_tile = 64;
+            constexpr float masked_score = std::numeric_limits<float>::lowest();
+
+            inline bool is_masked(const AttentionProblem& p, std::int64_t i, std::int64_t j) {
+                return p.mask != nullptr && p.mask[i * p.mask_stride + j] == 0;
+            }
+
+            /// returns inverse of keep probability or zero for dropped
+            inline float dropout_scale(const AttentionProblem& p, float rate, std::uint64_t seed,
+                                       std::int64_t i, std::int64_t j) {
+                if (rate <= 0) return 1;
+                auto u = random::uniform(seed, p.counter + static_cast<std::uint64_t>(i * p.kv_len + j));
+                return u < rate ? 0 : 1 / (1 - rate);
+            }
+
+            /// o (q_len, d) and lse (q_len) are written with strides o_stride and 1
+            inline void attention_forward(const AttentionProblem& p, std::int64_t d, float scale,
+                                          float rate, std::uint64_t seed, float* o, std::int64_t o_stride, float* lse) {
+                float s[attention_tile];
+                for (std::int64_t i = 0; i < p.q_len; ++i) {
+                    auto qi = p.q + i * p.q_stride;
+                    auto oi = o + i * o_stride;
+                    std::fill(oi, oi + d, 0.0f);
+                    float m = -std::numeric_limits<float>::infinity();
+                    float l = 0;
+                    for (std::int64_t j0 = 0; j0 < p.kv_len; j0 += attention_tile) {
+                        auto jn = std::min(attention_tile, p.kv_len - j0);
+                        auto tile_max = masked_score;
+                        for (std::int64_t t = 0; t < jn; ++t) {
+                            auto j = j0 + t;
+                            s[t] = is_masked(p, i, j) ? masked_score : scale * simd::dot(qi, p.k + j * p.kv_stride, d);
+                            tile_max = std::max(tile_max, s[t]);
+                        }
+                        auto m_new = std::max(m, tile_max);
+                        auto alpha = std::exp(m - m_new);
+                        l *= alpha;
+                        simd::scale(alpha, oi, d);
+                        for (std::int64_t t = 0; t < jn; ++t) {
+                            auto e = std::exp(s[t] - m_new);
+                            l += e;
+                            auto pd = e * dropout_scale(p, rate, seed, i, j0 + t);
+                            if (pd != 0) {
+                                simd::axpy(pd, p.v + (j0 + t) * p.kv_stride, oi, d);
+                            }
+                        }
+                        m = m_new;
+                    }
+                    simd::scale(1 / l, oi, d);
+                    lse[i] = m + std::log(l);
+                }
+            }
+
+            /// gradients are accumulated into dq, dk and dv with the strides of q, k and v
+            inline void attention_backward(const AttentionProblem& p, std::int64_t d, float scale,
+                                           float rate, std::uint64_t seed,
+                                           const float* o, const float* go, std::int64_t o_stride, const float* lse,
+                                           float* dq, float* dk, float* dv) {
+                for (std::int64_t i = 0; i < p.q_len; ++i) {
+                    auto qi = p.q + i * p.q_stride;
+                    auto goi = go + i * o_stride;
+                    auto dqi = dq + i * p.q_stride;
+                    auto di = simd::dot(goi, o + i * o_stride, d);
+                    for (std::int64_t j = 0; j < p.kv_len; ++j) {
+                        auto kj = p.k + j * p.kv_stride;
+                        auto vj = p.v + j * p.kv_stride;
+                        auto masked = is_masked(p, i, j);
+                        auto sij = masked ? masked_score : scale * simd::dot(qi, kj, d);
+                        auto pij = std::exp(sij - lse[i]);
+                        if (pij == 0) continue;
+                        auto keep = dropout_scale(p, rate, seed, i, j);
+                        if (keep == 0) {
+                            if (!masked) {
+                                // dP = 0 for the dropped
+                                auto ds = -pij * di * scale;
+                                simd::axpy(ds, kj, dqi, d);
+                                simd::axpy(ds, qi, dk + j * p.kv_stride, d);
+                            }
+                            continue;
+                        }
+                        simd::axpy(pij * keep, goi, dv + j * p.kv_stride, d);
+                        if (masked) continue; // masked_fill blocks the gradient of scores
+                        auto dp = simd::dot(goi, vj, d) * keep;
+                        auto ds = pij * (dp - di) * scale;
+                        simd::axpy(ds, kj, dqi, d);
+                        simd::axpy(ds, qi, dk + j * p.kv_stride, d);
+                    }
+                }
+            }
+
+            /// problems of padded (batch, heads, time, d_k) contiguous inputs with (batch or 1, q_len or 1, kv_len) mask
+            /// of any strides but the unit stride of kv_len
+            inline std::vector<AttentionProblem> padded_problems(const at::Tensor& q, const at::Tensor& k, const at::Tensor& v,
+                                                                 const at::Tensor& mask) {
+                auto n_batch = q.size(0);
+                auto heads = q.size(1);
+                auto q_len = q.size(2);
+                auto kv_len = k.size(2);
+                auto d = q.size(3);
+                auto kv_batch = k.size(0);
+                std::vector<AttentionProblem> ret;
+                ret.reserve(n_batch * heads);
+                for (std::int64_t b = 0; b < n_batch; ++b) {
+                    for (std::int64_t h = 0; h < heads; ++h) {
+                        auto kb = kv_batch == 1 ? 0 : b;
+                        AttentionProblem p;
+                        p.q = q.template data<float>() + (b * heads + h) * q_len * d;
+                        p.k = k.template data<float>() + (kb * heads + h) * kv_len * d;
+                        p.v = v.template data<float>() + (kb * heads + h) * kv_len * d;
+                        p.q_len = q_len;
+                        p.kv_len = kv_len;
+                        p.q_stride = d;
+                        p.kv_stride = d;
+                        p.mask = nullptr;
+                        p.mask_stride = 0;
+                        if (mask.defined()) {
+                            auto mb = mask.size(0) == 1 ? 0 : b;
+                            p.mask = mask.template data<std::uint8_t>() + mb * mask.stride(0);
+                            p.mask_stride = mask.size(1) == 1 ? 0 : mask.stride(1);
+                        }
+                        p.counter = static_cast<std::uint64_t>((b * heads + h) * q_len * kv_len);
+                        ret.push_back(p);
+                    }
+                }
+                return ret;
+            }
+
+            /// problems of packed (total, heads, d) contiguous inputs where each segment [offsets[s], offsets[s + 1])
+            /// attends to itself. the n-th problem is (segment n / heads, head n % heads)
+            inline std::vector<AttentionProblem> varlen_problems(const at::Tensor& q, const at::Tensor& k, const at::Tensor& v,
+                                                                 const std::vector<std::int64_t>& offsets) {
+                auto heads = q.size(1);
+                auto d = q.size(2);
+                std::vector<AttentionProblem> ret;
+                ret.reserve((offsets.size() - 1) * heads);
+                std::uint64_t counter = 0;
+                for (size_t s = 0; s + 1 < offsets.size(); ++s) {
+                    auto len = offsets[s + 1] - offsets[s];
+                    for (std::int64_t h = 0; h < heads; ++h) {
+                        auto row = (offsets[s] * heads + h) * d;
+                        AttentionProblem p;
+                        p.q = q.template data<float>() + row;
+                        p.k = k.template data<float>() + row;
+                        p.v = v.template data<float>() + row;
+                        p.q_len = len;
+                        p.kv_len = len;
+                        p.q_stride = heads * d;
+                        p.kv_stride = heads * d;
+                        p.mask = nullptr;
+                        p.mask_stride = 0;
+                        p.counter = counter;
+                        counter += static_cast<std::uint64_t>(len * len);
+                        ret.push_back(p);
+                    }
+                }
+                return ret;
+            }
+        } // namespace detail
+
+
+        class AttentionBackward : public torch::autograd::Function {
+        public:
+            at::Tensor q, k, v, mask, o, lse;
+            float scale, rate;
+            std::uint64_t seed;
+
+            torch::autograd::variable_list apply(torch::autograd::variable_list&& grads) override {
+                auto go = autograd::data(grads[0]);
+                if (!go.defined()) {
+                    return {torch::autograd::Variable(), torch::autograd::Variable(), torch::autograd::Variable()};
+                }
+                go = go.contiguous();
+                // broadcasted key/value are expanded to avoid racing their gradients
+                auto kx = this->k.expand({this->q.size(0), -1, -1, -1}).contiguous();
+                auto vx = this->v.expand({this->q.size(0), -1, -1, -1}).contiguous();
+                auto dq = at::zeros_like(this->q);
+                auto dk = at::zeros_like(kx);
+                auto dv = at::zeros_like(vx);
+                auto problems = detail::padded_problems(this->q, kx, vx, this->mask);
+                auto d = this->q.size(3);
+                auto q_len = this->q.size(2);
+                auto kv_len = kx.size(2);
+                at::parallel_for(0, problems.size(), 1, [&](std::int64_t begin, std::int64_t end) {
+                    for (auto n = begin; n < end; ++n) {
+                        detail::attention_backward(
+                            problems[n], d, this->scale, this->rate, this->seed,
+                            this->o.template data<float>() + n * q_len * d,
+                            go.template data<float>() + n * q_len * d, d,
+                            this->lse.template data<float>() + n * q_len,
+                            dq.template data<float>() + n * q_len * d,
+                            dk.template data<float>() + n * kv_len * d,
+                            dv.template data<float>() + n * kv_len * d);
+                    }
+                });
+                if (this->k.size(0) != dk.size(0)) {
+                    dk = dk.sum(0, true);
+                    dv = dv.sum(0, true);
+                }
+                return {torch::autograd::make_variable(dq), torch::autograd::make_variable(dk),
+                        torch::autograd::make_variable(dv)};
+            }
+
+            void release_variables() override {
+                this->q.reset();
+                this->k.reset();
+                this->v.reset();
+                this->mask.reset();
+                this->o.reset();
+                this->lse.reset();
+            }
+        };
+
+        /**
+           Fused scaled dot product attention softmax(q k^T / sqrt(d_k)) v without (time x time) score buffers.
+
+           q: (batch, heads, q_len, d_k), k/v: (batch or 1, heads, kv_len, d_k) float CPU tensors
+           mask: undefined or (batch or 1, q_len or 1, kv_len) byte tensor where 0 is masked out
+           returns (batch, heads, q_len, d_k)
+         */
+        inline at::Tensor attention(at::Tensor q, at::Tensor k, at::Tensor v, at::Tensor mask,
+                                    float dropout_rate = 0, bool training = false) {
+            AT_ASSERT(q.dim() == 4);
+            AT_ASSERT(k.dim() == 4);
+            AT_ASSERT(k.sizes() == v.sizes());
+            AT_ASSERT(k.size(0) == q.size(0) || k.size(0) == 1);
+            AT_ASSERT(q.scalar_type() == at::kFloat);
+            AT_ASSERT(!q.is_cuda());
+            auto fn = std::make_shared<AttentionBackward>();
+            fn->q = autograd::data(q).contiguous();
+            fn->k = autograd::data(k).contiguous();
+            fn->v = autograd::data(v).contiguous();
+            if (mask.defined()) {
+                AT_ASSERT(mask.scalar_type() == at::kByte);
+                AT_ASSERT(mask.dim() == 3);
+                AT_ASSERT(mask.size(2) == k.size(2));
+                // views (e.g., of net::MaskCache) are read by their strides without copying
+                auto m = autograd::data(mask);
+                fn->mask = m.stride(2) == 1 ? m : m.contiguous();
+            }
+            fn->scale = 1 / std::sqrt(static_cast<float>(q.size(3)));
+            fn->rate = training ? dropout_rate : 0;
+            fn->seed = fn->rate > 0 ? random::seed() : 0;
+            fn->o = at::empty_like(fn->q);
+            fn->lse = at::empty({q.size(0), q.size(1), q.size(2)}, fn->q.options());
+
+            auto problems = detail::padded_problems(fn->q, fn->k, fn->v, fn->mask);
+            auto d = q.size(3);
+            auto q_len = q.size(2);
+            at::parallel_for(0, problems.size(), 1, [&](std::int64_t begin, std::int64_t end) {
+                for (auto n = begin; n < end; ++n) {
+                    detail::attention_forward(problems[n], d, fn->scale, fn->rate, fn->seed,
+                                              fn->o.template data<float>() + n * q_len * d, d,
+                                              fn->lse.template data<float>() + n * q_len);
+                }
+            });
+            auto o = fn->o;
+            return autograd::make_outputs(fn, {q, k, v}, {o})[0];
+        }
+
+
+        class VarlenAttentionBackward : public torch::autograd::Function {
+        public:
+            at::Tensor q, k, v, o, lse;
+            std::vector<std::int64_t> offsets;
+            float scale, rate;
+            std::uint64_t seed;
+
+            torch::autograd::variable_list apply(torch::autograd::variable_list&& grads) override {
+                auto go = autograd::data(grads[0]);
+                if (!go.defined()) {
+                    return {torch::autograd::Variable(), torch::autograd::Variable(), torch::autograd::Variable()};
+                }
+                go = go.contiguous();
+                auto dq = at::zeros_like(this->q);
+                auto dk = at::zeros_like(this->k);
+                auto dv = at::zeros_like(this->v);
+                auto problems = detail::varlen_problems(this->q, this->k, this->v, this->offsets);
+                auto total = this->q.size(0);
+                auto heads = this->q.size(1);
+                auto d = this->q.size(2);
+                // problems write disjoint (rows, head) blocks of dq, dk and dv
+                at::parallel_for(0, problems.size(), 1, [&](std::int64_t begin, std::int64_t end) {
+                    for (auto n = begin; n < end; ++n) {
+                        auto s = n / heads;
+                        auto h = n % heads;
+                        auto row = (this->offsets[s] * heads + h) * d;
+                        detail::attention_backward(
+                            problems[n], d, this->scale, this->rate, this->seed,
+                            this->o.template data<float>() + row,
+                            go.template data<float>() + row, heads * d,
+                            this->lse.template data<float>() + h * total + this->offsets[s],
+                            dq.template data<float>() + row,
+                            dk.template data<float>() + row,
+                            dv.template data<float>() + row);
+                    }
+                });
+                return {torch::autograd::make_variable(dq), torch::autograd::make_variable(dk),
+                        torch::autograd::make_variable(dv)};
+            }
+
+            void release_variables() override {
+                this->q.reset();
+                this->k.reset();
+                this->v.reset();
+                this->o.reset();
+                this->lse.reset();
+            }
+        };
+
+        /**
+           Fused attention over packed variable-length sequences without padding.
+
+           q/k/v: (total, heads, d_k) float CPU tensors of concatenated sequences
+           offsets: cumulative lengths {0, len_0, len_0 + len_1, ..., total}. each sequence attends only to itself
+           returns (total, heads, d_k)
+         */
+        inline at::Tensor varlen_attention(at::Tensor q, at::Tensor k, at::Tensor v, at::IntList offsets,
+                                           float dropout_rate = 0, bool training = false) {
+            AT_ASSERT(q.dim() == 3);
+            AT_ASSERT(q.sizes() == k.sizes());
+            AT_ASSERT(k.sizes() == v.sizes());
+            AT_ASSERT(q.scalar_type() == at::kFloat);
+            AT_ASSERT(!q.is_cuda());
+            AT_ASSERT(offsets.size() >= 1 && offsets.front() == 0 && offsets.back() == q.size(0));
+            auto fn = std::make_shared<VarlenAttentionBackward>();
+            fn->q = autograd::data(q).contiguous();
+            fn->k = autograd::data(k).contiguous();
+            fn->v = autograd::data(v).contiguous();
+            fn->offsets = offsets.vec();
+            fn->scale = 1 / std::sqrt(static_cast<float>(q.size(2)));
+            fn->rate = training ? dropout_rate : 0;
+            fn->seed = fn->rate > 0 ? random::seed() : 0;
+            fn->o = at::empty_like(fn->q);
+            // (heads, total) so that rows of a problem are contiguous
+            fn->lse = at::empty({q.size(1), q.size(0)}, fn->q.options());
+
+            auto problems = detail::varlen_problems(fn->q, fn->k, fn->v, fn->offsets);
+            auto total = q.size(0);
+            auto heads = q.size(1);
+            auto d = q.size(2);
+            at::parallel_for(0, problems.size(), 1, [&](std::int64_t begin, std::int64_t end) {
+                for (auto n = begin; n < end; ++n) {
+                    auto s = n / heads;
+                    auto h = n % heads;
+                    detail::attention_forward(problems[n], d, fn->scale, fn->rate, fn->seed,
+                                              fn->o.template data<float>() + (fn->offsets[s] * heads + h) * d, heads * d,
+                                              fn->lse.template data<float>() + h * total + fn->offsets[s]);
+                }
+            });
+            auto o = fn->o;
+            return autograd::make_outputs(fn, {q, k, v}, {o})[0];
+        }
+
+
+
+        namespace detail {
+            /// merge Welford statistics (count, mean, m2) of b into a (Chan et al.)
+            inline void merge_moments(float& count, float& mean, float& m2, float count_b, float mean_b, float m2_b) {
+                auto n = count + count_b;
+                auto delta = mean_b - mean;
+                mean += delta * count_b / n;
+                m2 += m2_b + delta * delta * count * count_b / n;
+                count = n;
+            }
+
+            /// one pass Welford mean and sum of squared deviations of v = x + r (r is optional). v is written to s if r is given
+            inline void add_moments(const float* x, const float* r, float* s, std::int64_t n, float& mean, float& m2) {
+                std::int64_t j = 0;
+                float count = 0;
+                mean = 0;
+                m2 = 0;
+#if defined(__AVX__)
+                if (n >= 16) {
+                    auto vmean = _mm256_setzero_ps();
+                    auto vm2 = _mm256_setzero_ps();
+                    float lane_count = 0;
+                    for (; j + 8 <= n; j += 8) {
+                        auto v = _mm256_loadu_ps(x + j);
+                        if (r) {
+                            v = _mm256_add_ps(v, _mm256_loadu_ps(r + j));
+                            _mm256_storeu_ps(s + j, v);
+                        }
+                        lane_count += 1;
+                        auto delta = _mm256_sub_ps(v, vmean);
+                        vmean = simd::fmadd(delta, _mm256_set1_ps(1 / lane_count), vmean);
+                        vm2 = simd::fmadd(delta, _mm256_sub_ps(v, vmean), vm2);
+                    }
+                    float lm[8], lm2[8];
+                    _mm256_storeu_ps(lm, vmean);
+                    _mm256_storeu_ps(lm2, vm2);
+                    count = lane_count;
+                    mean = lm[0];
+                    m2 = lm2[0];
+                    for (int l = 1; l < 8; ++l) {
+                        merge_moments(count, mean, m2, lane_count, lm[l], lm2[l]);
+                    }
+                }
+#endif
+                for (; j < n; ++j) {
+                    auto v = x[j];
+                    if (r) {
+                        v += r[j];
+                        s[j] = v;
+                    }
+                    count += 1;
+                    auto delta = v - mean;
+                    mean += delta / count;
+                    m2 += delta * (v - mean);
+                }
+            }
+
+            /// y = gamma * (v - mean) * rstd + beta. null gamma and beta for y = (v - mean) * rstd
+            inline void normalize(const float* v, const float* gamma, const float* beta, float mean, float rstd,
+                                  float* y, std::int64_t n) {
+                std::int64_t j = 0;
+#if defined(__AVX__)
+                auto vmean = _mm256_set1_ps(mean);
+                auto vrstd = _mm256_set1_ps(rstd);
+                for (; j + 8 <= n; j += 8) {
+                    auto xhat = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(v + j), vmean), vrstd);
+                    if (gamma) {
+                        xhat = simd::fmadd(xhat, _mm256_loadu_ps(gamma + j), _mm256_loadu_ps(beta + j));
+                    }
+                    _mm256_storeu_ps(y + j, xhat);
+                }
+#endif
+                if (gamma) {
+                    for (; j < n; ++j) {
+                        y[j] = gamma[j] * (v[j] - mean) * rstd + beta[j];
+                    }
+                } else {
+                    for (; j < n; ++j) {
+                        y[j] = (v[j] - mean) * rstd;
+                    }
+                }
+            }
+        } // namespace detail
+
+
+        class LayerNormBackward : public torch::autograd::Function {
+        public:
+            /// normalized input (x + residual) of (rows, features)
+            at::Tensor v, mean, rstd, gamma;
+            bool has_residual;
+            std::vector<std::int64_t> input_sizes;
+
+            torch::autograd::variable_list apply(torch::autograd::variable_list&& grads) override {
+                auto gy = autograd::data(grads[0]);
+                auto gs = this->has_residual ? autograd::data(grads[1]) : at::Tensor();
+                auto rows = this->v.size(0);
+                auto n = this->v.size(1);
+                auto dv = at::zeros_like(this->v);
+                // partial sums of dgamma/dbeta to reduce rows without races
+                auto n_chunks = std::min<std::int64_t>(rows, 64);
+                auto partial = at::zeros({2, n_chunks, n}, this->v.options());
+                if (gy.defined()) {
+                    gy = gy.contiguous().view({rows, n});
+                    auto pv = this->v.template data<float>();
+                    auto pg = this->gamma.defined() ? this->gamma.template data<float>() : nullptr;
+                    auto pgy = gy.template data<float>();
+                    auto pdv = dv.template data<float>();
+                    auto pdgamma = partial[0].template data<float>();
+                    auto pdbeta = partial[1].template data<float>();
+                    at::parallel_for(0, n_chunks, 1, [&](std::int64_t begin, std::int64_t end) {
+                        for (auto c = begin; c < end; ++c) {
+                            auto dgamma = pdgamma + c * n;
+                            auto dbeta = pdbeta + c * n;
+                            for (auto i = c * rows / n_chunks; i < (c + 1) * rows / n_chunks; ++i) {
+                                auto vi = pv + i * n;
+                                auto gyi = pgy + i * n;
+                                auto dvi = pdv + i * n;
+                                auto mean = this->mean.template data<float>()[i];
+                                auto rstd = this->rstd.template data<float>()[i];
+                                float a = 0, b = 0;
+                                for (std::int64_t j = 0; j < n; ++j) {
+                                    auto xhat = (vi[j] - mean) * rstd;
+                                    auto g = pg ? gyi[j] * pg[j] : gyi[j];
+                                    a += g;
+                                    b += g * xhat;
+                                    dgamma[j] += gyi[j] * xhat;
+                                    dbeta[j] += gyi[j];
+                                }
+                                // derivative of the unbiased std
+                                a /= n;
+                                b /= n - 1;
+                                for (std::int64_t j = 0; j < n; ++j) {
+                                    auto xhat = (vi[j] - mean) * rstd;
+                                    dvi[j] = rstd * ((pg ? gyi[j] * pg[j] : gyi[j]) - a - xhat * b);
+                                }
+                            }
+                        }
+                    });
+                }
+                if (gs.defined()) {
+                    dv += gs.contiguous().view({rows, n});
+                }
+                auto sizes = this->input_sizes;
+                auto dx = torch::autograd::make_variable(dv.view(sizes));
+                // NOTE: do not share a grad tensor that can be accumulated in-place
+                auto dr = this->has_residual ? torch::autograd::make_variable(dv.view(sizes).clone()) : torch::autograd::Variable();
+                if (!this->gamma.defined()) {
+                    return {dx, dr, torch::autograd::Variable(), torch::autograd::Variable()};
+                }
+                auto dsum = partial.sum(1);
+                return {dx, dr, torch::autograd::make_variable(dsum[0]), torch::autograd::make_variable(dsum[1])};
+            }
+
+            void release_variables() override {
+                this->v.reset();
+                this->mean.reset();
+                this->rstd.reset();
+                this->gamma.reset();
+            }
+        };
+
+        /**
+           Fused LayerNorm over the last dim: gamma * (v - mean(v)) / std(v) + beta where v = x + residual.
+
+           std is unbiased without eps as net::LayerNorm. residual can be undefined. undefined gamma and beta
+           skip the affine transform (e.g., folded into the next Linear).
+           returns (normalized, v) where v is undefined without residual
+         */
+        inline std::tuple<at::Tensor, at::Tensor> layer_norm(at::Tensor x, at::Tensor residual, at::Tensor gamma, at::Tensor beta) {
+            AT_ASSERT(x.scalar_type() == at::kFloat);
+            AT_ASSERT(!x.is_cuda());
+            auto n = x.size(-1);
+            AT_ASSERT(gamma.defined() == beta.defined());
+            AT_ASSERT(!gamma.defined() || (gamma.numel() == n && beta.numel() == n));
+            auto rows = x.numel() / n;
+            auto fn = std::make_shared<LayerNormBackward>();
+            fn->input_sizes = x.sizes().vec();
+            fn->has_residual = residual.defined();
+            auto xd = autograd::data(x).contiguous().view({rows, n});
+            at::Tensor rd;
+            if (fn->has_residual) {
+                AT_ASSERT(residual.sizes() == x.sizes());
+                rd = autograd::data(residual).contiguous().view({rows, n});
+                fn->v = at::empty_like(xd);
+            } else {
+                fn->v = xd;
+            }
+            at::Tensor bd;
+            if (gamma.defined()) {
+                fn->gamma = autograd::data(gamma).contiguous();
+                bd = autograd::data(beta).contiguous();
+            }
+            fn->mean = at::empty({rows}, xd.options());
+            fn->rstd = at::empty({rows}, xd.options());
+            auto y = at::empty_like(xd);
+
+            auto px = xd.template data<float>();
+            auto pr = fn->has_residual ? rd.template data<float>() : nullptr;
+            auto pv = fn->v.template data<float>();
+            auto py = y.template data<float>();
+            auto pmean = fn->mean.template data<float>();
+            auto prstd = fn->rstd.template data<float>();
+            auto pg = bd.defined() ? fn->gamma.template data<float>() : nullptr;
+            auto pb = bd.defined() ? bd.template data<float>() : nullptr;
+            at::parallel_for(0, rows, 16, [&](std::int64_t begin, std::int64_t end) {
+                for (auto i = begin; i < end; ++i) {
+                    float mean, m2;
+                    detail::add_moments(px + i * n, pr ? pr + i * n : nullptr, pv + i * n, n, mean, m2);
+                    auto rstd = 1 / std::sqrt(m2 / (n - 1));
+                    pmean[i] = mean;
+                    prstd[i] = rstd;
+                    detail::normalize(pv + i * n, pg, pb, mean, rstd, py + i * n, n);
+                }
+            });
+            auto v = fn->has_residual ? fn->v.view(x.sizes()) : at::Tensor();
+            auto outputs = autograd::make_outputs(fn, {x, residual, gamma, beta}, {y.view(x.sizes()), v});
+            return std::make_tuple(outputs[0], outputs[1]);
+        }
+
+
+        namespace detail {
+            /// label-smoothed target distribution: `on` at the target and `off` elsewhere
+            struct SmoothedTarget {
+                double on, off, entropy;
+
+                SmoothedTarget(float smoothing, std::int64_t n_class) {
+                    this->on = 1.0 - smoothing;
+                    this->off = smoothing / (n_class - 1);
+                    // sum_j q_j log q_j with 0 log 0 = 0
+                    this->entropy = (this->on > 0 ? this->on * std::log(this->on) : 0.0)
+                        + (this->off > 0 ? smoothing * std::log(this->off) : 0.0);
+                }
+            };
+
+            /// (batch, n_class) logits of rows [begin, end) in fp32
+            inline at::Tensor chunk_logits(const at::Tensor& h, const at::Tensor& weight, const at::Tensor& bias,
+                                           std::int64_t begin, std::int64_t end) {
+                auto hc = h.slice(0, begin, end).to(at::kFloat);
+                auto w = weight.to(at::kFloat);
+                return bias.defined() ? at::addmm(bias.to(at::kFloat), hc, w.t()) : hc.mm(w.t());
+            }
+        } // namespace detail
+
+        /// recompute each chunk of logits for the gradient softmax(z) - q
+        class LinearLabelSmoothingBackward : public torch::autograd::Function {
+        public:
+            at::Tensor h, weight, bias, target, n_valid;
+            float smoothing;
+            std::int64_t ignore_index, chunk;
+
+            torch::autograd::variable_list apply(torch::autograd::variable_list&& grads) override {
+                auto g = autograd::data(grads[0]);
+                if (!g.defined()) {
+                    return {torch::autograd::Variable(), torch::autograd::Variable(), torch::autograd::Variable()};
+                }
+                auto n_class = this->weight.size(0);
+                detail::SmoothedTarget q(this->smoothing, n_class);
+                auto scale = g.to(at::kFloat) / this->n_valid;
+                auto dh = at::empty(this->h.sizes(), this->h.options().dtype(at::kFloat));
+                auto dw = at::zeros(this->weight.sizes(), this->weight.options().dtype(at::kFloat));
+                auto db = at::zeros({n_class}, dw.options());
+                for (std::int64_t begin = 0; begin < this->h.size(0); begin += this->chunk) {
+                    auto end = std::min(begin + this->chunk, this->h.size(0));
+                    auto t = this->target.slice(0, begin, end);
+                    auto valid = t != this->ignore_index;
+                    auto dz = detail::chunk_logits(this->h, this->weight, this->bias, begin, end).softmax(1).sub_(q.off);
+                    auto on = at::full({t.size(0), 1}, q.off - q.on, dz.options());
+                    dz.scatter_add_(1, t.masked_fill(valid == 0, 0).unsqueeze(1), on);
+                    dz.mul_((valid.to(at::kFloat) * scale).unsqueeze(1));
+                    dh.slice(0, begin, end).copy_(dz.mm(this->weight.to(at::kFloat)));
+                    dw.add_(dz.t().mm(this->h.slice(0, begin, end).to(at::kFloat)));
+                    db.add_(dz.sum(0));
+                }
+                return {torch::autograd::make_variable(dh.to(this->h.scalar_type())),
+                        torch::autograd::make_variable(dw.to(this->weight.scalar_type())),
+                        this->bias.defined() ? torch::autograd::make_variable(db.to(this->bias.scalar_type()))
+                                             : torch::autograd::Variable()};
+            }
+
+            void release_variables() override {
+                this->h.reset();
+                this->weight.reset();
+                this->bias.reset();
+                this->target.reset();
+                this->n_valid.reset();
+            }
+        };
+
+        /**
+           Label-smoothed KL divergence of softmax(h W^T + b) averaged over non-ignored targets.
+
+           The KL is computed in closed form from log-sum-exp, the target logit and the sum of logits,
+           and logits are computed `chunk` rows at a time, so neither forward nor backward keeps
+           a buffer of (rows, n_class).
+
+           h: (rows, d) features, weight: (n_class, d), bias: (n_class) or undefined, target: (rows) long
+           returns (loss, the number of correct argmax predictions)
+         */
+        inline std::tuple<at::Tensor, at::Tensor> linear_label_smoothing(at::Tensor h, at::Tensor weight, at::Tensor bias,
+                                                                         at::Tensor target, float smoothing,
+                                                                         std::int64_t ignore_index, std::int64_t chunk = 512) {
+            AT_ASSERT(h.dim() == 2);
+            AT_ASSERT(target.dim() == 1 && target.size(0) == h.size(0));
+            AT_ASSERT(0 <= smoothing && smoothing <= 1);
+            AT_ASSERT(chunk > 0);
+            auto fn = std::make_shared<LinearLabelSmoothingBackward>();
+            fn->h = autograd::data(h).contiguous();
+            fn->weight = autograd::data(weight);
+            fn->bias = autograd::data(bias);
+            fn->target = autograd::data(target);
+            fn->smoothing = smoothing;
+            fn->ignore_index = ignore_index;
+            fn->chunk = chunk;
+            fn->n_valid = (fn->target != ignore_index).sum().to(at::kFloat);
+
+            auto n_class = weight.size(0);
+            detail::SmoothedTarget q(smoothing, n_class);
+            auto loss = at::zeros({}, fn->h.options().dtype(at::kFloat));
+            auto correct = at::zeros({}, fn->target.options());
+            for (std::int64_t begin = 0; begin < h.size(0); begin += chunk) {
+                auto end = std::min(begin + chunk, h.size(0));
+                auto t = fn->target.slice(0, begin, end);
+                auto valid = t != ignore_index;
+                auto z = detail::chunk_logits(fn->h, fn->weight, fn->bias, begin, end);
+                auto lse = z.logsumexp(1);
+                auto logp_t = z.gather(1, t.masked_fill(valid == 0, 0).unsqueeze(1)).squeeze(1) - lse;
+                auto sum_logp = z.sum(1) - lse * n_class;
+                // sum_j q_j (log q_j - log p_j)
+                auto kl = q.entropy - (q.on - q.off) * logp_t - q.off * sum_logp;
+                loss.add_(kl.masked_fill_(valid == 0, 0).sum());
+                correct.add_((z.argmax(1) == t).__and__(valid).sum());
+            }
+            loss.div_(fn->n_valid);
+            auto outputs = autograd::make_outputs(fn, {h, weight, bias}, {loss});
+            return std::make_tuple(outputs[0], torch::autograd::make_variable(correct, false));
+        }
+
+
+        /// int8 weight of a linear layer with per output channel scales: weight ~= int8 * scale
+        struct QuantizedWeight {
+            /// (out, in) int8
+            at::Tensor weight;
+            /// (out) float
+            at::Tensor scale;
+
+            bool defined() const {
+                return this->weight.defined();
+            }
+        };
+
+        /// symmetric per-channel quantization of a (out, in) float weight
+        inline QuantizedWeight quantize_per_channel(at::Tensor w) {
+            w = autograd::data(w).contiguous();
+            AT_ASSERT(w.dim() == 2);
+            AT_ASSERT(w.scalar_type() == at::kFloat);
+            QuantizedWeight ret;
+            ret.scale = (std::get<0>(w.abs().max(1)) / 127).clamp_min(std::numeric_limits<float>::min());
+            ret.weight = (w / ret.scale.unsqueeze(1)).round_().clamp_(-127, 127).to(at::kChar);
+            return ret;
+        }
+
+        /**
+           y = x W^T + b by int8 GEMM for inference (no backward).
+           activations are quantized dynamically per row into 16-bit integers in [-127, 127],
+           so that AVX2 madd (or VNNI dpwssd) accumulates products without saturation.
+        */
+        inline at::Tensor quantized_linear(at::Tensor x, const QuantizedWeight& w, at::Tensor bias) {
+            AT_ASSERT(w.defined());
+            auto xd = autograd::data(x).contiguous();
+            AT_ASSERT(xd.scalar_type() == at::kFloat);
+            auto n_in = w.weight.size(1);
+            auto n_out = w.weight.size(0);
+            AT_ASSERT(xd.size(-1) == n_in);
+            auto rows = xd.numel() / n_in;
+
+            auto xq = at::empty({rows, n_in}, at::kShort);
+            auto xs = at::empty({rows}, at::kFloat);
+            auto px = xd.template data<float>();
+            auto pxq = xq.template data<std::int16_t>();
+            auto pxs = xs.template data<float>();
+            at::parallel_for(0, rows, 16, [&](std::int64_t begin, std::int64_t end) {
+                for (auto r = begin; r < end; ++r) {
+                    auto xr = px + r * n_in;
+                    auto scale = std::max(simd::max_abs(xr, n_in) / 127, std::numeric_limits<float>::min());
+                    pxs[r] = scale;
+                    for (std::int64_t i = 0; i < n_in; ++i) {
+                        pxq[r * n_in + i] = static_cast<std::int16_t>(std::nearbyint(xr[i] / scale));
+                    }
+                }
+            });
+
+            auto y = at::empty({rows, n_out}, at::kFloat);
+            auto py = y.template data<float>();
+            auto pw = w.weight.template data<std::int8_t>();
+            auto pws = w.scale.template data<float>();
+            auto bd = bias.defined() ? autograd::data(bias).contiguous() : at::Tensor();
+            auto pb = bd.defined() ? bd.template data<float>() : nullptr;
+            // blocks of output channels are shared by threads and swept by blocks of rows, so that the weight
+            // block stays in cache over all the rows. tiles of tile_rows x tile_out reuse loaded registers
+            constexpr std::int64_t block_out = 64, block_rows = 64;
+            constexpr int tile_rows = 2, tile_out = 4;
+            // y[r][o] of the tile (r0, o0) of R x C
+            auto tile = [&](auto& c, std::int64_t r0, std::int64_t o0) {
+                constexpr int R = std::extent<std::remove_reference_t<decltype(c)>, 0>::value;
+                constexpr int C = std::extent<std::remove_reference_t<decltype(c)>, 1>::value;
+                simd::dot_tile<R, C>(pxq + r0 * n_in, n_in, pw + o0 * n_in, n_in, n_in, c);
+                for (int r = 0; r < R; ++r) {
+                    for (int j = 0; j < C; ++j) {
+                        auto o = o0 + j;
+                        py[(r0 + r) * n_out + o] = c[r][j] * pxs[r0 + r] * pws[o] + (pb ? pb[o] : 0.0f);
+                    }
+                }
+            };
+            at::parallel_for(0, (n_out + block_out - 1) / block_out, 1, [&](std::int64_t begin, std::int64_t end) {
+                for (auto ob = begin; ob < end; ++ob) {
+                    auto o_begin = ob * block_out;
+                    auto o_end = std::min(o_begin + block_out, n_out);
+                    for (std::int64_t r_begin = 0; r_begin < rows; r_begin += block_rows) {
+                        auto r_end = std::min(r_begin + block_rows, rows);
+                        auto o = o_begin;
+                        for (; o + tile_out <= o_end; o += tile_out) {
+                            auto r = r_begin;
+                            for (; r + tile_rows <= r_end; r += tile_rows) {
+                                std::int32_t c[tile_rows][tile_out];
+                                tile(c, r, o);
+                            }
+                            for (; r < r_end; ++r) {
+                                std::int32_t c[1][tile_out];
+                                tile(c, r, o);
+                            }
+                        }
+                        for (; o < o_end; ++o) {
+                            auto r = r_begin;
+                            for (; r + tile_rows <= r_end; r += tile_rows) {
+                                std::int32_t c[tile_rows][1];
+                                tile(c, r, o);
+                            }
+                            for (; r < r_end; ++r) {
+                                std::int32_t c[1][1];
+                                tile(c, r, o);
+                            }
+                        }
+                    }
+                }
+            });
+            auto sizes = xd.sizes().vec();
+            sizes.back() = n_out;
+            return torch::autograd::make_variable(y.view(sizes), false);
+        }
+
+
+        namespace pointwise {
+            enum class Kind { dropout, relu, sigmoid, tanh };
+
+            /// one elementwise stage of pointwise_chain
+            struct Op {
+                Kind kind;
+                /// dropout rate (0 in eval)
+                float rate = 0;
+                /// dropout random numbers are drawn from (seed, element index)
+                std::uint64_t seed = 0;
+            };
+
+            /// apply `ops` to `v` of the `i`-th element in place. returns d(output)/d(input) if Grad or 1
+            template <bool Grad>
+            inline float chain(const std::vector<Op>& ops, std::int64_t i, float& v) {
+                float d = 1;
+                for (const auto& op : ops) {
+                    switch (op.kind) {
+                    case Kind::dropout:
+                        if (op.rate > 0) {
+                            auto u = random::uniform(op.seed, static_cast<std::uint64_t>(i));
+                            auto m = u < op.rate ? 0 : 1 / (1 - op.rate);
+                            v *= m;
+                            if (Grad) d *= m;
+                        }
+                        break;
+                    case Kind::relu:
+                        if (v <= 0) {
+                            v = 0;
+                            if (Grad) d = 0;
+                        }
+                        break;
+                    case Kind::sigmoid:
+                        v = 1 / (1 + std::exp(-v));
+                        if (Grad) d *= v * (1 - v);
+                        break;
+                    case Kind::tanh:
+                        v = std::tanh(v);
+                        if (Grad) d *= 1 - v * v;
+                        break;
+                    }
+                }
+                return d;
+            }
+        } // namespace pointwise
+
+        /// recompute the chain from its input instead of storing the intermediates
+        class PointwiseChainBackward : public torch::autograd::Function {
+        public:
+            at::Tensor x;
+            std::vector<pointwise::Op> ops;
+
+            torch::autograd::variable_list apply(torch::autograd::variable_list&& grads) override {
+                auto gy = autograd::data(grads[0]);
+                if (!gy.defined()) {
+                    return {torch::autograd::Variable()};
+                }
+                gy = gy.contiguous();
+                auto gx = at::empty_like(this->x);
+                auto px = this->x.template data<float>();
+                auto pgy = gy.template data<float>();
+                auto pgx = gx.template data<float>();
+                at::parallel_for(0, this->x.numel(), 2048, [&](std::int64_t begin, std::int64_t end) {
+                    for (auto i = begin; i < end; ++i) {
+                        auto v = px[i];
+                        pgx[i] = pgy[i] * pointwise::chain<true>(this->ops, i, v);
+                    }
+                });
+                return {torch::autograd::make_variable(gx)};
+            }
+
+            void release_variables() override {
+                this->x.reset();
+            }
+        };
+
+        /**
+           Elementwise stages `ops` (e.g., dropout -> relu) over float CPU `x` in one pass without intermediates.
+           Backward recomputes the stages from the saved input. used by meta::sequential
+
+           NOTE: dropout masks come from random::seed() instead of at::bernoulli, so they differ from
+           torch::nn::Dropout for the same global seed (but are replayed by checkpoint)
+        */
+        inline at::Tensor pointwise_chain(at::Tensor x, const std::vector<pointwise::Op>& ops) {
+            AT_ASSERT(x.scalar_type() == at::kFloat);
+            AT_ASSERT(!x.is_cuda());
+            auto fn = std::make_shared<PointwiseChainBackward>();
+            fn->x = autograd::data(x).contiguous();
+            fn->ops = ops;
+            auto y = at::empty_like(fn->x);
+            auto px = fn->x.template data<float>();
+            auto py = y.template data<float>();
+            at::parallel_for(0, y.numel(), 2048, [&](std::int64_t begin, std::int64_t end) {
+                for (auto i = begin; i < end; ++i) {
+                    auto v = px[i];
+                    pointwise::chain<false>(fn->ops, i, v);
+                    py[i] = v;
+                }
+            });
+            return autograd::make_outputs(fn, {x}, {y})[0];
+        }
+
+
+        using CheckpointFn = std::function<std::vector<at::Tensor>(const std::vector<at::Tensor>&)>;
+
+        /// recompute the checkpointed function with grad enabled and backpropagate through it
+        class CheckpointBackward : public torch::autograd::Function {
+        public:
+            CheckpointFn fn;
+            /// data of the inputs. activations inside `fn` are not stored
+            std::vector<at::Tensor> inputs;
+            std::vector<bool> input_requires_grad;
+            std::uint64_t seed;
+
+            torch::autograd::variable_list apply(torch::autograd::variable_list&& grads) override {
+                std::vector<at::Tensor> xs;
+                for (size_t i = 0; i < this->inputs.size(); ++i) {
+                    auto& t = this->inputs[i];
+                    xs.push_back(t.defined() ? torch::autograd::make_variable(t, this->input_requires_grad[i]) : t);
+                }
+                std::vector<at::Tensor> ys;
+                {
+                    torch::autograd::AutoGradMode enable_grad(true);
+                    // replay the random numbers (e.g., dropout masks) drawn in forward
+                    auto next = random::seed();
+                    torch::manual_seed(this->seed);
+                    ys = this->fn(xs);
+                    torch::manual_seed(next);
+                }
+                torch::autograd::edge_list roots;
+                torch::autograd::variable_list root_grads;
+                for (size_t i = 0; i < ys.size(); ++i) {
+                    if (ys[i].defined() && ys[i].is_variable() && ys[i].requires_grad() && grads[i].defined()) {
+                        roots.push_back(torch::autograd::as_variable_ref(ys[i]).gradient_edge());
+                        root_grads.push_back(grads[i]);
+                    }
+                }
+                if (!roots.empty()) {
+                    // parameters used in `fn` accumulate their gradients here
+                    torch::autograd::Engine::get_default_engine().execute(roots, root_grads, false, false);
+                }
+                torch::autograd::variable_list ret;
+                for (auto& x : xs) {
+                    auto g = x.defined() ? x.grad() : at::Tensor();
+                    ret.push_back(g.defined() ? torch::autograd::as_variable_ref(g) : torch::autograd::Variable());
+                }
+                return ret;
+            }
+
+            void release_variables() override {
+                this->inputs.clear();
+                this->fn = nullptr;
+            }
+        };
+
+        /**
+           Activation checkpointing: `fn(inputs)` runs without storing its intermediates and is run again in backward.
+           The global generator is reseeded before both runs so that dropout masks are replayed exactly.
+
+           NOTE:
+           - gradients of the parameters in `fn` flow only when any of `inputs` requires grad
+           - reseeding makes concurrent training threads share the global generator state
+        */
+        inline std::vector<at::Tensor> checkpoint(CheckpointFn fn, std::vector<at::Tensor> inputs) {
+            if (!autograd::requires_grad(inputs)) {
+                return fn(inputs);
+            }
+            auto f = std::make_shared<CheckpointBackward>();
+            f->seed = random::seed();
+            std::vector<at::Tensor> outputs;
+            {
+                torch::NoGradGuard no_grad;
+                torch::manual_seed(f->seed);
+                outputs = fn(inputs);
+            }
+            for (auto& t : inputs) {
+                f->inputs.push_back(autograd::data(t));
+                f->input_requires_grad.push_back(t.defined() && t.is_variable() && t.requires_grad());
+            }
+            for (auto& o : outputs) {
+                o = autograd::data(o);
+            }
+            f->fn = std::move(fn);
+            auto vs = autograd::make_outputs(f, inputs, outputs);
+            return std::vector<at::Tensor>(vs.begin(), vs.end());
+        }
+
+    } // namespace kernel
+
+} // namespace thxx
@@ -5,6 +5,9 @@
 #include <tuple>
 #include <type_traits>
 #include <utility>
+#include <vector>
+
+#include "kernel.hpp"
 
 
 namespace thxx {
@@ -74,19 +77,6 @@ namespace thxx {
                     this->template register_modules<i + 1>(std::forward<Args>(args)...);
                 }
             };
-
-            static auto sequential_impl() {
-                return [](auto&& x) { return std::move(x); };  // avoid copy
-            }
-
-            template <typename A, typename ... Args>
-            auto sequential_impl(A&& a, Args&& ... args) {
-                return
-                    [=](auto&& ... x) mutable {
-                        return sequential_impl(std::forward<Args>(args)...)(
-                            a->forward(std::forward<decltype(x)>(x)...));
-                    };
-            }
         }
 
         template <typename Func>
@@ -100,9 +90,99 @@ namespace thxx {
             return Lambda<Func>(std::forward<Func>(f));
         }
 
+        /// elementwise activations recognized by sequential at compile time, e.g., lambda(meta::Relu())
+        struct Relu {
+            static constexpr auto kind = kernel::pointwise::Kind::relu;
+            at::Tensor operator()(const at::Tensor& x) const { return torch::relu(x); }
+        };
+
+        struct Sigmoid {
+            static constexpr auto kind = kernel::pointwise::Kind::sigmoid;
+            at::Tensor operator()(const at::Tensor& x) const { return torch::sigmoid(x); }
+        };
+
+        struct Tanh {
+            static constexpr auto kind = kernel::pointwise::Kind::tanh;
+            at::Tensor operator()(const at::Tensor& x) const { return torch::tanh(x); }
+        };
+
+        namespace detail {
+            /// the functors above
+            template <typename F, typename = void>
+            struct is_pointwise_func : std::false_type {};
+            template <typename F>
+            struct is_pointwise_func<F, std::void_t<decltype(F::kind)>> : std::true_type {};
+
+            /// stages that sequential can fuse into kernel::pointwise_chain
+            template <typename M> struct is_pointwise : std::false_type {};
+            template <> struct is_pointwise<torch::nn::Dropout> : std::true_type {};
+            template <typename F> struct is_pointwise<Lambda<F>> : is_pointwise_func<std::decay_t<F>> {};
+
+            /// append the op of `stage` to `ops`
+            inline void pointwise_op(const torch::nn::Dropout& stage, std::vector<kernel::pointwise::Op>& ops) {
+                kernel::pointwise::Op op{kernel::pointwise::Kind::dropout};
+                op.rate = stage->is_training() ? stage->options.rate() : 0;
+                ops.push_back(op);
+            }
+
+            template <typename F>
+            void pointwise_op(const Lambda<F>&, std::vector<kernel::pointwise::Op>& ops) {
+                ops.push_back({std::decay_t<F>::kind});
+            }
+
+            /// run pointwise `stages` by one kernel::pointwise_chain if possible or one by one
+            template <typename ... Stages>
+            at::Tensor pointwise_forward(std::tuple<Stages...>& stages, at::Tensor x) {
+                if constexpr (sizeof...(Stages) > 1) {
+                    if (x.is_variable() && !x.is_cuda() && x.scalar_type() == at::kFloat) {
+                        std::vector<kernel::pointwise::Op> ops;
+                        std::apply([&](auto& ... s) { (pointwise_op(s, ops), ...); }, stages);
+                        for (auto& op : ops) {
+                            if (op.rate > 0) op.seed = kernel::random::seed();
+                        }
+                        return kernel::pointwise_chain(x, ops);
+                    }
+                }
+                std::apply([&](auto& ... s) { ((x = s->forward(x)), ...); }, stages);
+                return x;
+            }
+
+            /// consecutive pointwise stages are collected in `run` and fused at the end of the run
+            template <typename ... Run>
+            auto sequential_impl(std::tuple<Run...> run) {
+                if constexpr (sizeof...(Run) == 0) {
+                    return [](auto&& x) { return std::move(x); };  // avoid copy
+                } else {
+                    return [=](auto&& x) mutable { return pointwise_forward(run, x); };
+                }
+            }
+
+            template <typename ... Run, typename A, typename ... Args>
+            auto sequential_impl(std::tuple<Run...> run, A&& a, Args&& ... args) {
+                if constexpr (is_pointwise<std::decay_t<A>>::value) {
+                    return sequential_impl(std::tuple_cat(run, std::make_tuple(a)), std::forward<Args>(args)...);
+                } else if constexpr (sizeof...(Run) > 0) {
+                    auto rest = sequential_impl(std::tuple<>(), std::forward<A>(a), std::forward<Args>(args)...);
+                    return [=](auto&& x) mutable { return rest(pointwise_forward(run, x)); };
+                } else {
+                    auto rest = sequential_impl(std::tuple<>(), std::forward<Args>(args)...);
+                    return
+                        [=](auto&& ... x) mutable {
+                            return rest(a->forward(std::forward<decltype(x)>(x)...));
+                        };
+                }
+            }
+        }
+
+        /**
+           Chain of modules applied in order. Consecutive pointwise stages (torch::nn::Dropout and
+           Lambda of meta::Relu, meta::Sigmoid or meta::Tanh) are detected at compile time and run as one
+           kernel::pointwise_chain on float CPU variables, e.g., Dropout -> Relu in positionwise_feedforward.
+           Otherwise (or for other functions such as lambda(torch::relu)) they run one by one as written.
+         */
         template <typename ... Args>
         auto sequential(Args&& ... args) {
-            auto ret = lambda(detail::sequential_impl(args...));
+            auto ret = lambda(detail::sequential_impl(std::tuple<>(), args...));
             ret->template register_modules<0>(std::forward<Args>(args)...);
             return ret;
         }
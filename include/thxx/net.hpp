@@ -11,25 +11,136 @@
 #pragma once
 
 #include <torch/torch.h>
+#include <algorithm>
 #include <cmath>
 #include <limits>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
 
+#include "kernel.hpp"
 #include "meta.hpp"
 
 namespace thxx {
 
     namespace net {
 
-        double accuracy(torch::Tensor output, torch::Tensor target, std::int64_t ignore_label) {
+        /// the number of correct argmax predictions of non-ignored targets as a device tensor (no host sync)
+        static torch::Tensor count_correct(torch::Tensor output, torch::Tensor target, std::int64_t ignore_label) {
             AT_ASSERT(target.dim() + 1 == output.dim());
             for (std::int64_t i = 0; i < target.dim(); ++i) {
                 AT_ASSERT(target.size(i) == output.size(i));
             }
-            auto pred = output.argmax(-1);
             auto mask = target != ignore_label;
-            auto num = torch::sum(pred.masked_select(mask) == target.masked_select(mask));;
-            auto den = torch::sum(mask);
-            return num.template item<double>() / den.template item<double>();
+            return (output.argmax(-1) == target).__and__(mask).sum();
+        }
+
+        static double accuracy(torch::Tensor output, torch::Tensor target, std::int64_t ignore_label) {
+            auto num = count_correct(output, target, ignore_label).to(at::kDouble);
+            auto den = (target != ignore_label).sum().to(at::kDouble);
+            return (num / den).template item<double>();
+        }
+
+        /**
+           Loss and accuracy accumulated in device tensors over steps. Only the getters synchronize with the device,
+           so read them at a logging interval or at the end of an epoch.
+        */
+        class Metrics {
+        public:
+            /// token-weighted sum of loss and the number of correct tokens
+            torch::Tensor loss_sum, correct_sum;
+            std::int64_t tokens = 0;
+            std::int64_t steps = 0;
+
+            void reset() {
+                this->loss_sum = torch::Tensor();
+                this->correct_sum = torch::Tensor();
+                this->tokens = 0;
+                this->steps = 0;
+            }
+
+            /// `loss` is the mean over `n_tokens` and `correct` counts correct tokens
+            void add(torch::Tensor loss, torch::Tensor correct, std::int64_t n_tokens) {
+                torch::NoGradGuard no_grad;
+                auto l = loss.detach().to(at::kDouble) * static_cast<double>(n_tokens);
+                auto c = correct.detach().to(at::kDouble);
+                if (this->loss_sum.defined()) {
+                    this->loss_sum.add_(l);
+                    this->correct_sum.add_(c);
+                } else {
+                    this->loss_sum = l;
+                    this->correct_sum = c;
+                }
+                this->tokens += n_tokens;
+                ++this->steps;
+            }
+
+            /// average loss per token
+            double loss() const {
+                return this->tokens == 0 ? 0.0 : this->loss_sum.template item<double>() / this->tokens;
+            }
+
+            double accuracy() const {
+                return this->tokens == 0 ? 0.0 : this->correct_sum.template item<double>() / this->tokens;
+            }
+        };
+
+        namespace detail {
+            /**
+               Masks shared by all the models in a process and kept per device.
+
+               A causal mask of any size is a zero-copy slice of one lower triangular mask grown by doubling,
+               and padding masks are compared against a cached row of positions.
+               Returned tensors are views of the cache and must not be modified in place.
+            */
+            class MaskCache {
+            public:
+                static MaskCache& instance() {
+                    static MaskCache cache;
+                    return cache;
+                }
+
+                /// (size, size) lower triangular byte mask on `device`
+                at::Tensor subsequent(std::int64_t size, torch::Device device) {
+                    auto m = this->get(this->causal, size, device, [](std::int64_t n, torch::Device d) {
+                        return at::ones({n, n}, torch::TensorOptions().dtype(at::kByte).device(d)).tril_();
+                    });
+                    return m.slice(0, 0, size).slice(1, 0, size);
+                }
+
+                /// {0, 1, ..., size - 1} kLong on `device`
+                at::Tensor positions(std::int64_t size, torch::Device device) {
+                    auto p = this->get(this->position, size, device, [](std::int64_t n, torch::Device d) {
+                        return at::arange(n, torch::TensorOptions().dtype(at::kLong).device(d));
+                    });
+                    return p.slice(0, 0, size);
+                }
+
+            private:
+                using Key = std::pair<int, int>;
+                std::mutex mutex;
+                std::map<Key, at::Tensor> causal, position;
+
+                template <typename Make>
+                at::Tensor get(std::map<Key, at::Tensor>& cache, std::int64_t size, torch::Device device, Make make) {
+                    std::lock_guard<std::mutex> lock(this->mutex);
+                    auto& m = cache[{static_cast<int>(device.type()), static_cast<int>(device.index())}];
+                    if (!m.defined() || m.size(0) < size) {
+                        // old slices held by callers keep the previous storage alive
+                        m = make(std::max<std::int64_t>(size, m.defined() ? 2 * m.size(0) : 64), device);
+                    }
+                    return m;
+                }
+            };
+        } // namespace detail
+
+        /// convert lengths to a 1d kLong tensor on CPU
+        static at::Tensor length_tensor(at::IntList lengths) {
+            auto ret = at::empty({static_cast<std::int64_t>(lengths.size())}, at::kLong);
+            std::copy(lengths.begin(), lengths.end(), ret.data<std::int64_t>());
+            return ret;
         }
 
         /// convert lengths {1, 2} to mask {{1, 0}, {1, 1}}
@@ -37,34 +148,155 @@ namespace thxx {
             auto maxlen = *std::max_element(lengths.begin(), lengths.end());
             auto bs = static_cast<std::int64_t>(lengths.size());
             auto ret = at::zeros({bs, maxlen}, at::kByte);
+            // filled in one pass over the buffer instead of a slice op per row
+            auto p = ret.data<std::uint8_t>();
             for (size_t i = 0; i < lengths.size(); ++i) {
-                ret[i].slice(0, 0, lengths[i]) = 1;
+                std::fill(p + i * maxlen, p + i * maxlen + lengths[i], 1);
+            }
+            return ret;
+        }
+
+        /// pad_mask made on `device`. non-CPU masks compare cached positions with the lengths copied at once
+        static at::Tensor pad_mask(at::IntList lengths, torch::Device device) {
+            if (device.type() == torch::kCPU) {
+                return pad_mask(lengths);
+            }
+            auto maxlen = *std::max_element(lengths.begin(), lengths.end());
+            auto len = length_tensor(lengths).to(device).unsqueeze(1);
+            return detail::MaskCache::instance().positions(maxlen, device).unsqueeze(0) < len;
+        }
+
+        /**
+           make decoder input {sos, y0, ..., y(n-2)} and output {y1, ..., y(n-1), eos} of padded targets (batch, time).
+           padded positions are `ignore_index`. the number of ops does not depend on the batch size.
+        */
+        static std::tuple<torch::Tensor, torch::Tensor>
+        shift_targets(torch::Tensor tgt, at::IntList lengths, std::int64_t sos, std::int64_t eos, std::int64_t ignore_index) {
+            AT_ASSERT(tgt.dim() == 2);
+            AT_ASSERT(tgt.size(0) == static_cast<std::int64_t>(lengths.size()));
+            auto b = tgt.size(0);
+            auto t = tgt.size(1);
+            auto len = torch::autograd::make_variable(length_tensor(lengths)).to(tgt.device()).unsqueeze(1);
+            auto pos = torch::arange(t, tgt.options()).unsqueeze(0);
+            auto pad = pos >= len;
+            auto tgt_in = torch::cat({torch::full({b, 1}, sos, tgt.options()), tgt.slice(1, 0, t - 1)}, 1);
+            tgt_in.masked_fill_(pad, ignore_index);
+            auto tgt_out = torch::cat({tgt.slice(1, 1, t), torch::full({b, 1}, ignore_index, tgt.options())}, 1);
+            tgt_out.masked_fill_(pos == len - 1, eos);
+            tgt_out.masked_fill_(pad, ignore_index);
+            return std::make_tuple(tgt_in, tgt_out);
+        }
+
+        /// convert lengths {1, 2} to cumulative offsets {0, 1, 3} of packed sequences
+        static std::vector<std::int64_t> length_offsets(at::IntList lengths) {
+            std::vector<std::int64_t> ret = {0};
+            for (auto l : lengths) {
+                ret.push_back(ret.back() + l);
             }
             return ret;
         }
 
+        /// pack padded x (batch, time, ...) into (sum(lengths), ...) without padded frames
+        static torch::Tensor pack_padded(torch::Tensor x, at::IntList lengths) {
+            AT_ASSERT(x.size(0) == static_cast<std::int64_t>(lengths.size()));
+            std::vector<torch::Tensor> xs;
+            for (size_t i = 0; i < lengths.size(); ++i) {
+                xs.push_back(x[i].slice(0, 0, lengths[i]));
+            }
+            return torch::cat(xs, 0);
+        }
+
+        /// inverse of pack_padded: (offsets.back(), ...) -> (offsets.size() - 1, max length, ...) padded by zeros
+        static torch::Tensor pad_packed(torch::Tensor x, at::IntList offsets) {
+            std::int64_t maxlen = 0;
+            for (size_t i = 0; i + 1 < offsets.size(); ++i) {
+                maxlen = std::max(maxlen, offsets[i + 1] - offsets[i]);
+            }
+            std::vector<torch::Tensor> xs;
+            for (size_t i = 0; i + 1 < offsets.size(); ++i) {
+                auto xi = x.slice(0, offsets[i], offsets[i + 1]);
+                auto sizes = xi.sizes().vec();
+                sizes[0] = maxlen - sizes[0];
+                xs.push_back(torch::cat({xi, torch::zeros(sizes, xi.options())}, 0));
+            }
+            return torch::stack(xs);
+        }
+
+        /// (size, size) causal mask. this is a read-only view of detail::MaskCache
         static at::Tensor subsequent_mask(std::int64_t size, torch::Device device = torch::kCPU) {
-            return at::ones({size, size}, torch::TensorOptions().dtype(at::kByte).device(device)).tril_();
+            return detail::MaskCache::instance().subsequent(size, device);
         }
 
+        /// KL divergence from the label-smoothed target distribution in closed form without a (batch, class) target buffer
         static auto label_smoothing_kl_div(torch::Tensor pred, torch::Tensor target, float smoothing=0, std::int64_t padding_idx=-1) {
             AT_ASSERT(0.0 <= smoothing);
             AT_ASSERT(smoothing <= 1.0);
-            torch::Tensor true_dist, ignore_mask, n_valid;
+            kernel::detail::SmoothedTarget q(smoothing, pred.size(1));
+            torch::Tensor ignore_mask, t, n_valid;
             {
                 torch::NoGradGuard no_grad;
-                true_dist = at::empty_like(pred);
-                auto n_false_class = pred.size(1) - 1; // only one for true
-                true_dist.fill_(smoothing / n_false_class);
                 ignore_mask = target == padding_idx;
-                auto t = target.detach().clone();
-                n_valid = (t != padding_idx).sum();
-                // NOTE this is only worked for ctc loss using 0 index for eps
-                // if (pa) t = t.masked_fill_(ignore_mask, 0); // avoid -1 index
-                true_dist.scatter_(1, t.unsqueeze(1), 1.0 - smoothing);
-            }
-            auto kl = torch::kl_div(pred.log_softmax(1), true_dist, Reduction::None);
-            return kl.masked_fill_(ignore_mask.unsqueeze(1), 0).sum() / n_valid;
+                t = target.masked_fill(ignore_mask, 0); // avoid -1 index
+                n_valid = (target != padding_idx).sum().to(at::kFloat);
+            }
+            auto logp = pred.log_softmax(1);
+            auto logp_t = logp.gather(1, t.unsqueeze(1)).squeeze(1);
+            auto kl = q.entropy - (q.on - q.off) * logp_t - q.off * logp.sum(1);
+            return kl.masked_fill(ignore_mask, 0).sum() / n_valid;
+        }
+
+        /// torch::nn::Linear with the same parameters (and checkpoints) that can run int8 weights for decoding
+        class LinearImpl : public torch::nn::Cloneable<LinearImpl> {
+        public:
+            std::int64_t in_features;
+            std::int64_t out_features;
+            bool with_bias;
+            torch::Tensor weight;
+            torch::Tensor bias;
+            /// set by quantize(). fp32 weight is kept for training and non-CPU devices
+            kernel::QuantizedWeight quantized;
+
+            LinearImpl(std::int64_t in_features, std::int64_t out_features, bool with_bias = true)
+                : in_features(in_features), out_features(out_features), with_bias(with_bias) {
+                this->reset();
+            }
+
+            void reset() override {
+                this->weight = register_parameter("weight", torch::empty({out_features, in_features}));
+                if (this->with_bias) {
+                    this->bias = register_parameter("bias", torch::empty(out_features));
+                }
+                // the same initialization as torch::nn::Linear
+                torch::NoGradGuard no_grad;
+                auto stdv = 1.0 / std::sqrt(this->in_features);
+                for (auto& p : this->parameters()) {
+                    p.uniform_(-stdv, stdv);
+                }
+                this->quantized = {};
+            }
+
+            /// quantize the current weight into int8 with per output channel scales
+            void quantize() {
+                this->quantized = kernel::quantize_per_channel(this->weight);
+            }
+
+            torch::Tensor forward(torch::Tensor x) {
+                if (this->quantized.defined() && !this->is_training() && !x.is_cuda()
+                    && x.scalar_type() == at::kFloat && !kernel::autograd::requires_grad({x, this->weight})) {
+                    return kernel::quantized_linear(x, this->quantized, this->bias);
+                }
+                return torch::linear(x, this->weight, this->bias);
+            }
+        };
+        TORCH_MODULE(Linear);
+
+        /// quantize every net::Linear in `module` (e.g., a loaded Transformer) for CPU decoding
+        static void quantize_dynamic(torch::nn::Module& module) {
+            for (auto& m : module.modules()) {
+                if (auto l = std::dynamic_pointer_cast<LinearImpl>(m)) {
+                    l->quantize();
+                }
+            }
         }
 
         class LayerNormImpl : public torch::nn::Cloneable<LayerNormImpl> {
@@ -84,15 +316,48 @@ namespace thxx {
                 this->bias = register_parameter("bias", torch::zeros(features));
             }
 
+            /// use kernel::layer_norm on CPU
+            bool fused = true;
+
+            bool use_kernel(const torch::Tensor& x) const {
+                return this->fused && !x.is_cuda() && x.scalar_type() == at::kFloat;
+            }
+
             torch::Tensor forward(torch::Tensor x) {
-                auto mean = x.mean(-1, true);
-                auto std = x.std(-1, true).unsqueeze(-1);
-                return this->scale * (x - mean) / std + this->bias;
+                if (this->use_kernel(x)) {
+                    return std::get<0>(kernel::layer_norm(x, {}, this->scale, this->bias));
+                }
+                // reduced precision inputs are normalized in fp32
+                auto h = x.to(at::kFloat);
+                auto mean = h.mean(-1, true);
+                auto std = h.std(-1, true).unsqueeze(-1);
+                auto y = this->scale.to(at::kFloat) * (h - mean) / std + this->bias.to(at::kFloat);
+                return y.to(x.scalar_type());
+            }
+
+            /// returns (x + residual, forward(x + residual)) by one kernel
+            std::tuple<torch::Tensor, torch::Tensor> forward_residual(torch::Tensor x, torch::Tensor residual) {
+                if (this->use_kernel(x)) {
+                    auto [y, v] = kernel::layer_norm(x, residual, this->scale, this->bias);
+                    return std::make_tuple(v, y);
+                }
+                auto v = x + residual;
+                return std::make_tuple(v, this->forward(v));
             }
         };
         TORCH_MODULE(LayerNorm);
 
 
+        /// how MultiHeadedAttention packs the input projections
+        enum class Projection {
+            /// linear_q, linear_k and linear_v
+            separate,
+            /// linear_qkv for self-attention
+            qkv,
+            /// linear_q and linear_kv for source-attention
+            kv
+        };
+
         class MultiHeadedAttentionImpl : public torch::nn::Cloneable<MultiHeadedAttentionImpl> {
         public:
             // configurations
@@ -100,68 +365,288 @@ namespace thxx {
             std::int64_t d_model;
             std::int64_t d_k;
             float dropout_rate;
+            Projection projection;
 
             // submodules
-            torch::nn::Linear linear_q = nullptr;
-            torch::nn::Linear linear_k = nullptr;
-            torch::nn::Linear linear_v = nullptr;
-            torch::nn::Linear linear_out = nullptr;
+            Linear linear_q = nullptr;
+            Linear linear_k = nullptr;
+            Linear linear_v = nullptr;
+            /// packed (3 * heads * d_k, d_model) weight of Projection::qkv
+            Linear linear_qkv = nullptr;
+            /// packed (2 * heads * d_k, d_model) weight of Projection::kv
+            Linear linear_kv = nullptr;
+            Linear linear_out = nullptr;
             torch::nn::Dropout dropout = nullptr;
 
-            torch::Tensor attn;
-            static constexpr float min_value = std::numeric_limits<float>::min();
-
-            MultiHeadedAttentionImpl(std::int64_t heads, std::int64_t d_model, float dropout_rate)
-                : heads(heads), d_model(d_model), d_k(d_model / heads), dropout_rate(dropout_rate) {
-                AT_ASSERT(d_model % heads == 0);
+            /// use kernel::attention on CPU unless attention weights are captured
+            bool fused = true;
+            /// NOTE: numeric_limits::min() is the smallest *positive* float that does not mask anything
+            static constexpr float min_value = std::numeric_limits<float>::lowest();
+
+            /// `d_k` is d_model / heads by default. heads * d_k can be smaller than d_model (e.g., pruned heads)
+            MultiHeadedAttentionImpl(std::int64_t heads, std::int64_t d_model, float dropout_rate,
+                                     Projection projection = Projection::separate, std::int64_t d_k = 0)
+                : heads(heads), d_model(d_model), d_k(d_k > 0 ? d_k : d_model / heads), dropout_rate(dropout_rate),
+                  projection(projection) {
+                AT_ASSERT(d_k > 0 || d_model % heads == 0);
                 this->reset();
             }
 
+            /// width of the concatenated heads
+            std::int64_t d_inner() const {
+                return this->heads * this->d_k;
+            }
+
             void reset() override {
-                this->linear_q = register_module("linear_q", torch::nn::Linear(this->d_model, this->d_model));
-                this->linear_k = register_module("linear_k", torch::nn::Linear(this->d_model, this->d_model));
-                this->linear_v = register_module("linear_v", torch::nn::Linear(this->d_model, this->d_model));
-                this->linear_out = register_module("linear_out", torch::nn::Linear(this->d_model, this->d_model));
+                auto d_inner = this->d_inner();
+                if (this->projection == Projection::qkv) {
+                    this->linear_qkv = register_module("linear_qkv", Linear(this->d_model, 3 * d_inner));
+                } else {
+                    this->linear_q = register_module("linear_q", Linear(this->d_model, d_inner));
+                }
+                if (this->projection == Projection::separate) {
+                    this->linear_k = register_module("linear_k", Linear(this->d_model, d_inner));
+                    this->linear_v = register_module("linear_v", Linear(this->d_model, d_inner));
+                } else if (this->projection == Projection::kv) {
+                    this->linear_kv = register_module("linear_kv", Linear(this->d_model, 2 * d_inner));
+                }
+                this->linear_out = register_module("linear_out", Linear(d_inner, this->d_model));
                 this->dropout = register_module("dropout", torch::nn::Dropout(this->dropout_rate));
+                // initialize packed weights in the same way as separated ones
+                if (this->projection != Projection::separate) {
+                    torch::NoGradGuard no_grad;
+                    for (std::int64_t i = 0; i < 3; ++i) {
+                        auto [w, b] = this->projection_parameters(i);
+                        Linear l(this->d_model, d_inner);
+                        w.copy_(l->weight);
+                        b.copy_(l->bias);
+                    }
+                }
             }
 
-            torch::Tensor forward(torch::Tensor query, torch::Tensor key, torch::Tensor value, torch::Tensor mask) {
-                // check minibatch size
-                auto n_batch = query.size(0);
-                AT_ASSERT(key.size(0) == n_batch);
-                AT_ASSERT(value.size(0) == n_batch);
-                AT_ASSERT(mask.size(0) == n_batch);
-                // check time length
-                auto q_len = query.size(1);
-                // AT_ASSERT(mask.size(1) == q_len);
+            /// (weight, bias) of query (i = 0), key (1) or value (2) projection. packed ones are returned as views.
+            std::tuple<torch::Tensor, torch::Tensor> projection_parameters(std::int64_t i) const {
+                AT_ASSERT(0 <= i && i < 3);
+                const Linear* packed = nullptr;
+                auto offset = i;
+                if (this->projection == Projection::qkv) {
+                    packed = &this->linear_qkv;
+                } else if (this->projection == Projection::kv && i > 0) {
+                    packed = &this->linear_kv;
+                    offset = i - 1;
+                }
+                if (packed) {
+                    auto begin = offset * this->d_inner();
+                    auto end = begin + this->d_inner();
+                    return std::make_tuple((*packed)->weight.slice(0, begin, end), (*packed)->bias.slice(0, begin, end));
+                }
+                const auto& l = i == 0 ? this->linear_q : (i == 1 ? this->linear_k : this->linear_v);
+                return std::make_tuple(l->weight, l->bias);
+            }
+
+            /// keep checkpoints in the separate layout (linear_q, linear_k and linear_v) regardless of packing
+            void save(torch::serialize::OutputArchive& archive) const override {
+                if (this->projection == Projection::separate) {
+                    torch::nn::Module::save(archive);
+                    return;
+                }
+                torch::NoGradGuard no_grad;
+                const char* names[] = {"linear_q", "linear_k", "linear_v"};
+                for (std::int64_t i = 0; i < 3; ++i) {
+                    auto [w, b] = this->projection_parameters(i);
+                    torch::serialize::OutputArchive a;
+                    a.write("weight", w.clone());
+                    a.write("bias", b.clone());
+                    archive.write(names[i], a);
+                }
+                torch::serialize::OutputArchive out, dropout;
+                this->linear_out->save(out);
+                this->dropout->save(dropout);
+                archive.write("linear_out", out);
+                archive.write("dropout", dropout);
+            }
+
+            void load(torch::serialize::InputArchive& archive) override {
+                if (this->projection == Projection::separate) {
+                    torch::nn::Module::load(archive);
+                    return;
+                }
+                torch::NoGradGuard no_grad;
+                const char* names[] = {"linear_q", "linear_k", "linear_v"};
+                for (std::int64_t i = 0; i < 3; ++i) {
+                    torch::serialize::InputArchive a;
+                    archive.read(names[i], a);
+                    torch::Tensor w, b;
+                    a.read("weight", w);
+                    a.read("bias", b);
+                    auto [pw, pb] = this->projection_parameters(i);
+                    pw.copy_(w);
+                    pb.copy_(b);
+                }
+                torch::serialize::InputArchive out, dropout;
+                archive.read("linear_out", out);
+                archive.read("dropout", dropout);
+                this->linear_out->load(out);
+                this->dropout->load(dropout);
+            }
+
+            /// (batch, time, heads * d_k) -> (batch, heads, time, d_k)
+            torch::Tensor split_heads(torch::Tensor x) {
+                return x.view({x.size(0), x.size(1), this->heads, this->d_k}).transpose(1, 2);
+            }
+
+            /// (batch, time, n * heads * d_k) -> n tensors of (batch, heads, time, d_k)
+            std::vector<torch::Tensor> split_packed_heads(torch::Tensor x, std::int64_t n) {
+                auto y = x.view({x.size(0), x.size(1), n, this->heads, this->d_k}).permute({2, 0, 3, 1, 4});
+                std::vector<torch::Tensor> ret;
+                for (std::int64_t i = 0; i < n; ++i) {
+                    ret.push_back(y[i]);
+                }
+                return ret;
+            }
+
+            /// project query into (batch, heads, time, d_k)
+            torch::Tensor forward_q(torch::Tensor query) {
+                AT_ASSERT(query.size(2) == this->d_model);
+                AT_ASSERT(at::isFloatingType(query.scalar_type()));
+                if (this->projection == Projection::qkv) {
+                    auto [w, b] = this->projection_parameters(0);
+                    return this->split_heads(torch::linear(query, w, b));
+                }
+                return this->split_heads(this->linear_q->forward(query));
+            }
+
+            /// project key/value into (batch, heads, time, d_k) that can be cached over decoding steps
+            std::tuple<torch::Tensor, torch::Tensor> forward_kv(torch::Tensor key, torch::Tensor value) {
+                auto n_batch = key.size(0);
                 auto kv_len = key.size(1);
+                AT_ASSERT(value.size(0) == n_batch);
                 AT_ASSERT(value.size(1) == kv_len);
-                // check feature size
-                AT_ASSERT(query.size(2) == this->d_model);
                 AT_ASSERT(key.size(2) == this->d_model);
                 AT_ASSERT(value.size(2) == this->d_model);
-                // type check
-                AT_ASSERT(query.scalar_type() == at::kFloat);
-                AT_ASSERT(key.scalar_type() == at::kFloat);
-                AT_ASSERT(value.scalar_type() == at::kFloat);
-                AT_ASSERT(mask.scalar_type() == at::kByte);
-
-                auto q = this->linear_q->forward(query).view({n_batch, q_len, this->heads, this->d_k}).transpose(1, 2);
-                auto k = this->linear_k->forward(key).view({n_batch, kv_len, this->heads, this->d_k}).transpose(1, 2);
-                auto v = this->linear_v->forward(value).view({n_batch, kv_len, this->heads, this->d_k}).transpose(1, 2);
-                auto scores = q.matmul(k.transpose(-2, -1)) / std::sqrt(this->d_k);
-                // TODO: create non destructive masked_fill?
-                // auto m0 = torch::autograd::make_variable((mask.unsqueeze(1) == 0).to(at::kFloat));
-                // auto m1 = torch::autograd::make_variable(mask.unsqueeze(1).to(at::kFloat));
-                // auto masked_scores = scores * m1 + min_value * m0;
-                auto m = torch::autograd::make_variable(mask.unsqueeze(1) == 0);
-                auto masked_scores = scores.masked_fill_(m, min_value);
-                this->attn = masked_scores.softmax(-1);
-                auto p_attn = this->dropout->forward(this->attn);
-                auto weighted = p_attn.matmul(v);
-                auto y = weighted.transpose(1, 2).contiguous().view({n_batch, q_len, this->d_model});
+                AT_ASSERT(at::isFloatingType(key.scalar_type()));
+                AT_ASSERT(at::isFloatingType(value.scalar_type()));
+                if (this->projection == Projection::kv && key.is_same(value)) {
+                    auto kv = this->split_packed_heads(this->linear_kv->forward(key), 2);
+                    return std::make_tuple(kv[0], kv[1]);
+                }
+                if (this->projection == Projection::separate) {
+                    return std::make_tuple(this->split_heads(this->linear_k->forward(key)),
+                                           this->split_heads(this->linear_v->forward(value)));
+                }
+                auto [wk, bk] = this->projection_parameters(1);
+                auto [wv, bv] = this->projection_parameters(2);
+                return std::make_tuple(this->split_heads(torch::linear(key, wk, bk)),
+                                       this->split_heads(torch::linear(value, wv, bv)));
+            }
+
+            /// project the same input into query/key/value of (batch, heads, time, d_k) by one GEMM if packed
+            std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> forward_qkv(torch::Tensor x) {
+                if (this->projection == Projection::qkv) {
+                    AT_ASSERT(x.size(2) == this->d_model);
+                    AT_ASSERT(at::isFloatingType(x.scalar_type()));
+                    auto qkv = this->split_packed_heads(this->linear_qkv->forward(x), 3);
+                    return std::make_tuple(qkv[0], qkv[1], qkv[2]);
+                }
+                auto [k, v] = this->forward_kv(x, x);
+                return std::make_tuple(this->forward_q(x), k, v);
+            }
+
+            /// attend query to the projected key/value from forward_kv. undefined mask attends to everything.
+            torch::Tensor forward_attention(torch::Tensor query, torch::Tensor k, torch::Tensor v, torch::Tensor mask,
+                                            torch::Tensor* attn = nullptr) {
+                return this->attend(this->forward_q(query), k, v, mask, attn);
+            }
+
+            /// attend projected query/key/value and apply the output projection.
+            /// non-null `attn` receives (batch, heads, q_len, kv_len) attention weights of this call.
+            torch::Tensor attend(torch::Tensor q, torch::Tensor k, torch::Tensor v, torch::Tensor mask,
+                                 torch::Tensor* attn = nullptr) {
+                auto n_batch = q.size(0);
+                auto q_len = q.size(2);
+                // key/value/mask of batch size 1 are broadcasted (e.g., memory shared by beams)
+                AT_ASSERT(k.size(0) == n_batch || k.size(0) == 1);
+                AT_ASSERT(v.size(0) == k.size(0));
+                if (mask.defined()) {
+                    AT_ASSERT(mask.size(0) == n_batch || mask.size(0) == 1);
+                    AT_ASSERT(mask.scalar_type() == at::kByte);
+                }
+                torch::Tensor weighted;
+                if (this->fused && !q.is_cuda() && q.scalar_type() == at::kFloat && attn == nullptr) {
+                    // stream key/value without storing (batch, heads, q_len, kv_len) scores
+                    weighted = kernel::attention(q, k, v, mask, this->dropout_rate, this->is_training());
+                } else {
+                    weighted = this->attention(q, k, v, mask, attn);
+                }
+                auto y = weighted.transpose(1, 2).contiguous().view({n_batch, q_len, this->d_inner()});
                 return this->linear_out->forward(y);
             }
+
+            /// reference implementation of fused kernel::attention that optionally captures `attn`
+            torch::Tensor attention(torch::Tensor q, torch::Tensor k, torch::Tensor v, torch::Tensor mask,
+                                    torch::Tensor* attn = nullptr) {
+                // softmax is computed in fp32 for reduced precision inputs
+                auto scores = (q.matmul(k.transpose(-2, -1)) / std::sqrt(this->d_k)).to(at::kFloat);
+                if (mask.defined()) {
+                    // TODO: create non destructive masked_fill?
+                    // auto m0 = torch::autograd::make_variable((mask.unsqueeze(1) == 0).to(at::kFloat));
+                    // auto m1 = torch::autograd::make_variable(mask.unsqueeze(1).to(at::kFloat));
+                    // auto masked_scores = scores * m1 + min_value * m0;
+                    auto m = torch::autograd::make_variable(mask.unsqueeze(1) == 0);
+                    scores = scores.masked_fill_(m, min_value);
+                }
+                auto weights = scores.softmax(-1);
+                if (attn != nullptr) {
+                    *attn = weights;
+                }
+                auto p_attn = this->dropout->forward(weights.to(v.scalar_type()));
+                return p_attn.matmul(v);
+            }
+
+            /// reentrant: nothing of the module is modified, so threads can share one instance for inference
+            torch::Tensor forward(torch::Tensor query, torch::Tensor key, torch::Tensor value, torch::Tensor mask,
+                                  torch::Tensor* attn = nullptr) {
+                // check minibatch size
+                auto n_batch = query.size(0);
+                AT_ASSERT(key.size(0) == n_batch);
+                AT_ASSERT(value.size(0) == n_batch);
+                // a mask of batch size 1 (e.g., subsequent_mask) is broadcasted as in attend()
+                AT_ASSERT(mask.size(0) == n_batch || mask.size(0) == 1);
+                // check time length
+                // AT_ASSERT(mask.size(1) == query.size(1));
+                AT_ASSERT(value.size(1) == key.size(1));
+                if (query.is_same(key) && key.is_same(value)) {
+                    auto [q, k, v] = this->forward_qkv(query);
+                    return this->attend(q, k, v, mask, attn);
+                }
+                auto [k, v] = this->forward_kv(key, value);
+                return this->forward_attention(query, k, v, mask, attn);
+            }
+
+            /// self-attention over packed sequences x (total, d_model) where each of [offsets[i], offsets[i + 1]) attends to itself
+            torch::Tensor forward_packed(torch::Tensor x, at::IntList offsets) {
+                AT_ASSERT(x.dim() == 2);
+                auto total = x.size(0);
+                // (1, heads, total, d_k) -> (total, heads, d_k)
+                auto [q, k, v] = this->forward_qkv(x.unsqueeze(0));
+                q = q[0].transpose(0, 1);
+                k = k[0].transpose(0, 1);
+                v = v[0].transpose(0, 1);
+                torch::Tensor weighted;
+                if (this->fused && !x.is_cuda() && x.scalar_type() == at::kFloat) {
+                    weighted = kernel::varlen_attention(q, k, v, offsets, this->dropout_rate, this->is_training());
+                } else {
+                    std::vector<torch::Tensor> ys;
+                    for (size_t i = 0; i + 1 < offsets.size(); ++i) {
+                        auto split = [&](torch::Tensor t) {
+                            return t.slice(0, offsets[i], offsets[i + 1]).transpose(0, 1).unsqueeze(0);
+                        };
+                        ys.push_back(this->attention(split(q), split(k), split(v), {})[0].transpose(0, 1));
+                    }
+                    weighted = torch::cat(ys, 0);
+                }
+                return this->linear_out->forward(weighted.contiguous().view({total, this->d_inner()}));
+            }
         };
         TORCH_MODULE(MultiHeadedAttention);
 
@@ -172,10 +657,25 @@ namespace thxx {
                 std::int64_t d_model = 256;
                 std::int64_t d_ff = 1024;
                 std::int64_t heads = 4;
+                /// dim of each attention head (0 for d_model / heads). pruned models keep the original one
+                std::int64_t d_head = 0;
                 std::int64_t elayers = 6;
                 std::int64_t dlayers = 6;
                 float dropout_rate = 0.1;
                 float label_smoothing = 0.1;
+                /// pack query/key/value projections into one GEMM (checkpoints are compatible)
+                bool fused_projection = false;
+                /// time (and frequency) subsampling rate of Conv2dSubsampling: 4, 6 or 8
+                std::int64_t subsampling = 4;
+                /// add an exit head (the shared encoder norm and a projection to tokens) after every `exit_interval`
+                /// encoder layers but the last (0 for no exit). exit heads are trained by CTC, so ctc_weight > 0 is needed.
+                /// the decoder is trained on the memory of an exit (or the last layer) drawn per batch so that it can
+                /// decode the memory of a confident exit (see exit_threshold)
+                std::int64_t exit_interval = 0;
+                /// layers of the draft decoder proposing tokens for speculative decoding (0 does not create it)
+                std::int64_t draft_dlayers = 0;
+                /// feed-forward dim of the draft decoder
+                std::int64_t draft_d_ff = 256;
 
                 // training
                 float lr = 10.0;
@@ -183,38 +683,158 @@ namespace thxx {
                 std::int64_t batch_size = 64;
                 std::int64_t max_len_in = 512;
                 std::int64_t max_len_out = 150;
+                /// recompute activations of every `checkpoint_layers` encoder/decoder layers in backward (0 to store all)
+                std::int64_t checkpoint_layers = 0;
+                /// encode utterances packed without padding (see EncoderImpl::forward_packed). memory lengths are the
+                /// same as padded encoding (see Conv2dSubsampling::subsample_mask)
+                bool unpadded = false;
+                /// rows of logits computed at once by kernel::linear_label_smoothing (0 materializes all the logits)
+                std::int64_t loss_chunk = 512;
+                /// weight of the CTC loss on the encoder output in [0, 1] (0 does not create the CTC head)
+                float ctc_weight = 0;
+                /// probability to skip each encoder layer in training (stochastic depth)
+                float layer_drop = 0;
 
                 // decoding
                 std::int64_t beam_size = 1;
                 float max_len_ratio = 0;
                 float min_len_ratio = 0;
                 float penalty = 0;
+                /// decode with the CTC head only (no autoregressive decoder step). beam_size > 1 uses prefix search
+                bool ctc_decode = false;
+                /// stop encoding at the first exit head whose confidence exceeds this in every utterance of a batch
+                /// (0 runs all the encoder layers). see exit_confidence. not for ctc_decode since the CTC head only
+                /// learns the last layer
+                float exit_threshold = 0;
+                /// tokens proposed by the draft decoder per decoder step of greedy search (0 does not use the draft)
+                std::int64_t speculative_tokens = 4;
+
+                // precision
+                /// run the model in half while LayerNorm, softmax and loss stay fp32 (CUDA only: libtorch 1.0 has
+                /// no bf16 type nor half GEMM on CPU). see thxx::optim::MixedPrecision for fp32 master weights and loss scaling
+                bool mixed_precision = false;
+
+                // streaming
+                /// the number of subsampled frames in an encoder chunk (0 for full-context encoding)
+                std::int64_t stream_chunk = 0;
+                /// the number of previous chunks visible from each chunk
+                std::int64_t stream_left_chunks = 4;
+            };
+
+
+            /// convert chunk size 2 and left chunks 0 to mask {{1, 1, 0}, {1, 1, 0}, {0, 0, 1}} of size 3
+            static at::Tensor chunk_mask(std::int64_t size, std::int64_t chunk, std::int64_t left_chunks,
+                                         torch::Device device = torch::kCPU) {
+                AT_ASSERT(chunk > 0);
+                auto index = at::arange(size, torch::TensorOptions().dtype(at::kLong).device(device)) / chunk;
+                auto row = index.unsqueeze(1);
+                auto col = index.unsqueeze(0);
+                return (col <= row).__and__(col >= row - left_chunks);
+            }
+
+
+            /// state of EncoderImpl::forward_chunk kept between chunks of one stream
+            struct EncoderStreamState {
+                /// input frames not consumed by the input layer yet (its left context)
+                torch::Tensor buffer;
+                /// subsampled frames waiting for a complete chunk
+                torch::Tensor pending;
+                /// the number of subsampled frames emitted so far (position of the next frame)
+                std::int64_t offset = 0;
+                /// (1, heads, time, d_k) key/value of the previous chunks in each layer
+                std::vector<torch::Tensor> k, v;
             };
 
 
             static auto positionwise_feedforward(std::int64_t d_model, std::int64_t d_ff, float dropout_rate) {
                 return meta::sequential(
-                    torch::nn::Linear(d_model, d_ff),
+                    Linear(d_model, d_ff),
                     torch::nn::Dropout(dropout_rate),
-                    meta::lambda(torch::relu),
-                    torch::nn::Linear(d_ff, d_model)
+                    meta::lambda(meta::Relu()),
+                    Linear(d_ff, d_model)
                     );
             }
 
             /// for convinience
             using PositionwiseFeedforward = decltype(positionwise_feedforward(0,0,0.0));
+            using PositionwiseFeedforwardImpl = std::decay_t<decltype(*std::declval<PositionwiseFeedforward&>())>;
+
+            /// the first (d_model -> d_ff) and the second (d_ff -> d_model) Linear of positionwise_feedforward
+            static std::tuple<std::shared_ptr<LinearImpl>, std::shared_ptr<LinearImpl>>
+            feedforward_linears(const torch::nn::Module& pff) {
+                std::vector<std::shared_ptr<LinearImpl>> linears;
+                for (const auto& m : pff.children()) {
+                    if (auto l = std::dynamic_pointer_cast<LinearImpl>(m)) {
+                        linears.push_back(l);
+                    }
+                }
+                AT_ASSERT(linears.size() == 2);
+                return std::make_tuple(linears[0], linears[1]);
+            }
+
 
+            /// (1, length, d_model) sinusoidal encoding of positions [offset, offset + length)
+            static torch::Tensor positional_encoding(std::int64_t offset, std::int64_t length, std::int64_t d_model) {
+                torch::NoGradGuard no_grad;
+                auto pe = torch::zeros({1, length, d_model});
+                // double positions keep sin/cos accurate for long streams
+                auto position = torch::arange(offset, offset + length, at::kDouble).unsqueeze(1);
+                auto div_term = torch::exp(torch::arange(0, d_model, 2, at::kDouble) * -std::log(10000.0) / d_model);
+                pe.slice(2, 0, pe.size(2), 2) = torch::sin(position * div_term).to(at::kFloat);
+                pe.slice(2, 1, pe.size(2), 2) = torch::cos(position * div_term).to(at::kFloat);
+                return pe;
+            }
+
+            /**
+               Process-wide read-only sinusoidal tables shared by all the PositionalEncoding modules.
+
+               One table is kept per (d_model, dtype, device) and grown by doubling on demand up to `max_cached`
+               positions. Positions beyond that (e.g., long streams) are computed on the fly.
+            */
+            class PositionalEncodingTable {
+            public:
+                static constexpr std::int64_t max_cached = 1 << 14;
+
+                static PositionalEncodingTable& instance() {
+                    static PositionalEncodingTable table;
+                    return table;
+                }
+
+                /// (1, length, d_model) view of positions [offset, offset + length). `reserve` is the initial size
+                torch::Tensor get(std::int64_t offset, std::int64_t length, std::int64_t d_model,
+                                  at::ScalarType dtype, torch::Device device, std::int64_t reserve = 0) {
+                    auto end = offset + length;
+                    if (end > max_cached) {
+                        return positional_encoding(offset, length, d_model).to(device, dtype);
+                    }
+                    std::lock_guard<std::mutex> lock(this->mutex);
+                    auto& pe = this->tables[Key(d_model, static_cast<int>(dtype),
+                                                static_cast<int>(device.type()), static_cast<int>(device.index()))];
+                    if (!pe.defined() || pe.size(1) < end) {
+                        auto n = std::max<std::int64_t>(end, pe.defined() ? 2 * pe.size(1) : reserve);
+                        pe = positional_encoding(0, std::min(n, max_cached), d_model).to(device, dtype);
+                    }
+                    return pe.slice(1, offset, end);
+                }
 
+            private:
+                using Key = std::tuple<std::int64_t, int, int, int>;
+                std::mutex mutex;
+                std::map<Key, torch::Tensor> tables;
+            };
+
+            /// positional encoding without its own table. old checkpoints with a "pe" buffer are still loadable
+            /// because torch::load only reads the buffers registered in the module
             class PositionalEncodingImpl : public torch::nn::Cloneable<PositionalEncodingImpl> {
             public:
                 std::int64_t d_model;
                 float dropout_rate;
+                /// the number of positions reserved in PositionalEncodingTable at the first forward
                 std::int64_t max_len;
                 float scale;
 
                 // submodules
                 torch::nn::Dropout dropout;
-                torch::Tensor pe;
 
                 PositionalEncodingImpl(std::int64_t d_model, float dropout_rate, std::int64_t max_len = 5000)
                     : d_model(d_model), dropout_rate(dropout_rate), max_len(max_len), scale(std::sqrt(d_model)) {
@@ -222,19 +842,14 @@ namespace thxx {
                 }
 
                 void reset() override {
-                    torch::NoGradGuard no_grad;
                     this->dropout = this->register_module("dropout", torch::nn::Dropout(this->dropout_rate));
-                    auto pe = torch::zeros({1, this->max_len, this->d_model});
-                    auto position = torch::arange(0, max_len).unsqueeze(1);
-                    auto div_term = torch::exp(torch::arange(0, d_model, 2) * -std::log(10000.0) / d_model);
-                    pe.slice(2, 0, pe.size(2), 2) = torch::sin(position * div_term);
-                    pe.slice(2, 1, pe.size(2), 2) = torch::cos(position * div_term);
-                    this->pe = this->register_buffer("pe", pe);
                 }
 
-                auto forward(torch::Tensor x) {
-                    AT_ASSERT(x.size(1) <= this->max_len);
-                    auto y = this->scale * x + this->pe.slice(1, 0, x.size(1));
+                /// `offset` is the position of x[:, 0] for incremental decoding and streaming.
+                auto forward(torch::Tensor x, std::int64_t offset = 0) {
+                    auto pe = PositionalEncodingTable::instance().get(
+                        offset, x.size(1), this->d_model, x.scalar_type(), x.device(), this->max_len);
+                    auto y = this->scale * x + pe;
                     return this->dropout->forward(y);
                 }
             };
@@ -248,6 +863,8 @@ namespace thxx {
                 std::int64_t heads;
                 std::int64_t d_ff;
                 float dropout_rate;
+                bool fused_projection;
+                std::int64_t d_head;
 
                 // submodules
                 MultiHeadedAttention self_attn = nullptr;
@@ -256,15 +873,19 @@ namespace thxx {
                 LayerNorm norm1 = nullptr;
                 LayerNorm norm2 = nullptr;
 
-                EncoderLayerImpl(Config c) : EncoderLayerImpl(c.d_model, c.heads, c.d_ff, c.dropout_rate) {}
+                EncoderLayerImpl(Config c)
+                    : EncoderLayerImpl(c.d_model, c.heads, c.d_ff, c.dropout_rate, c.fused_projection, c.d_head) {}
 
-                EncoderLayerImpl(std::int64_t d_model, std::int64_t heads, std::int64_t d_ff, float dropout_rate)
-                    : d_model(d_model), heads(heads), d_ff(d_ff), dropout_rate(dropout_rate) {
+                EncoderLayerImpl(std::int64_t d_model, std::int64_t heads, std::int64_t d_ff, float dropout_rate,
+                                 bool fused_projection = false, std::int64_t d_head = 0)
+                    : d_model(d_model), heads(heads), d_ff(d_ff), dropout_rate(dropout_rate), fused_projection(fused_projection),
+                      d_head(d_head) {
                     this->reset();
                 }
 
                 void reset() override {
-                    this->self_attn = register_module("self_attn", MultiHeadedAttention(heads, d_model, dropout_rate));
+                    auto self = this->fused_projection ? Projection::qkv : Projection::separate;
+                    this->self_attn = register_module("self_attn", MultiHeadedAttention(heads, d_model, dropout_rate, self, d_head));
                     this->pff = register_module("pff", positionwise_feedforward(d_model, d_ff, dropout_rate));
                     this->dropout = this->register_module("dropout", torch::nn::Dropout(this->dropout_rate));
                     this->norm1 = register_module("norm1", LayerNorm(d_model));
@@ -273,14 +894,82 @@ namespace thxx {
 
                 auto forward(torch::Tensor x, torch::Tensor mask) {
                     auto nx = this->norm1->forward(x);
-                    x = x + this->dropout->forward(this->self_attn->forward(nx, nx, nx, mask));
-                    nx = this->norm2->forward(x);
+                    std::tie(x, nx) = this->norm2->forward_residual(
+                        x, this->dropout->forward(this->self_attn->forward(nx, nx, nx, mask)));
                     return std::make_tuple(x + this->dropout->forward(this->pff->forward(nx)), mask);
                 }
+
+                /// encode packed sequences x (total, d_model) with cumulative `offsets` without padded frames
+                torch::Tensor forward_packed(torch::Tensor x, at::IntList offsets) {
+                    auto nx = this->norm1->forward(x);
+                    std::tie(x, nx) = this->norm2->forward_residual(
+                        x, this->dropout->forward(this->self_attn->forward_packed(nx, offsets)));
+                    return x + this->dropout->forward(this->pff->forward(nx));
+                }
+
+                /// encode a chunk attending to itself and the cached key/value of previous chunks.
+                /// the cache keeps at most `left` frames.
+                torch::Tensor forward_chunk(torch::Tensor x, torch::Tensor& k_cache, torch::Tensor& v_cache,
+                                            std::int64_t left) {
+                    auto nx = this->norm1->forward(x);
+                    auto [q, k, v] = this->self_attn->forward_qkv(nx);
+                    if (k_cache.defined()) {
+                        k = torch::cat({k_cache, k}, 2);
+                        v = torch::cat({v_cache, v}, 2);
+                    }
+                    std::tie(x, nx) = this->norm2->forward_residual(
+                        x, this->dropout->forward(this->self_attn->attend(q, k, v, {})));
+                    auto begin = std::max<std::int64_t>(0, k.size(2) - left);
+                    k_cache = k.slice(2, begin);
+                    v_cache = v.slice(2, begin);
+                    return x + this->dropout->forward(this->pff->forward(nx));
+                }
             };
             TORCH_MODULE(EncoderLayer);
 
 
+            /// key/value of a decoder layer kept during incremental decoding
+            struct DecoderLayerCache {
+                /// (batch, heads, decoded length, d_k) self-attention key/value grown every step
+                torch::Tensor self_k, self_v;
+                /// (batch, heads, memory length, d_k) source-attention key/value projected once per utterance
+                torch::Tensor src_k, src_v;
+            };
+
+            /// decoder state for incremental decoding created by DecoderImpl::init_state
+            struct DecoderState {
+                std::vector<DecoderLayerCache> layers;
+                torch::Tensor memory_mask;
+                /// the number of tokens already decoded
+                std::int64_t offset = 0;
+
+                /// reorder or repeat the batch of caches. memory of batch size 1 is kept for broadcasting.
+                void index_select(torch::Tensor index) {
+                    for (auto& l : this->layers) {
+                        l.self_k = l.self_k.index_select(0, index);
+                        l.self_v = l.self_v.index_select(0, index);
+                        if (l.src_k.size(0) != 1) {
+                            l.src_k = l.src_k.index_select(0, index);
+                            l.src_v = l.src_v.index_select(0, index);
+                        }
+                    }
+                    if (this->memory_mask.size(0) != 1) {
+                        this->memory_mask = this->memory_mask.index_select(0, index);
+                    }
+                }
+
+                /// forget the tokens after the first `n` ones (e.g., rejected draft tokens)
+                void truncate(std::int64_t n) {
+                    AT_ASSERT(0 <= n && n <= this->offset);
+                    for (auto& l : this->layers) {
+                        l.self_k = l.self_k.slice(2, 0, n);
+                        l.self_v = l.self_v.slice(2, 0, n);
+                    }
+                    this->offset = n;
+                }
+            };
+
+
             class DecoderLayerImpl : public torch::nn::Cloneable<DecoderLayerImpl> {
             public:
                 // configurations
@@ -288,6 +977,8 @@ namespace thxx {
                 std::int64_t heads;
                 std::int64_t d_ff;
                 float dropout_rate;
+                bool fused_projection;
+                std::int64_t d_head;
 
                 // submodules
                 MultiHeadedAttention self_attn = nullptr;
@@ -298,16 +989,21 @@ namespace thxx {
                 LayerNorm norm2 = nullptr;
                 LayerNorm norm3 = nullptr;
 
-                DecoderLayerImpl(Config c) : DecoderLayerImpl(c.d_model, c.heads, c.d_ff, c.dropout_rate) {}
+                DecoderLayerImpl(Config c)
+                    : DecoderLayerImpl(c.d_model, c.heads, c.d_ff, c.dropout_rate, c.fused_projection, c.d_head) {}
 
-                DecoderLayerImpl(std::int64_t d_model, std::int64_t heads, std::int64_t d_ff, float dropout_rate)
-                    : d_model(d_model), heads(heads), d_ff(d_ff), dropout_rate(dropout_rate) {
+                DecoderLayerImpl(std::int64_t d_model, std::int64_t heads, std::int64_t d_ff, float dropout_rate,
+                                 bool fused_projection = false, std::int64_t d_head = 0)
+                    : d_model(d_model), heads(heads), d_ff(d_ff), dropout_rate(dropout_rate), fused_projection(fused_projection),
+                      d_head(d_head) {
                     this->reset();
                 }
 
                 void reset() override {
-                    this->self_attn = register_module("self_attn", MultiHeadedAttention(heads, d_model, dropout_rate));
-                    this->src_attn = register_module("src_attn", MultiHeadedAttention(heads, d_model, dropout_rate));
+                    auto self = this->fused_projection ? Projection::qkv : Projection::separate;
+                    auto src = this->fused_projection ? Projection::kv : Projection::separate;
+                    this->self_attn = register_module("self_attn", MultiHeadedAttention(heads, d_model, dropout_rate, self, d_head));
+                    this->src_attn = register_module("src_attn", MultiHeadedAttention(heads, d_model, dropout_rate, src, d_head));
                     this->pff = register_module("pff", positionwise_feedforward(d_model, d_ff, dropout_rate));
                     this->dropout = this->register_module("dropout", torch::nn::Dropout(this->dropout_rate));
                     this->norm1 = register_module("norm1", LayerNorm(d_model));
@@ -318,13 +1014,33 @@ namespace thxx {
                 auto forward(torch::Tensor tgt, torch::Tensor tgt_mask,
                              torch::Tensor memory, torch::Tensor memory_mask) {
                     auto nx = this->norm1->forward(tgt);
-                    auto x = tgt + this->dropout->forward(this->self_attn->forward(nx, nx, nx, tgt_mask));
-                    nx = this->norm2->forward(x);
-                    x = x + this->dropout->forward(this->src_attn->forward(nx, memory, memory, memory_mask));
-                    nx = this->norm3->forward(x);
+                    torch::Tensor x;
+                    std::tie(x, nx) = this->norm2->forward_residual(
+                        tgt, this->dropout->forward(this->self_attn->forward(nx, nx, nx, tgt_mask)));
+                    std::tie(x, nx) = this->norm3->forward_residual(
+                        x, this->dropout->forward(this->src_attn->forward(nx, memory, memory, memory_mask)));
                     x = x + this->dropout->forward(this->pff->forward(nx));
                     return std::make_tuple(x, tgt_mask);
                 }
+
+                /// process only the newest tokens `tgt` with the key/value of the previous tokens in `cache`
+                auto forward_incremental(torch::Tensor tgt, torch::Tensor tgt_mask,
+                                         DecoderLayerCache& cache, torch::Tensor memory_mask) {
+                    auto nx = this->norm1->forward(tgt);
+                    auto [q, k, v] = this->self_attn->forward_qkv(nx);
+                    if (cache.self_k.defined()) {
+                        k = torch::cat({cache.self_k, k}, 2);
+                        v = torch::cat({cache.self_v, v}, 2);
+                    }
+                    cache.self_k = k;
+                    cache.self_v = v;
+                    torch::Tensor x;
+                    std::tie(x, nx) = this->norm2->forward_residual(
+                        tgt, this->dropout->forward(this->self_attn->attend(q, k, v, tgt_mask)));
+                    std::tie(x, nx) = this->norm3->forward_residual(
+                        x, this->dropout->forward(this->src_attn->forward_attention(nx, cache.src_k, cache.src_v, memory_mask)));
+                    return x + this->dropout->forward(this->pff->forward(nx));
+                }
             };
             TORCH_MODULE(DecoderLayer);
 
@@ -335,49 +1051,145 @@ namespace thxx {
                 std::int64_t n_freq;
                 std::int64_t n_feat;
                 float dropout_rate;
+                /// subsampling rate of time and frequency (4, 6 or 8)
+                std::int64_t rate;
+                /// input frames seen by an output frame and input frames between output frames
+                std::int64_t context;
+                std::int64_t stride;
 
                 // submodules
-                torch::nn::Conv2d conv1 = nullptr;
-                torch::nn::Conv2d conv2 = nullptr;
-                torch::nn::Linear out = nullptr;
+                std::vector<torch::nn::Conv2d> convs;
+                Linear out = nullptr;
                 PositionalEncoding pe = nullptr;
 
-                Conv2dSubsamplingImpl(std::int64_t n_freq, std::int64_t n_feat, float dropout_rate)
-                    : n_freq(n_freq), n_feat(n_feat), dropout_rate(dropout_rate) {
+                Conv2dSubsamplingImpl(std::int64_t n_freq, std::int64_t n_feat, float dropout_rate, std::int64_t rate = 4)
+                    : n_freq(n_freq), n_feat(n_feat), dropout_rate(dropout_rate), rate(rate) {
                     this->reset();
                 }
 
+                Conv2dSubsamplingImpl(std::int64_t n_freq, const Config& config)
+                    : Conv2dSubsamplingImpl(n_freq, config.d_model, config.dropout_rate, config.subsampling) {}
+
+                /// (kernel, stride) of convolutions for the subsampling `rate`
+                static std::vector<std::pair<std::int64_t, std::int64_t>> conv_specs(std::int64_t rate) {
+                    switch (rate) {
+                    case 4: return {{3, 2}, {3, 2}};
+                    case 6: return {{3, 2}, {5, 3}};
+                    case 8: return {{3, 2}, {3, 2}, {3, 2}};
+                    }
+                    AT_ERROR("subsampling rate should be 4, 6 or 8 but ", rate);
+                }
+
                 void reset() override {
-                    auto c1 = torch::nn::Conv2dOptions(1, n_feat, 3).stride(2);
-                    auto c2 = torch::nn::Conv2dOptions(n_feat, n_feat, 3).stride(2);
-                    this->conv1 = register_module("conv1", torch::nn::Conv2d(c1));
-                    this->conv2 = register_module("conv2", torch::nn::Conv2d(c2));
-                    this->out = register_module("out", torch::nn::Linear(n_feat * (n_freq / 4), n_feat));
+                    this->convs.clear();
+                    this->context = 1;
+                    this->stride = 1;
+                    auto in_channels = 1;
+                    for (auto [kernel, s] : conv_specs(this->rate)) {
+                        auto c = torch::nn::Conv2dOptions(in_channels, n_feat, kernel).stride(s);
+                        auto name = "conv" + std::to_string(this->convs.size() + 1);
+                        this->convs.push_back(register_module(name, torch::nn::Conv2d(c)));
+                        this->context += (kernel - 1) * this->stride;
+                        this->stride *= s;
+                        in_channels = n_feat;
+                    }
+                    this->out = register_module("out", Linear(n_feat * this->output_length(n_freq), n_feat));
                     this->pe = register_module("pe", PositionalEncoding(n_feat, dropout_rate));
                 }
 
+                /// the number of output frames (or frequency bins) of `n` inputs
+                std::int64_t output_length(std::int64_t n) const {
+                    return n < this->context ? 0 : (n - this->context) / this->stride + 1;
+                }
+
+                /// mask (b, 1, t') of the output frames of a padding mask (b, 1, t). as forward_packed, an utterance of
+                /// n frames has output_length(n) frames, so no output frame convolves padded input frames
+                static torch::Tensor subsample_mask(torch::Tensor mask, std::int64_t context, std::int64_t stride) {
+                    auto n = kernel::autograd::data(mask).to(at::kLong).sum(-1, true);
+                    // (n - context) / stride + 1 for n >= context, otherwise 0
+                    auto n_out = ((n - (context - stride)) / stride).clamp_min(0);
+                    auto t = mask.size(2) < context ? 0 : (mask.size(2) - context) / stride + 1;
+                    auto ret = at::arange(t, n.options()).view({1, 1, -1}) < n_out;
+                    return mask.is_variable() ? torch::autograd::make_variable(ret) : ret;
+                }
+
                 auto subsample_mask(torch::Tensor mask) {
-                    for (std::int64_t i = 0; i < 2; ++i) {
-                        mask = mask.slice(2, 0, mask.size(2) - 2, 2);
-                    }
-                    return mask;
+                    return subsample_mask(mask, this->context, this->stride);
                 }
 
-                auto forward(torch::Tensor x, torch::Tensor mask) {
+                /**
+                   (b, t, f) -> (b, t', n_feat) without positional encoding
+
+                   Convolutions run on (b, c, f, t) so that the last output viewed as (b, c * f', t') is
+                   the transposed input of `out` and no (b, t', c * f') copy is made. The time and frequency
+                   axes of the kernels are swapped accordingly, hence checkpoints are the same as (b, c, t, f).
+                */
+                torch::Tensor subsample(torch::Tensor x) {
                     AT_ASSERT(x.dim() == 3); // (b, t, f)
                     AT_ASSERT(x.size(2) == n_freq);
-                    auto c1 = this->conv1->forward(x.unsqueeze(1)).relu();
-                    auto c2 = this->conv2->forward(c1).relu();
+                    auto h = x.transpose(1, 2).unsqueeze(1);
+                    for (auto& conv : this->convs) {
+                        const auto& o = conv->options;
+                        h = torch::conv2d(h, conv->weight.transpose(2, 3), conv->bias, o.stride_, o.padding_).relu();
+                    }
+                    auto n_batch = h.size(0);
+                    auto n_time = h.size(3);
+                    h = h.view({n_batch, -1, n_time}); // (b, c * f', t')
+                    auto w = this->out->weight.t().unsqueeze(0).expand({n_batch, -1, -1});
+                    // (b, t', c * f') x (b, c * f', n_feat) as a transposed GEMM operand
+                    auto y = torch::bmm(h.transpose(1, 2), w);
+                    return this->out->with_bias ? y + this->out->bias : y;
+                }
 
-                    auto n_batch = c2.size(0);
-                    auto n_time = c2.size(2);
-                    auto h = c2.transpose(1, 2).contiguous().view({n_batch, n_time, -1});
-                    auto y = this->pe->forward(this->out->forward(h));
+                auto forward(torch::Tensor x, torch::Tensor mask) {
+                    auto y = this->pe->forward(this->subsample(x));
                     return std::make_tuple(y, this->subsample_mask(mask));
                 }
+
+                /// subsample each of packed sequences x (total, f) separately so that no padded frame is convolved.
+                /// returns packed (total', n_feat) and its offsets
+                std::tuple<torch::Tensor, std::vector<std::int64_t>> forward_packed(torch::Tensor x, at::IntList offsets) {
+                    AT_ASSERT(x.dim() == 2);
+                    std::vector<torch::Tensor> ys;
+                    std::vector<std::int64_t> ret_offsets = {0};
+                    for (size_t i = 0; i + 1 < offsets.size(); ++i) {
+                        AT_ASSERT(offsets[i + 1] - offsets[i] >= context);
+                        auto y = this->pe->forward(this->subsample(x.slice(0, offsets[i], offsets[i + 1]).unsqueeze(0)))[0];
+                        ret_offsets.push_back(ret_offsets.back() + y.size(0));
+                        ys.push_back(y);
+                    }
+                    return std::make_tuple(torch::cat(ys, 0), ret_offsets);
+                }
+
+                /// subsample a chunk (1, t, f) of a stream. input frames not covered by a complete
+                /// receptive field are kept in `state.buffer` as the left context of the next chunk.
+                torch::Tensor forward_chunk(torch::Tensor x, EncoderStreamState& state) {
+                    AT_ASSERT(x.dim() == 3 && x.size(0) == 1);
+                    if (state.buffer.defined()) {
+                        x = torch::cat({state.buffer, x}, 1);
+                    }
+                    auto n_out = x.size(1) < context ? 0 : (x.size(1) - context) / stride + 1;
+                    state.buffer = x.slice(1, n_out * stride);
+                    if (n_out == 0) {
+                        return torch::zeros({1, 0, this->n_feat}, x.options());
+                    }
+                    auto y = this->subsample(x.slice(1, 0, (n_out - 1) * stride + context));
+                    y = this->pe->forward(y, state.offset);
+                    state.offset += n_out;
+                    return y;
+                }
             };
             TORCH_MODULE(Conv2dSubsampling);
 
+            /// the smallest confidence of utterances in `logits` (batch, time, n_class) of an exit head,
+            /// where the confidence of an utterance is the max posterior averaged over its frames in `mask` (batch, 1, time)
+            static double exit_confidence(torch::Tensor logits, torch::Tensor mask) {
+                auto p = std::get<0>(kernel::autograd::data(logits).to(at::kFloat).softmax(-1).max(-1));
+                auto m = kernel::autograd::data(mask).squeeze(1).to(at::kFloat);
+                auto c = (p * m).sum(-1) / m.sum(-1).clamp_min(1);
+                return c.min().template item<double>();
+            }
+
             template <typename InputLayer>
             class EncoderImpl : public torch::nn::Cloneable<EncoderImpl<InputLayer>> {
             public:
@@ -386,33 +1198,198 @@ namespace thxx {
                 // configurations
                 std::int64_t idim;
                 Config config;
+                /// output size of the exit heads (0 for no exit head)
+                std::int64_t n_exit_classes;
 
                 // submodules
                 InputLayer input_layer = nullptr;
                 std::vector<EncoderLayer> layers;
                 LayerNorm norm = nullptr;
+                /// exit heads after the layers of Config::exit_interval
+                std::vector<Linear> exits;
 
-                EncoderImpl(std::int64_t idim, Config config)
-                    : idim(idim), config(config) {
+                EncoderImpl(std::int64_t idim, Config config, std::int64_t n_exit_classes = 0)
+                    : idim(idim), config(config), n_exit_classes(n_exit_classes) {
                     this->reset();
                 }
 
                 void reset() override {
-                    this->input_layer = register_module("input_layer", InputLayer(this->idim, this->config.d_model, this->config.dropout_rate));
+                    this->input_layer = register_module("input_layer", InputLayer(this->idim, this->config));
                     this->layers.reserve(this->config.elayers);
                     for (std::int64_t i = 0; i < this->config.elayers; ++i) {
                         this->layers.push_back(register_module("e" + std::to_string(i), EncoderLayer(this->config)));
                     }
                     this->norm = register_module("norm", LayerNorm(this->config.d_model));
+                    if (this->config.exit_interval > 0 && this->n_exit_classes > 0) {
+                        for (auto i = this->config.exit_interval; i < this->config.elayers; i += this->config.exit_interval) {
+                            this->exits.push_back(register_module("exit" + std::to_string(this->exits.size()),
+                                                                  Linear(this->config.d_model, this->n_exit_classes)));
+                        }
+                    }
                 }
 
-                auto forward(torch::Tensor x, torch::Tensor mask) {
+                /// index of the exit head after the `i`-th layer or -1
+                std::int64_t exit_index(std::int64_t i) const {
+                    auto interval = this->config.exit_interval;
+                    if (interval <= 0 || (i + 1) % interval != 0) return -1;
+                    auto e = (i + 1) / interval - 1;
+                    return e < static_cast<std::int64_t>(this->exits.size()) ? e : -1;
+                }
+
+                /**
+                   run the layers by `layer_fn(layer, h, xs)` in checkpointed segments of inputs `xs` = {x, ...}.
+
+                   layers drawn by Config::layer_drop are skipped in training. they are drawn before checkpointing
+                   so that recomputation skips the same ones. non-null `exits` receives the outputs of the exit layers.
+                */
+                template <typename LayerFn>
+                torch::Tensor run_layers(std::vector<torch::Tensor> xs, LayerFn layer_fn, std::vector<torch::Tensor>* exits) {
+                    auto n_layers = static_cast<std::int64_t>(this->layers.size());
+                    auto step = this->config.checkpoint_layers > 0 && this->is_training()
+                        ? this->config.checkpoint_layers : n_layers;
+                    std::vector<std::uint8_t> skip(n_layers, 0);
+                    if (this->is_training() && this->config.layer_drop > 0) {
+                        auto r = at::rand({n_layers});
+                        for (std::int64_t i = 0; i < n_layers; ++i) {
+                            skip[i] = r.template data<float>()[i] < this->config.layer_drop;
+                        }
+                    }
+                    for (std::int64_t begin = 0; begin < n_layers; begin += step) {
+                        auto end = std::min(begin + step, n_layers);
+                        std::vector<EncoderLayer> segment(this->layers.begin() + begin, this->layers.begin() + end);
+                        std::vector<std::uint8_t> segment_skip(skip.begin() + begin, skip.begin() + end);
+                        std::vector<std::uint8_t> segment_exit;
+                        for (auto i = begin; i < end; ++i) {
+                            segment_exit.push_back(exits != nullptr && this->exit_index(i) >= 0);
+                        }
+                        // mutable to call the (non-const) layers
+                        auto run = [segment, segment_skip, segment_exit, layer_fn](const std::vector<torch::Tensor>& xs) mutable {
+                            // {the last output, the outputs of exit layers...}
+                            std::vector<torch::Tensor> ret = {xs[0]};
+                            for (size_t i = 0; i < segment.size(); ++i) {
+                                if (!segment_skip[i]) {
+                                    ret[0] = layer_fn(segment[i], ret[0], xs);
+                                }
+                                if (segment_exit[i]) {
+                                    ret.push_back(ret[0]);
+                                }
+                            }
+                            return ret;
+                        };
+                        auto ys = step < n_layers ? kernel::checkpoint(run, xs) : run(xs);
+                        xs[0] = ys[0];
+                        if (exits != nullptr) {
+                            exits->insert(exits->end(), ys.begin() + 1, ys.end());
+                        }
+                    }
+                    return xs[0];
+                }
+
+                /// non-null `exits` receives the normalized outputs of the exit layers for their losses.
+                /// otherwise encoding stops at a confident exit in eval mode (see Config::exit_threshold)
+                auto forward(torch::Tensor x, torch::Tensor mask, std::vector<torch::Tensor>* exits = nullptr) {
                     std::tie(x, mask) = this->input_layer->forward(x, mask);
-                    for (auto& l : this->layers) {
-                        std::tie(x, mask) = l->forward(x, mask);
+                    // layers see the same chunks as forward_chunk while the returned mask stays (b, 1, t)
+                    auto layer_mask = mask;
+                    if (this->config.stream_chunk > 0) {
+                        auto c = chunk_mask(x.size(1), this->config.stream_chunk, this->config.stream_left_chunks, x.device());
+                        layer_mask = mask.__and__(c.unsqueeze(0));
+                    }
+                    if (exits == nullptr && !this->is_training() && this->config.exit_threshold > 0 && !this->exits.empty()) {
+                        for (size_t i = 0; i < this->layers.size(); ++i) {
+                            x = std::get<0>(this->layers[i]->forward(x, layer_mask));
+                            auto e = this->exit_index(i);
+                            if (e < 0) continue;
+                            auto h = this->norm->forward(x);
+                            if (exit_confidence(this->exits[e]->forward(h), mask) > this->config.exit_threshold) {
+                                return std::make_tuple(h, mask);
+                            }
+                        }
+                        return std::make_tuple(this->norm->forward(x), mask);
+                    }
+                    auto layer_fn = [](EncoderLayer& l, torch::Tensor h, const std::vector<torch::Tensor>& xs) {
+                        return std::get<0>(l->forward(h, xs[1]));
+                    };
+                    x = this->run_layers({x, layer_mask}, layer_fn, exits);
+                    if (exits != nullptr) {
+                        for (auto& h : *exits) {
+                            h = this->norm->forward(h);
+                        }
                     }
                     return std::make_tuple(this->norm->forward(x), mask);
                 }
+
+                /// encode packed sequences x (total, idim) with cumulative `offsets` into packed (total', d_model).
+                /// FFN, LayerNorm and attention process only real frames. returns (y, offsets of y).
+                /// non-null `exits` receives the normalized (packed) outputs of the exit layers.
+                /// otherwise encoding stops at a confident exit in eval mode as forward does
+                auto forward_packed(torch::Tensor x, at::IntList offsets, std::vector<torch::Tensor>* exits = nullptr) {
+                    AT_ASSERT(this->config.stream_chunk == 0);
+                    torch::Tensor h;
+                    std::vector<std::int64_t> h_offsets;
+                    std::tie(h, h_offsets) = this->input_layer->forward_packed(x, offsets);
+                    if (exits == nullptr && !this->is_training() && this->config.exit_threshold > 0 && !this->exits.empty()) {
+                        // the confidence is averaged over real frames of the padded logits
+                        std::vector<std::int64_t> lengths;
+                        for (size_t i = 0; i + 1 < h_offsets.size(); ++i) {
+                            lengths.push_back(h_offsets[i + 1] - h_offsets[i]);
+                        }
+                        auto mask = pad_mask(lengths, h.device()).unsqueeze(-2);
+                        for (size_t i = 0; i < this->layers.size(); ++i) {
+                            h = this->layers[i]->forward_packed(h, h_offsets);
+                            auto e = this->exit_index(i);
+                            if (e < 0) continue;
+                            auto y = this->norm->forward(h);
+                            auto logits = pad_packed(this->exits[e]->forward(y), h_offsets);
+                            if (exit_confidence(logits, mask) > this->config.exit_threshold) {
+                                return std::make_tuple(y, h_offsets);
+                            }
+                        }
+                        return std::make_tuple(this->norm->forward(h), h_offsets);
+                    }
+                    auto layer_fn = [h_offsets](EncoderLayer& l, torch::Tensor y, const std::vector<torch::Tensor>&) {
+                        return l->forward_packed(y, h_offsets);
+                    };
+                    h = this->run_layers({h}, layer_fn, exits);
+                    if (exits != nullptr) {
+                        for (auto& e : *exits) {
+                            e = this->norm->forward(e);
+                        }
+                    }
+                    return std::make_tuple(this->norm->forward(h), h_offsets);
+                }
+
+                /// encode a chunk (1, t, idim) of a stream into (1, t', d_model) frames of completed chunks.
+                /// memory of `state` is bounded by the chunk size and `stream_left_chunks`.
+                /// set `last` at the end of the stream to flush an incomplete chunk.
+                torch::Tensor forward_chunk(torch::Tensor x, EncoderStreamState& state, bool last = false) {
+                    auto chunk = this->config.stream_chunk;
+                    AT_ASSERT(chunk > 0);
+                    if (state.k.empty()) {
+                        state.k.resize(this->layers.size());
+                        state.v.resize(this->layers.size());
+                    }
+                    auto h = this->input_layer->forward_chunk(x, state);
+                    if (state.pending.defined()) {
+                        h = torch::cat({state.pending, h}, 1);
+                    }
+                    auto n = last ? h.size(1) : h.size(1) / chunk * chunk;
+                    state.pending = h.slice(1, n);
+
+                    std::vector<torch::Tensor> ys;
+                    auto left = this->config.stream_left_chunks * chunk;
+                    for (std::int64_t begin = 0; begin < n; begin += chunk) {
+                        auto y = h.slice(1, begin, std::min(begin + chunk, n));
+                        for (size_t i = 0; i < this->layers.size(); ++i) {
+                            y = this->layers[i]->forward_chunk(y, state.k[i], state.v[i], left);
+                        }
+                        ys.push_back(this->norm->forward(y));
+                    }
+                    if (ys.empty()) {
+                        return h.slice(1, 0, 0);
+                    }
+                    return torch::cat(ys, 1);
+                }
             };
 
             template <typename InputLayer>
@@ -436,16 +1413,30 @@ namespace thxx {
                     this->reset();
                 }
 
+                PositonalEmbeddingImpl(std::int64_t vocab, const Config& config)
+                    : PositonalEmbeddingImpl(vocab, config.d_model, config.dropout_rate) {}
+
                 void reset() override {
                     this->embed = register_module("embed", torch::nn::Embedding(vocab, feat));
                     this->pe = register_module("pe", PositionalEncoding(feat, dropout_rate));
                 }
 
-                auto forward(torch::Tensor x, torch::Tensor mask) {
+                auto forward(torch::Tensor x, torch::Tensor mask, std::int64_t offset = 0) {
                     auto e = this->embed->forward(x);
-                    e = this->pe->forward(e);
+                    e = this->pe->forward(e, offset);
                     return std::make_tuple(e, mask);
                 }
+
+                /// embed each of packed sequences x (total) from position 0. returns (total, feat) and the same offsets
+                std::tuple<torch::Tensor, std::vector<std::int64_t>> forward_packed(torch::Tensor x, at::IntList offsets) {
+                    AT_ASSERT(x.dim() == 1);
+                    std::vector<torch::Tensor> ys;
+                    for (size_t i = 0; i + 1 < offsets.size(); ++i) {
+                        auto e = this->embed->forward(x.slice(0, offsets[i], offsets[i + 1]).unsqueeze(0));
+                        ys.push_back(this->pe->forward(e)[0]);
+                    }
+                    return std::make_tuple(torch::cat(ys, 0), offsets.vec());
+                }
             };
             TORCH_MODULE(PositonalEmbedding);
 
@@ -459,7 +1450,7 @@ namespace thxx {
                 PositonalEmbedding embed = nullptr;
                 std::vector<DecoderLayer> layers;
                 LayerNorm output_norm = nullptr;
-                torch::nn::Linear output_layer = nullptr;
+                Linear output_layer = nullptr;
 
                 DecoderImpl(std::int64_t odim, Config config)
                     : odim(odim), config(config) {
@@ -469,21 +1460,70 @@ namespace thxx {
                 void reset() override {
                     this->embed = register_module("embed", PositonalEmbedding(this->odim, this->config.d_model, this->config.dropout_rate));
                     this->output_norm = register_module("output_norm", LayerNorm(this->config.d_model));
-                    this->output_layer = register_module("output_layer", torch::nn::Linear(this->config.d_model, this->odim));
-                    this->layers.reserve(this->config.elayers);
-                    for (std::int64_t i = 0; i < this->config.elayers; ++i) {
+                    this->output_layer = register_module("output_layer", Linear(this->config.d_model, this->odim));
+                    this->layers.reserve(this->config.dlayers);
+                    for (std::int64_t i = 0; i < this->config.dlayers; ++i) {
                         this->layers.push_back(register_module("d" + std::to_string(i), DecoderLayer(this->config)));
                     }
                 }
 
                 auto forward(torch::Tensor tgt, torch::Tensor tgt_mask,
                              torch::Tensor memory, torch::Tensor memory_mask) {
+                    auto [x, mask] = this->forward_hidden(tgt, tgt_mask, memory, memory_mask);
+                    return std::make_tuple(this->output_layer->forward(x), mask);
+                }
+
+                /// normalized features before output_layer, e.g., for kernel::linear_label_smoothing
+                std::tuple<torch::Tensor, torch::Tensor> forward_hidden(torch::Tensor tgt, torch::Tensor tgt_mask,
+                                                                        torch::Tensor memory, torch::Tensor memory_mask) {
                     auto [x, mask] = this->embed->forward(tgt, tgt_mask);
+                    auto n_layers = static_cast<std::int64_t>(this->layers.size());
+                    auto step = this->config.checkpoint_layers > 0 && this->is_training()
+                        ? this->config.checkpoint_layers : n_layers;
+                    for (std::int64_t begin = 0; begin < n_layers; begin += step) {
+                        std::vector<DecoderLayer> segment(this->layers.begin() + begin,
+                                                          this->layers.begin() + std::min(begin + step, n_layers));
+                        // mutable to call the (non-const) layers
+                        auto run = [segment](const std::vector<torch::Tensor>& xs) mutable {
+                            auto h = xs[0];
+                            for (auto& l : segment) {
+                                h = std::get<0>(l->forward(h, xs[1], xs[2], xs[3]));
+                            }
+                            return std::vector<torch::Tensor>{h};
+                        };
+                        std::vector<torch::Tensor> inputs = {x, mask, memory, memory_mask};
+                        x = step < n_layers ? kernel::checkpoint(run, inputs)[0] : run(inputs)[0];
+                    }
+                    return std::make_tuple(this->output_norm->forward(x), mask);
+                }
+
+                /// precompute source-attention key/value of `memory` for incremental decoding
+                DecoderState init_state(torch::Tensor memory, torch::Tensor memory_mask) {
+                    DecoderState state;
+                    state.memory_mask = memory_mask;
+                    state.layers.reserve(this->layers.size());
                     for (auto& l : this->layers) {
-                        std::tie(x, mask) = l->forward(x, mask, memory, memory_mask);
+                        auto [k, v] = l->src_attn->forward_kv(memory, memory);
+                        state.layers.push_back({{}, {}, k, v});
                     }
-                    x = this->output_layer->forward(this->output_norm->forward(x));
-                    return std::make_tuple(x, mask);
+                    return state;
+                }
+
+                /// returns (batch, time, odim) output of the newest tokens `tgt` and updates `state`
+                torch::Tensor forward_incremental(torch::Tensor tgt, DecoderState& state) {
+                    AT_ASSERT(state.layers.size() == this->layers.size());
+                    auto n = tgt.size(1);
+                    // a single token can attend to all the cached tokens
+                    torch::Tensor mask;
+                    if (n > 1) {
+                        mask = subsequent_mask(state.offset + n, tgt.device()).slice(0, state.offset).unsqueeze(0);
+                    }
+                    auto [x, _m] = this->embed->forward(tgt, mask, state.offset);
+                    for (size_t i = 0; i < this->layers.size(); ++i) {
+                        x = this->layers[i]->forward_incremental(x, mask, state.layers[i], state.memory_mask);
+                    }
+                    state.offset += n;
+                    return this->output_layer->forward(this->output_norm->forward(x));
                 }
             };
             TORCH_MODULE(Decoder);
@@ -494,6 +1534,11 @@ namespace thxx {
             double score = 0;
             std::vector<std::int64_t> tokens;
 
+            /// sort by descending score
+            static bool compare(const Hypothesis& a, const Hypothesis& b) {
+                return a.score > b.score;
+            }
+
             std::string to_string(const std::vector<std::string>& char_list) const {
                 std::string ret;
                 for (auto t: tokens) {
@@ -503,6 +1548,448 @@ namespace thxx {
             }
         };
 
+        /// the number of decoding steps allowed for `n_frames` encoded frames of `n_input` input frames.
+        /// without max_len_ratio, the number of input frames as the original recognize (encoded frames if n_input = 0)
+        static std::int64_t max_output_length(std::int64_t n_frames, const transformer::Config& config, std::int64_t n_input = 0) {
+            if (config.max_len_ratio == 0) return n_input > 0 ? n_input : n_frames;
+            return std::max<std::int64_t>(1, static_cast<std::int64_t>(config.max_len_ratio * n_frames));
+        }
+
+        /// the number of decoding steps before eos is allowed for `n_frames` encoded frames
+        static std::int64_t min_output_length(std::int64_t n_frames, const transformer::Config& config) {
+            return static_cast<std::int64_t>(config.min_len_ratio * n_frames);
+        }
+
+        /**
+           Greedy search of a padded batch `memory` (batch, time, d_model) of `src_length` input frames (optional).
+
+           Rows that emitted eos or reached their max_len_ratio limit are dropped from the decoded batch
+           and decoding stops when no row is left.
+         */
+        template <typename Decoder>
+        std::vector<Hypothesis> greedy_search(Decoder& decoder, torch::Tensor memory, torch::Tensor memory_mask,
+                                              std::int64_t sos, std::int64_t eos, const transformer::Config& config,
+                                              at::IntList src_length = {}) {
+            auto device = memory.device();
+            auto n_batch = memory.size(0);
+            auto n_frames = memory_mask.sum(-1).view(-1).to(at::kLong).to(torch::kCPU);
+            std::vector<std::int64_t> max_len(n_batch), min_len(n_batch), active(n_batch);
+            for (std::int64_t i = 0; i < n_batch; ++i) {
+                auto n = n_frames.template data<std::int64_t>()[i];
+                max_len[i] = max_output_length(n, config, src_length.empty() ? 0 : src_length[i]);
+                min_len[i] = min_output_length(n, config);
+                active[i] = i;
+            }
+
+            std::vector<Hypothesis> results(n_batch);
+            for (auto& h : results) {
+                h.tokens.push_back(sos);
+            }
+            auto state = decoder->init_state(memory, memory_mask);
+            auto ys = torch::full({n_batch, 1}, sos, torch::TensorOptions().dtype(at::kLong).device(device));
+            auto scores = torch::zeros({n_batch}, torch::TensorOptions(device));
+            constexpr auto inf = std::numeric_limits<float>::infinity();
+            for (std::int64_t step = 0; !active.empty(); ++step) {
+                auto logp = decoder->forward_incremental(ys, state).select(1, -1).to(at::kFloat).log_softmax(-1);
+                std::vector<std::int64_t> no_eos;
+                for (size_t j = 0; j < active.size(); ++j) {
+                    if (step < min_len[active[j]]) no_eos.push_back(j);
+                }
+                if (!no_eos.empty()) {
+                    auto idx = torch::tensor(at::ArrayRef<std::int64_t>(no_eos), at::kLong).to(device);
+                    logp.select(1, eos).index_fill_(0, idx, -inf);
+                }
+                auto [max_prob, next_id] = logp.max(1);
+                scores += max_prob;
+
+                auto next_cpu = next_id.to(torch::kCPU);
+                auto next = next_cpu.template data<std::int64_t>();
+                // copied once at the first finished row of this step
+                at::Tensor scores_cpu;
+                std::vector<std::int64_t> keep, remained;
+                for (size_t j = 0; j < active.size(); ++j) {
+                    auto i = active[j];
+                    auto t = step == max_len[i] ? eos : next[j];
+                    results[i].tokens.push_back(t);
+                    if (t == eos) {
+                        if (!scores_cpu.defined()) {
+                            scores_cpu = kernel::autograd::data(scores).to(torch::kCPU);
+                        }
+                        results[i].score = scores_cpu.template data<float>()[j];
+                    } else {
+                        keep.push_back(j);
+                        remained.push_back(i);
+                    }
+                }
+                if (keep.size() != active.size() && !keep.empty()) {
+                    auto idx = torch::tensor(at::ArrayRef<std::int64_t>(keep), at::kLong).to(device);
+                    next_id = next_id.index_select(0, idx);
+                    scores = scores.index_select(0, idx);
+                    state.index_select(idx);
+                }
+                active = std::move(remained);
+                ys = next_id.unsqueeze(1);
+            }
+            return results;
+        }
+
+        /**
+           Beam search of a single utterance `memory` (1, time, d_model) of `src_length` input frames (0 if unknown).
+
+           All the active beams are decoded as one batch by Decoder::forward_incremental
+           and the hypotheses are stored as back pointers to avoid copying shared prefixes.
+         */
+        template <typename Decoder>
+        std::vector<Hypothesis> beam_search(Decoder& decoder, torch::Tensor memory, torch::Tensor memory_mask,
+                                            std::int64_t sos, std::int64_t eos, const transformer::Config& config,
+                                            std::int64_t src_length = 0) {
+            AT_ASSERT(memory.size(0) == 1);
+            auto device = memory.device();
+            auto beam = config.beam_size;
+            auto n_frames = memory.size(1);
+            auto max_len = max_output_length(n_frames, config, src_length);
+            auto min_len = min_output_length(n_frames, config);
+
+            auto state = decoder->init_state(memory, memory_mask);
+            auto ys = torch::full({1, 1}, sos, torch::TensorOptions().dtype(at::kLong).device(device));
+            auto scores = torch::zeros({1}, torch::TensorOptions(device));
+            // tokens[i][j] is the last token of the j-th active hypothesis at step i and parents[i][j] is its prefix at step i - 1
+            std::vector<torch::Tensor> tokens = {ys.view(-1).to(torch::kCPU)};
+            std::vector<torch::Tensor> parents = {torch::zeros({1}, at::kLong)};
+            auto backtrack = [&](std::int64_t step, std::int64_t j) {
+                std::vector<std::int64_t> ret(step + 1);
+                for (auto i = step; i >= 0; --i) {
+                    ret[i] = tokens[i].template data<std::int64_t>()[j];
+                    j = parents[i].template data<std::int64_t>()[j];
+                }
+                return ret;
+            };
+
+            std::vector<Hypothesis> ended;
+            constexpr auto inf = std::numeric_limits<float>::infinity();
+            for (std::int64_t step = 0; step <= max_len; ++step) {
+                auto logp = decoder->forward_incremental(ys, state).select(1, -1).to(at::kFloat).log_softmax(-1);
+                auto odim = logp.size(1);
+                if (step < min_len) {
+                    logp.select(1, eos).fill_(-inf);
+                }
+                if (step == max_len) {
+                    auto eos_logp = logp.select(1, eos).clone();
+                    logp.fill_(-inf).select(1, eos).copy_(eos_logp);
+                }
+                // vectorized top-k over (beam x vocab)
+                auto candidates = (scores.unsqueeze(1) + logp + config.penalty).view(-1);
+                auto [top_scores, top_ids] = candidates.topk(std::min(beam, candidates.size(0)));
+                auto parent = top_ids / odim;
+                auto token = top_ids - parent * odim;
+
+                auto token_cpu = token.to(torch::kCPU);
+                auto parent_cpu = parent.to(torch::kCPU);
+                auto score_cpu = top_scores.to(torch::kCPU);
+                auto t = token_cpu.template data<std::int64_t>();
+                auto p = parent_cpu.template data<std::int64_t>();
+                auto sc = score_cpu.template data<float>();
+                std::vector<std::int64_t> keep;
+                for (std::int64_t j = 0; j < token_cpu.size(0); ++j) {
+                    if (t[j] == eos) {
+                        auto prefix = backtrack(step, p[j]);
+                        prefix.push_back(eos);
+                        ended.push_back({sc[j], prefix});
+                    } else {
+                        keep.push_back(j);
+                    }
+                }
+                if (keep.empty()) break;
+
+                auto keep_cpu = torch::tensor(at::ArrayRef<std::int64_t>(keep), at::kLong);
+                auto keep_idx = keep_cpu.to(device);
+                tokens.push_back(token_cpu.index_select(0, keep_cpu));
+                parents.push_back(parent_cpu.index_select(0, keep_cpu));
+                ys = token.index_select(0, keep_idx).unsqueeze(1);
+                scores = top_scores.index_select(0, keep_idx);
+                state.index_select(parent.index_select(0, keep_idx));
+
+                // active scores never increase without positive penalty
+                if (config.penalty <= 0 && static_cast<std::int64_t>(ended.size()) >= beam) {
+                    std::nth_element(ended.begin(), ended.begin() + beam - 1, ended.end(), Hypothesis::compare);
+                    if (ended[beam - 1].score >= sc[keep.front()]) break;
+                }
+            }
+
+            std::sort(ended.begin(), ended.end(), Hypothesis::compare);
+            if (static_cast<std::int64_t>(ended.size()) > beam) {
+                ended.resize(beam);
+            }
+            return ended;
+        }
+
+        /// log(exp(a) + exp(b))
+        static double log_add(double a, double b) {
+            if (a < b) std::swap(a, b);
+            if (b == -std::numeric_limits<double>::infinity()) return a;
+            return a + std::log1p(std::exp(b - a));
+        }
+
+        /**
+           Batched CTC greedy search of `logp` (batch, time, odim) with `n_frames` valid frames in each utterance.
+
+           The best class of every frame is taken on device at once. Then repeated classes and blanks are
+           collapsed on host, so there is no sequential step on device.
+         */
+        static std::vector<Hypothesis> ctc_greedy_search(torch::Tensor logp, at::IntList n_frames, std::int64_t blank,
+                                                         std::int64_t sos, std::int64_t eos) {
+            AT_ASSERT(logp.dim() == 3);
+            AT_ASSERT(logp.size(0) == static_cast<std::int64_t>(n_frames.size()));
+            auto [best, ids] = logp.max(-1);
+            best = best.to(at::kDouble).to(torch::kCPU).contiguous();
+            ids = ids.to(torch::kCPU).contiguous();
+            auto n_time = ids.size(1);
+            std::vector<Hypothesis> results(n_frames.size());
+            for (size_t i = 0; i < n_frames.size(); ++i) {
+                auto id = ids.template data<std::int64_t>() + i * n_time;
+                auto score = best.template data<double>() + i * n_time;
+                auto& h = results[i];
+                h.tokens.push_back(sos);
+                auto prev = blank;
+                for (std::int64_t t = 0; t < n_frames[i]; ++t) {
+                    if (id[t] != blank && id[t] != prev) {
+                        h.tokens.push_back(id[t]);
+                    }
+                    prev = id[t];
+                    h.score += score[t];
+                }
+                h.tokens.push_back(eos);
+            }
+            return results;
+        }
+
+        /**
+           CTC prefix beam search of a single utterance `logp` (time, odim) on host.
+
+           Each prefix keeps the probabilities of ending with blank and non-blank separately so that
+           the alignments collapsing into the same prefix are merged. Only the `beam` best classes of each frame are expanded.
+         */
+        static std::vector<Hypothesis> ctc_prefix_beam_search(torch::Tensor logp, std::int64_t blank, std::int64_t sos,
+                                                              std::int64_t eos, std::int64_t beam) {
+            AT_ASSERT(logp.dim() == 2);
+            auto lp = logp.to(at::kFloat).to(torch::kCPU).contiguous();
+            auto n_time = lp.size(0);
+            auto n_class = lp.size(1);
+            auto top = std::get<1>(lp.topk(std::min(beam, n_class), -1)).contiguous();
+            auto k = top.size(1);
+
+            using Prefix = std::vector<std::int64_t>;
+            struct Score {
+                double blank = -std::numeric_limits<double>::infinity();
+                double non_blank = -std::numeric_limits<double>::infinity();
+                double total() const { return log_add(blank, non_blank); }
+            };
+            std::map<Prefix, Score> beams;
+            beams[{}].blank = 0;
+            for (std::int64_t t = 0; t < n_time; ++t) {
+                auto row = lp.template data<float>() + t * n_class;
+                auto cls = top.template data<std::int64_t>() + t * k;
+                std::map<Prefix, Score> next;
+                for (const auto& b : beams) {
+                    const auto& prefix = b.first;
+                    const auto& s = b.second;
+                    auto& stay = next[prefix];
+                    stay.blank = log_add(stay.blank, s.total() + row[blank]);
+                    auto extend = [&](std::int64_t c) {
+                        Prefix extended = prefix;
+                        extended.push_back(c);
+                        auto& e = next[extended];
+                        if (!prefix.empty() && prefix.back() == c) {
+                            // a repeated class needs a blank in between, otherwise it collapses into the prefix
+                            e.non_blank = log_add(e.non_blank, s.blank + row[c]);
+                            auto& same = next[prefix];
+                            same.non_blank = log_add(same.non_blank, s.non_blank + row[c]);
+                        } else {
+                            e.non_blank = log_add(e.non_blank, s.total() + row[c]);
+                        }
+                    };
+                    auto has_last = false;
+                    for (std::int64_t j = 0; j < k; ++j) {
+                        auto c = cls[j];
+                        if (c == blank) continue;
+                        has_last = has_last || (!prefix.empty() && prefix.back() == c);
+                        extend(c);
+                    }
+                    if (!prefix.empty() && !has_last) {
+                        // the last class continues the prefix through its non-blank end even out of the top classes
+                        extend(prefix.back());
+                    }
+                }
+                std::vector<std::pair<double, const Prefix*>> order;
+                order.reserve(next.size());
+                for (const auto& n : next) {
+                    // e.g., a repeated class right after its non-blank end has no alignment yet
+                    if (n.second.total() == -std::numeric_limits<double>::infinity()) continue;
+                    order.emplace_back(n.second.total(), &n.first);
+                }
+                auto n_keep = std::min<size_t>(beam, order.size());
+                std::partial_sort(order.begin(), order.begin() + n_keep, order.end(),
+                                  [](const auto& a, const auto& b) { return a.first > b.first; });
+                beams.clear();
+                for (size_t i = 0; i < n_keep; ++i) {
+                    beams.emplace(*order[i].second, next[*order[i].second]);
+                }
+            }
+
+            std::vector<Hypothesis> results;
+            for (const auto& b : beams) {
+                Hypothesis h;
+                h.score = b.second.total();
+                h.tokens.push_back(sos);
+                h.tokens.insert(h.tokens.end(), b.first.begin(), b.first.end());
+                h.tokens.push_back(eos);
+                results.push_back(std::move(h));
+            }
+            std::sort(results.begin(), results.end(), Hypothesis::compare);
+            return results;
+        }
+
+        /// n-best hypotheses of each utterance in padded `memory` (batch, time, d_model) by greedy_search (beam_size = 1)
+        /// or beam_search of every utterance without its padded frames. `src_length` input frames are optional
+        template <typename Decoder>
+        std::vector<std::vector<Hypothesis>> autoregressive_search(Decoder& decoder, torch::Tensor memory, torch::Tensor memory_mask,
+                                                                   std::int64_t sos, std::int64_t eos,
+                                                                   const transformer::Config& config,
+                                                                   at::IntList src_length = {}) {
+            std::vector<std::vector<Hypothesis>> ret;
+            ret.reserve(memory.size(0));
+            if (config.beam_size == 1) {
+                for (auto& h : greedy_search(decoder, memory, memory_mask, sos, eos, config, src_length)) {
+                    ret.push_back({std::move(h)});
+                }
+                return ret;
+            }
+            auto n_frames = memory_mask.sum(-1).view(-1).to(at::kLong).to(torch::kCPU);
+            for (std::int64_t i = 0; i < memory.size(0); ++i) {
+                auto n = n_frames.template data<std::int64_t>()[i];
+                ret.push_back(beam_search(decoder, memory.slice(0, i, i + 1).slice(1, 0, n),
+                                          memory_mask.slice(0, i, i + 1).slice(2, 0, n), sos, eos, config,
+                                          src_length.empty() ? 0 : src_length[i]));
+            }
+            return ret;
+        }
+
+        /**
+           Greedy search of a single utterance `memory` (1, time, d_model) of `src_length` input frames (0 if unknown)
+           drafted by a small `draft` decoder.
+
+           `draft` proposes Config::speculative_tokens tokens one by one. `decoder` then scores all of them by one
+           forward_incremental under the causal mask and accepts the longest prefix agreeing with its own greedy
+           choices, followed by its choice at the first disagreement. The key/value of rejected tokens are truncated.
+           Tokens are the same as greedy_search of `decoder` (up to ties of float logits).
+         */
+        template <typename Decoder, typename Draft>
+        Hypothesis speculative_greedy_search(Decoder& decoder, Draft& draft, torch::Tensor memory, torch::Tensor memory_mask,
+                                             std::int64_t sos, std::int64_t eos, const transformer::Config& config,
+                                             std::int64_t src_length = 0) {
+            AT_ASSERT(memory.size(0) == 1);
+            AT_ASSERT(config.speculative_tokens > 0);
+            auto device = memory.device();
+            auto n_frames = memory_mask.sum().to(at::kLong).template item<std::int64_t>();
+            auto max_len = max_output_length(n_frames, config, src_length);
+            auto min_len = min_output_length(n_frames, config);
+            constexpr auto inf = std::numeric_limits<float>::infinity();
+
+            Hypothesis result;
+            auto& tokens = result.tokens;
+            tokens.push_back(sos);
+            auto state = decoder->init_state(memory, memory_mask);
+            auto draft_state = draft->init_state(memory, memory_mask);
+            auto to_device = [&](const std::int64_t* begin, const std::int64_t* end) {
+                std::vector<std::int64_t> ys(begin, end);
+                return torch::tensor(at::ArrayRef<std::int64_t>(ys), at::kLong).to(device).unsqueeze(0);
+            };
+            // greedy choices of `logits` (n, odim) whose first row decides the `step`-th token as greedy_search
+            auto choose = [&](torch::Tensor logits, std::int64_t step) {
+                auto logp = logits.to(at::kFloat).log_softmax(-1);
+                auto n_no_eos = std::min(logp.size(0), std::max<std::int64_t>(0, min_len - step));
+                if (n_no_eos > 0) {
+                    logp.slice(0, 0, n_no_eos).select(1, eos).fill_(-inf);
+                }
+                auto [best, ids] = logp.max(1);
+                return std::make_tuple(best.to(at::kDouble).to(torch::kCPU).contiguous(), ids.to(torch::kCPU).contiguous());
+            };
+
+            while (true) {
+                // the number of tokens decided so far
+                auto step = static_cast<std::int64_t>(tokens.size()) - 1;
+                auto k = std::min(config.speculative_tokens, max_len - step);
+                std::vector<std::int64_t> proposal;
+                for (std::int64_t j = 0; j < k; ++j) {
+                    auto ys = j == 0 ? to_device(tokens.data() + draft_state.offset, tokens.data() + tokens.size())
+                        : to_device(&proposal.back(), &proposal.back() + 1);
+                    auto ids = std::get<1>(choose(draft->forward_incremental(ys, draft_state)[0].slice(0, -1), step + j));
+                    proposal.push_back(ids.template data<std::int64_t>()[0]);
+                    if (proposal.back() == eos) break;
+                }
+
+                // verify the undecoded tokens and the proposal at once
+                auto n_pending = static_cast<std::int64_t>(tokens.size()) - state.offset;
+                std::vector<std::int64_t> ys(tokens.begin() + state.offset, tokens.end());
+                ys.insert(ys.end(), proposal.begin(), proposal.end());
+                auto logits = decoder->forward_incremental(to_device(ys.data(), ys.data() + ys.size()), state)[0];
+                auto [best, ids] = choose(logits.slice(0, n_pending - 1), step);
+                auto b = best.template data<double>();
+                auto g = ids.template data<std::int64_t>();
+                for (size_t j = 0; ; ++j) {
+                    auto t = step + static_cast<std::int64_t>(j) == max_len ? eos : g[j];
+                    result.score += b[j];
+                    tokens.push_back(t);
+                    if (t == eos) return result;
+                    if (j == proposal.size() || proposal[j] != t) break;
+                }
+                // the last token is not fed to either decoder yet
+                auto n_valid = static_cast<std::int64_t>(tokens.size()) - 1;
+                if (state.offset > n_valid) state.truncate(n_valid);
+                if (draft_state.offset > n_valid) draft_state.truncate(n_valid);
+            }
+        }
+
+        /**
+           speculative_greedy_search of each utterance in padded `memory` (batch, time, d_model) without its padded frames.
+           NOTE: utterances are decoded one at a time (accepted prefixes differ by utterance), so recognize_batch
+           with a draft decoder trades the batched decoder steps of greedy_search for fewer decoder calls per utterance.
+         */
+        template <typename Decoder, typename Draft>
+        std::vector<std::vector<Hypothesis>> speculative_search(Decoder& decoder, Draft& draft, torch::Tensor memory,
+                                                                torch::Tensor memory_mask, std::int64_t sos, std::int64_t eos,
+                                                                const transformer::Config& config, at::IntList src_length = {}) {
+            std::vector<std::vector<Hypothesis>> ret;
+            ret.reserve(memory.size(0));
+            auto n_frames = memory_mask.sum(-1).view(-1).to(at::kLong).to(torch::kCPU);
+            for (std::int64_t i = 0; i < memory.size(0); ++i) {
+                auto n = n_frames.template data<std::int64_t>()[i];
+                ret.push_back({speculative_greedy_search(decoder, draft, memory.slice(0, i, i + 1).slice(1, 0, n),
+                                                         memory_mask.slice(0, i, i + 1).slice(2, 0, n), sos, eos, config,
+                                                         src_length.empty() ? 0 : src_length[i])});
+            }
+            return ret;
+        }
+
+        /// n-best hypotheses of each utterance from CTC `logp` (batch, time, odim) with blank 0 and padding `memory_mask`
+        static std::vector<std::vector<Hypothesis>> ctc_search(torch::Tensor logp, torch::Tensor memory_mask,
+                                                               std::int64_t sos, std::int64_t eos, std::int64_t beam_size) {
+            auto n_frames = memory_mask.sum(-1).view(-1).to(at::kLong).to(torch::kCPU);
+            auto lengths = at::IntList(n_frames.template data<std::int64_t>(), n_frames.size(0));
+            std::vector<std::vector<Hypothesis>> ret;
+            ret.reserve(lengths.size());
+            if (beam_size == 1) {
+                for (auto& h : ctc_greedy_search(logp, lengths, 0, sos, eos)) {
+                    ret.push_back({std::move(h)});
+                }
+            } else {
+                for (size_t i = 0; i < lengths.size(); ++i) {
+                    ret.push_back(ctc_prefix_beam_search(logp[i].slice(0, 0, lengths[i]), 0, sos, eos, beam_size));
+                }
+            }
+            return ret;
+        }
+
         template <typename InputLayer>
         class TransformerImpl : public torch::nn::Cloneable<TransformerImpl<InputLayer>> {
         public:
@@ -519,6 +2006,14 @@ namespace thxx {
             // submodules
             transformer::Encoder<InputLayer> encoder = nullptr;
             transformer::Decoder decoder = nullptr;
+            /// small decoder drafting tokens for speculative_greedy_search. created only if config.draft_dlayers > 0
+            transformer::Decoder draft = nullptr;
+            /// CTC projection of the encoder output (blank is 0). created only if config.ctc_weight > 0
+            Linear ctc = nullptr;
+            /// updated by every forward. reset it at the beginning of an epoch or a dev loop
+            Metrics metrics;
+            /// loss and accuracy of the draft decoder kept out of `metrics`. updated by every forward with the draft
+            Metrics draft_metrics;
 
             TransformerImpl(std::int64_t idim, std::int64_t odim, transformer::Config config)
                 : idim(idim), odim(odim), config(config), sos(odim-1), eos(odim-1), ignore_index(odim) {
@@ -526,68 +2021,192 @@ namespace thxx {
             }
 
             void reset() override {
-                this->encoder = register_module("encoder", transformer::Encoder<InputLayer>(idim, config));
+                // exit heads are trained by CTC
+                AT_ASSERT(this->config.exit_interval == 0 || this->config.ctc_weight > 0);
+                auto n_exit_classes = this->config.exit_interval > 0 ? this->odim : 0;
+                this->encoder = register_module("encoder", transformer::Encoder<InputLayer>(idim, config, n_exit_classes));
                 this->decoder = register_module("decoder", transformer::Decoder(odim + 1, config));
+                if (this->config.ctc_weight > 0) {
+                    this->ctc = register_module("ctc", Linear(this->config.d_model, this->odim));
+                }
+                if (this->config.draft_dlayers > 0) {
+                    auto draft_config = this->config;
+                    draft_config.dlayers = this->config.draft_dlayers;
+                    draft_config.d_ff = this->config.draft_d_ff;
+                    this->draft = register_module("draft", transformer::Decoder(odim + 1, draft_config));
+                }
+                if (this->config.mixed_precision) {
+                    this->to(at::kHalf);
+                }
+            }
+
+            /// dtype of parameters and activations
+            at::ScalarType dtype() const {
+                return this->config.mixed_precision ? at::kHalf : at::kFloat;
+            }
+
+            /// encode padded `src` (batch, time, feat) into padded memory and its mask.
+            /// `src_mask` (batch, time) can be precomputed by the data loader.
+            /// non-null `exits` receives the padded outputs of the encoder exit layers
+            std::tuple<torch::Tensor, torch::Tensor> encode(torch::Tensor src, at::IntList src_length,
+                                                            torch::Tensor src_mask = {},
+                                                            std::vector<torch::Tensor>* exits = nullptr) {
+                if (at::isFloatingType(src.scalar_type())) {
+                    // token ids of PositonalEmbedding are kept
+                    src = src.to(this->dtype());
+                }
+                if (this->config.unpadded) {
+                    auto [h, offsets] = this->encoder->forward_packed(pack_padded(src, src_length), length_offsets(src_length), exits);
+                    if (exits != nullptr) {
+                        for (auto& e : *exits) {
+                            e = pad_packed(e, offsets);
+                        }
+                    }
+                    std::vector<std::int64_t> lengths;
+                    for (size_t i = 0; i + 1 < offsets.size(); ++i) {
+                        lengths.push_back(offsets[i + 1] - offsets[i]);
+                    }
+                    return std::make_tuple(pad_packed(h, offsets), pad_mask(lengths, src.device()).unsqueeze(-2));
+                }
+                src_mask = src_mask.defined() ? src_mask.to(src.device()) : pad_mask(src_length, src.device());
+                return this->encoder->forward(src, src_mask.unsqueeze(-2), exits);
             }
 
+            /// returns (loss, accuracy) as device tensors. they are also accumulated in `metrics`.
+            /// the returned loss adds the draft loss (see draft_metrics) to train both decoders by one backward
             auto forward(torch::Tensor src, at::IntList src_length,
                          torch::Tensor tgt, at::IntList tgt_length) {
-                auto src_mask = pad_mask(src_length).unsqueeze(-2).to(src.device());
-                auto [mem, mem_mask] = this->encoder->forward(src, src_mask);
-
-                auto tgt_mask = pad_mask(tgt_length).unsqueeze(-2).to(tgt.device());
-                tgt_mask = tgt_mask.__and__(subsequent_mask(tgt_mask.size(-1), tgt_mask.device()).unsqueeze(0));
-                auto tgt_in = tgt.clone().fill_(this->ignore_index);
-                auto tgt_out = tgt.clone().fill_(this->ignore_index); // NOTE fill eos?
-                for (size_t i = 0; i < tgt_length.size(); ++i) {
-                    auto n = tgt_length[i];
-                    tgt_in[i][0] = this->sos;
-                    tgt_in[i].slice(0, 1, n) = tgt[i].slice(0, 0, n - 1);
+                auto [tgt_in, tgt_out] = shift_targets(tgt, tgt_length, this->sos, this->eos, this->ignore_index);
+                return this->forward_shifted(src, src_length, tgt_in, tgt_out, tgt_length);
+            }
 
-                    tgt_out[i].slice(0, 0, n - 1) = tgt[i].slice(0, 1, tgt_length[i]);
-                    tgt_out[i][n - 1] = this->eos;
+            /// forward with decoder input/output already made by `shift_targets` (e.g., dataset::MiniBatch::prepare).
+            /// `src_mask` and `tgt_mask` (batch, time) are optional padding masks
+            std::tuple<torch::Tensor, torch::Tensor>
+            forward_shifted(torch::Tensor src, at::IntList src_length,
+                            torch::Tensor tgt_in, torch::Tensor tgt_out, at::IntList tgt_length,
+                            torch::Tensor src_mask = {}, torch::Tensor tgt_mask = {}) {
+                std::vector<torch::Tensor> exits;
+                auto [mem, mem_mask] = this->encode(src, src_length, src_mask,
+                                                    this->encoder->exits.empty() ? nullptr : &exits);
+
+                auto device = tgt_in.device();
+                tgt_mask = tgt_mask.defined() ? tgt_mask.to(device) : pad_mask(tgt_length, device);
+                tgt_mask = tgt_mask.unsqueeze(-2).__and__(subsequent_mask(tgt_mask.size(-1), device).unsqueeze(0));
+
+                // the decoder learns the memory of every exit layer as early exit may hand any of them in decoding
+                auto dec_mem = mem;
+                if (!exits.empty() && this->is_training()) {
+                    auto n_exits = static_cast<std::int64_t>(exits.size());
+                    auto k = at::randint(n_exits + 1, {1}, at::kLong).template item<std::int64_t>();
+                    if (k < n_exits) {
+                        dec_mem = exits[k];
+                    }
+                }
+                // the number of tokens is known on host
+                std::int64_t n_valid = 0;
+                for (auto n : tgt_length) {
+                    n_valid += n;
+                }
+                auto [loss, correct] = this->decoder_loss(this->decoder, tgt_in, tgt_mask, dec_mem, mem_mask, tgt_out);
+                torch::Tensor draft_loss;
+                if (!this->draft.is_empty()) {
+                    // the draft learns to imitate the targets without changing the encoder
+                    torch::Tensor draft_correct;
+                    std::tie(draft_loss, draft_correct) =
+                        this->decoder_loss(this->draft, tgt_in, tgt_mask, dec_mem.detach(), mem_mask, tgt_out);
+                    this->draft_metrics.add(draft_loss, draft_correct, n_valid);
+                }
+                if (!this->ctc.is_empty()) {
+                    // CTC losses of the exit heads are averaged with the final one
+                    auto ctc = this->ctc_loss(mem, mem_mask, tgt_out, tgt_length);
+                    for (size_t i = 0; i < exits.size(); ++i) {
+                        ctc = ctc + this->ctc_loss(exits[i], mem_mask, tgt_out, tgt_length, this->encoder->exits[i]);
+                    }
+                    auto w = this->config.ctc_weight;
+                    loss = (1 - w) * loss + w * ctc / static_cast<double>(1 + exits.size());
+                }
+                this->metrics.add(loss, correct, n_valid);
+                if (draft_loss.defined()) {
+                    // only the draft parameters receive its gradient
+                    loss = loss + draft_loss;
                 }
+                auto acc = correct.to(at::kFloat) / static_cast<double>(n_valid);
+                return std::make_tuple(loss, acc);
+            }
 
-                auto [pred, pred_mask] = this->decoder->forward(tgt_in, tgt_mask, mem, mem_mask);
-                // TODO calc accuracy
+            /// label smoothing loss and the number of correct tokens of `decoder` (the decoder or the draft)
+            std::tuple<torch::Tensor, torch::Tensor>
+            decoder_loss(transformer::Decoder& decoder, torch::Tensor tgt_in, torch::Tensor tgt_mask,
+                         torch::Tensor mem, torch::Tensor mem_mask, torch::Tensor tgt_out) {
                 auto target = tgt_out.view({-1});
-                auto loss = label_smoothing_kl_div(pred.view({target.size(0), -1}), target,
-                                                   this->config.label_smoothing, this->ignore_index);
-                auto acc = accuracy(pred, tgt_out, this->ignore_index);
-                return std::make_tuple(loss, acc);
+                if (this->config.loss_chunk == 0) {
+                    auto [pred, pred_mask] = decoder->forward(tgt_in, tgt_mask, mem, mem_mask);
+                    // loss in fp32
+                    auto loss = label_smoothing_kl_div(pred.view({target.size(0), -1}).to(at::kFloat), target,
+                                                       this->config.label_smoothing, this->ignore_index);
+                    return std::make_tuple(loss, count_correct(pred, tgt_out, this->ignore_index));
+                }
+                // logits are computed chunk by chunk inside the loss
+                auto [hidden, hidden_mask] = decoder->forward_hidden(tgt_in, tgt_mask, mem, mem_mask);
+                auto output_layer = decoder->output_layer;
+                return kernel::linear_label_smoothing(
+                    hidden.view({target.size(0), -1}), output_layer->weight, output_layer->bias, target,
+                    this->config.label_smoothing, this->ignore_index, this->config.loss_chunk);
             }
 
-            auto recognize(torch::Tensor src) {
-                AT_ASSERT(src.dim() == 2); // "input shape should be (time, feat)");
-                auto device = src.device();
-                auto src_mask = pad_mask({src.size(0)}).unsqueeze(-2).to(device);
-                auto [mem, mem_mask] = this->encoder->forward(src.unsqueeze(0), src_mask);
-                std::vector<Hypothesis> n_best;
-                // TODO beam search decoding
-                if (config.beam_size == 1) {
-                    auto tgt = torch::full({1, 1}, this->sos, torch::TensorOptions().dtype(at::kLong).device(device));
-                    auto score = torch::zeros({1}, torch::TensorOptions(device));
-                    auto max_len = src.size(0);
-                    for (std::int64_t step = 0; step <= max_len; ++step) {
-                        auto tgt_mask = subsequent_mask(step + 1, tgt.device()).unsqueeze(0);
-                        auto [pred, pred_mask] = this->decoder->forward(tgt, tgt_mask, mem, mem_mask);
-                        auto prob = pred.select(1, -1).log_softmax(-1);
-                        auto [max_prob, next_id] = prob.max(1);
-                        score += max_prob;
-                        if (step == max_len) {
-                            next_id[0] = this->eos;
-                        }
-                        tgt = torch::cat({tgt, next_id.unsqueeze(1)}, 1);
-                    }
-                    auto ptr = tgt.template data<std::int64_t>();
-                    std::vector<std::int64_t> tgt_vec(ptr, ptr + tgt.size(1));
-                    n_best.push_back({score.item<double>(), tgt_vec});
+            /// CTC loss per token of encoded `mem` predicting the decoder targets `tgt_out` without eos.
+            /// `head` is the projection to tokens (the CTC head by default)
+            torch::Tensor ctc_loss(torch::Tensor mem, torch::Tensor mem_mask, torch::Tensor tgt_out, at::IntList tgt_length,
+                                   Linear head = nullptr) {
+                // ctc_loss takes lengths on host
+                auto n_frames = mem_mask.sum(-1).view(-1).to(at::kLong).to(torch::kCPU);
+                std::vector<std::int64_t> input_length(n_frames.template data<std::int64_t>(),
+                                                       n_frames.template data<std::int64_t>() + n_frames.size(0));
+                std::vector<std::int64_t> target_length;
+                std::int64_t n_tokens = 0;
+                for (auto n : tgt_length) {
+                    target_length.push_back(n - 1);
+                    n_tokens += n - 1;
                 }
-                else {
-                    AT_ASSERT(false); // , "beam search decoding is not implemented");
+                auto targets = tgt_out.masked_fill(tgt_out == this->ignore_index, 0);
+                if (head.is_empty()) {
+                    head = this->ctc;
                 }
+                auto logp = head->forward(mem).to(at::kFloat).log_softmax(-1).transpose(0, 1);
+                auto loss = torch::ctc_loss(logp, targets, input_length, target_length, 0, at::Reduction::Sum);
+                return loss / static_cast<double>(std::max<std::int64_t>(1, n_tokens));
+            }
 
-                return n_best;
+            /// CTC search of encoded `mem` without decoder steps (see Config::ctc_decode)
+            std::vector<std::vector<Hypothesis>> recognize_ctc(torch::Tensor mem, torch::Tensor mem_mask) {
+                AT_ASSERT(!this->ctc.is_empty()); // "ctc_decode needs a model trained with ctc_weight > 0"
+                auto logp = this->ctc->forward(mem).to(at::kFloat).log_softmax(-1);
+                return ctc_search(logp, mem_mask, this->sos, this->eos, this->config.beam_size);
+            }
+
+            /// returns n-best hypotheses of each utterance in a padded batch `src` (batch, time, feat)
+            auto recognize_batch(torch::Tensor src, at::IntList src_length) {
+                AT_ASSERT(src.dim() == 3); // "input shape should be (batch, time, feat)");
+                AT_ASSERT(src.size(0) == static_cast<std::int64_t>(src_length.size()));
+                // the CTC head is not trained on the memory of exit layers
+                AT_ASSERT(!this->config.ctc_decode || this->config.exit_threshold == 0);
+                auto [mem, mem_mask] = this->encode(src, src_length);
+                if (this->config.ctc_decode) {
+                    return this->recognize_ctc(mem, mem_mask);
+                }
+                if (!this->draft.is_empty() && this->config.speculative_tokens > 0 && this->config.beam_size == 1) {
+                    // not batched over utterances (see speculative_search)
+                    return speculative_search(this->decoder, this->draft, mem, mem_mask, this->sos, this->eos, this->config,
+                                              src_length);
+                }
+                return autoregressive_search(this->decoder, mem, mem_mask, this->sos, this->eos, this->config, src_length);
+            }
+
+            /// returns n-best hypotheses of a single utterance `src` (time, feat)
+            auto recognize(torch::Tensor src) {
+                AT_ASSERT(src.dim() == 2); // "input shape should be (time, feat)");
+                return this->recognize_batch(src.unsqueeze(0), {src.size(0)}).front();
             }
         };
 
@@ -2,7 +2,10 @@
 #include <torch/torch.h>
 
 #include <cmath>
+#include <cstdint>
+#include <limits>
 #include <utility>
+#include <vector>
 
 namespace thxx::optim {
     using torch::serialize::InputArchive;
@@ -48,11 +51,102 @@ namespace thxx::optim {
 
     };
 
-    OutputArchive& operator<<(OutputArchive& archive, const Noam& optimizer) {
+    struct LossScaleOptions {
+        double init_scale = 65536;
+        double factor = 2;
+        /// the number of steps without overflow before increasing the scale
+        std::int64_t growth_interval = 2000;
+    };
+
+    /**
+       fp32 master weights of a reduced precision model with dynamic loss scaling.
+
+       usage:
+         MixedPrecision mp(model->parameters());
+         Noam optimizer(mp.master_parameters, options);
+         mp.scale(loss).backward();
+         mp.step(optimizer); // skipped when gradients overflow
+     */
+    class MixedPrecision {
+    public:
+        std::vector<torch::Tensor> model_parameters;
+        std::vector<torch::Tensor> master_parameters;
+        LossScaleOptions options;
+        double loss_scale;
+        std::int64_t good_steps = 0;
+
+        MixedPrecision(std::vector<torch::Tensor> parameters, const LossScaleOptions& options = {})
+            : model_parameters(std::move(parameters)), options(options), loss_scale(options.init_scale) {
+            torch::NoGradGuard no_grad;
+            for (auto& p : this->model_parameters) {
+                auto master = p.detach().to(at::kFloat).clone();
+                master.set_requires_grad(true);
+                this->master_parameters.push_back(master);
+            }
+        }
+
+        torch::Tensor scale(torch::Tensor loss) const {
+            return loss.to(at::kFloat) * this->loss_scale;
+        }
+
+        /// copy unscaled model gradients to master gradients. returns false on inf/nan
+        bool unscale() {
+            torch::NoGradGuard no_grad;
+            torch::Tensor overflow;
+            for (size_t i = 0; i < this->model_parameters.size(); ++i) {
+                auto g = this->model_parameters[i].grad();
+                if (!g.defined()) continue;
+                auto g32 = g.to(at::kFloat) / this->loss_scale;
+                this->master_parameters[i].grad() = g32;
+                // elementwise (a sum of large finite gradients can overflow)
+                auto bad = g32.ne(g32).__or__(g32.abs().eq(std::numeric_limits<float>::infinity())).any();
+                overflow = overflow.defined() ? overflow.__or__(bad) : bad;
+            }
+            // one synchronization for all the parameters
+            return !overflow.defined() || overflow.template item<std::uint8_t>() == 0;
+        }
+
+        /// update master weights by `optimizer` and copy them back to the model
+        template <typename Optimizer>
+        bool step(Optimizer& optimizer) {
+            if (!this->unscale()) {
+                this->loss_scale /= this->options.factor;
+                this->good_steps = 0;
+                for (auto& p : this->master_parameters) {
+                    p.grad() = torch::Tensor();
+                }
+                return false;
+            }
+            optimizer.step();
+            {
+                torch::NoGradGuard no_grad;
+                for (size_t i = 0; i < this->model_parameters.size(); ++i) {
+                    this->model_parameters[i].copy_(this->master_parameters[i]);
+                }
+            }
+            if (++this->good_steps % this->options.growth_interval == 0) {
+                this->loss_scale *= this->options.factor;
+            }
+            return true;
+        }
+
+        void zero_grad() {
+            for (auto& ps : {&this->model_parameters, &this->master_parameters}) {
+                for (auto& p : *ps) {
+                    if (p.grad().defined()) {
+                        p.grad() = p.grad().detach();
+                        p.grad().zero_();
+                    }
+                }
+            }
+        }
+    };
+
+    inline OutputArchive& operator<<(OutputArchive& archive, const Noam& optimizer) {
         return archive << optimizer.super;
     }
 
-    InputArchive& operator>>(InputArchive& archive, Noam& optimizer) {
+    inline InputArchive& operator>>(InputArchive& archive, Noam& optimizer) {
         return archive >> optimizer.super;
     }
 } // namespace detail
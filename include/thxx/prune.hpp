@@ -0,0 +1,204 @@
+#pragma once
+
+/**
+   Structured pruning of attention heads and feed-forward neurons
+
+   Calibration scores heads and neurons on a calibration set by the first order (Taylor) estimate of the loss
+   change when each of them is removed, |dL/dm| of a mask m scaling
+   - the contribution of each attention head through linear_out, and
+   - the activation of each feed-forward neuron through the second Linear.
+   As the output of a Linear is linear in such a mask, dL/dm is the inner product of the weight columns fed by
+   the head (neuron) and their gradient. Calibration only reads the weight gradients after loss.backward(),
+   so nothing is observed in the forward of the model.
+
+   prune() then builds a smaller model keeping the best `heads` heads of every attention and the best `d_ff`
+   neurons of every feed-forward layer. Config has one size for all the layers, so every layer keeps the same
+   number of them (but not the same ones). The head dim is kept in Config::d_head, so the pruned model is saved
+   and loaded as a net::Transformer of its config like any other checkpoint.
+ */
+
+#include <torch/torch.h>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <tuple>
+#include <vector>
+
+#include "net.hpp"
+
+namespace thxx {
+    namespace prune {
+
+        /**
+           importance statistics of the attention and feed-forward layers in a model.
+
+           usage:
+             prune::Calibration calibration(*model);
+             for (...) {
+                 model->zero_grad();
+                 std::get<0>(model->forward(...)).backward();
+                 calibration.accumulate();
+             }
+        */
+        class Calibration {
+        public:
+            /// score every attention and feed-forward layer in `model`
+            explicit Calibration(torch::nn::Module& model) {
+                for (auto& m : model.modules()) {
+                    if (auto a = std::dynamic_pointer_cast<net::MultiHeadedAttentionImpl>(m)) {
+                        this->attentions.push_back(a);
+                    } else if (auto f = std::dynamic_pointer_cast<net::transformer::PositionwiseFeedforwardImpl>(m)) {
+                        this->feedforwards.push_back(f);
+                    }
+                }
+            }
+
+            /// add |dL/dm| of every head and neuron from the current gradients (e.g., of a minibatch)
+            void accumulate() {
+                torch::NoGradGuard no_grad;
+                for (const auto& a : this->attentions) {
+                    // (d_model, heads, d_k) columns of linear_out fed by each head
+                    auto s = taylor(a->linear_out->weight, {a->d_model, a->heads, a->d_k}, {0, 2});
+                    if (s.defined()) this->add(a.get(), s);
+                }
+                for (const auto& f : this->feedforwards) {
+                    // (d_model, d_ff) columns of the second Linear fed by each neuron
+                    auto w_2 = std::get<1>(net::transformer::feedforward_linears(*f));
+                    auto s = taylor(w_2->weight, w_2->weight.sizes(), {0});
+                    if (s.defined()) this->add(f.get(), s);
+                }
+                ++this->n_accumulated;
+            }
+
+            /// (heads) importance of the heads of `m`. the norms of linear_out blocks if `m` was never scored
+            at::Tensor head_importance(const net::MultiHeadedAttentionImpl& m) const {
+                auto s = this->find(&m);
+                if (s.defined()) return s;
+                auto w = kernel::autograd::data(m.linear_out->weight).to(at::kFloat);
+                return w.view({m.d_model, m.heads, m.d_k}).pow(2).sum({0, 2}).sqrt();
+            }
+
+            /// (d_ff) importance of the neurons of `pff` made by net::transformer::positionwise_feedforward.
+            /// the norms of both weights of each neuron if `pff` was never scored
+            at::Tensor neuron_importance(const torch::nn::Module& pff) const {
+                auto s = this->find(&pff);
+                if (s.defined()) return s;
+                auto [w_1, w_2] = net::transformer::feedforward_linears(pff);
+                auto n_1 = kernel::autograd::data(w_1->weight).to(at::kFloat).norm(2, 1);
+                return n_1 * kernel::autograd::data(w_2->weight).to(at::kFloat).norm(2, 0);
+            }
+
+            /// the number of accumulate() calls
+            std::int64_t count() const {
+                return this->n_accumulated;
+            }
+
+        private:
+            std::vector<std::shared_ptr<net::MultiHeadedAttentionImpl>> attentions;
+            std::vector<std::shared_ptr<net::transformer::PositionwiseFeedforwardImpl>> feedforwards;
+            std::map<const torch::nn::Module*, at::Tensor> sums;
+            std::int64_t n_accumulated = 0;
+
+            /// |sum of weight * grad| over `dims` of `weight` viewed as `sizes`. undefined without gradient
+            static at::Tensor taylor(const torch::Tensor& weight, at::IntList sizes, at::IntList dims) {
+                auto g = weight.grad();
+                if (!g.defined()) return {};
+                auto w = kernel::autograd::data(weight).to(at::kFloat);
+                auto wg = w * kernel::autograd::data(g).to(at::kFloat);
+                return wg.view(sizes).sum(dims).abs();
+            }
+
+            void add(const torch::nn::Module* m, const at::Tensor& s) {
+                auto& sum = this->sums[m];
+                sum = sum.defined() ? sum + s : s;
+            }
+
+            /// mean importance of `m` or an undefined tensor
+            at::Tensor find(const torch::nn::Module* m) const {
+                auto it = this->sums.find(m);
+                if (it == this->sums.end()) return {};
+                return it->second / static_cast<double>(this->n_accumulated);
+            }
+        };
+
+        /// sorted indices of the `k` largest `importance`
+        inline at::Tensor top_indices(const at::Tensor& importance, std::int64_t k) {
+            AT_ASSERT(0 < k && k <= importance.size(0));
+            return std::get<0>(std::get<1>(importance.topk(k)).sort());
+        }
+
+        /// copy the heads of `src` with the largest `importance` into smaller `dst`
+        inline void prune_attention(const net::MultiHeadedAttentionImpl& src, net::MultiHeadedAttentionImpl& dst,
+                                    const at::Tensor& importance) {
+            AT_ASSERT(src.d_k == dst.d_k);
+            auto device = src.linear_out->weight.device();
+            auto heads = top_indices(importance, dst.heads).to(device);
+            // rows of the kept heads in the projections
+            auto rows = (heads.unsqueeze(1) * src.d_k + at::arange(src.d_k, heads.options())).view(-1);
+            auto index = torch::autograd::make_variable(rows);
+            for (std::int64_t i = 0; i < 3; ++i) {
+                auto [sw, sb] = src.projection_parameters(i);
+                auto [dw, db] = dst.projection_parameters(i);
+                dw.copy_(sw.index_select(0, index));
+                db.copy_(sb.index_select(0, index));
+            }
+            dst.linear_out->weight.copy_(src.linear_out->weight.index_select(1, index));
+            dst.linear_out->bias.copy_(src.linear_out->bias);
+        }
+
+        /// copy the neurons of `src` with the largest `importance` into smaller `dst` (positionwise_feedforward)
+        inline void prune_feedforward(const torch::nn::Module& src, torch::nn::Module& dst, const at::Tensor& importance) {
+            auto [s1, s2] = net::transformer::feedforward_linears(src);
+            auto [d1, d2] = net::transformer::feedforward_linears(dst);
+            auto index = torch::autograd::make_variable(top_indices(importance, d1->out_features).to(s1->weight.device()));
+            d1->weight.copy_(s1->weight.index_select(0, index));
+            d1->bias.copy_(s1->bias.index_select(0, index));
+            d2->weight.copy_(s2->weight.index_select(1, index));
+            d2->bias.copy_(s2->bias);
+        }
+
+        /**
+           A smaller copy of `model` keeping `heads` heads of every attention and `d_ff` neurons of every
+           feed-forward layer by the importance in `calibration`. The draft decoder keeps its own d_ff.
+           The other parameters are copied as they are.
+         */
+        template <typename InputLayer>
+        net::Transformer<InputLayer> prune(net::Transformer<InputLayer>& model, const Calibration& calibration,
+                                           std::int64_t heads, std::int64_t d_ff) {
+            auto config = model->config;
+            AT_ASSERT(0 < heads && heads <= config.heads);
+            AT_ASSERT(0 < d_ff && d_ff <= config.d_ff);
+            config.d_head = config.d_head > 0 ? config.d_head : config.d_model / config.heads;
+            config.heads = heads;
+            config.d_ff = d_ff;
+            net::Transformer<InputLayer> pruned(model->idim, model->odim, config);
+            pruned->to(model->parameters().front().device());
+            pruned->train(model->is_training());
+
+            torch::NoGradGuard no_grad;
+            auto src_params = model->named_parameters();
+            for (auto& p : pruned->named_parameters()) {
+                auto s = src_params.find(p.key());
+                AT_ASSERT(s != nullptr);
+                if (s->sizes().equals(p.value().sizes())) {
+                    p.value().copy_(*s);
+                }
+            }
+            // the same module tree of different sizes
+            auto src_modules = model->modules();
+            auto dst_modules = pruned->modules();
+            AT_ASSERT(src_modules.size() == dst_modules.size());
+            for (size_t i = 0; i < src_modules.size(); ++i) {
+                if (auto a = std::dynamic_pointer_cast<net::MultiHeadedAttentionImpl>(src_modules[i])) {
+                    auto b = std::dynamic_pointer_cast<net::MultiHeadedAttentionImpl>(dst_modules[i]);
+                    prune_attention(*a, *b, calibration.head_importance(*a));
+                } else if (auto f = std::dynamic_pointer_cast<net::transformer::PositionwiseFeedforwardImpl>(src_modules[i])) {
+                    prune_feedforward(*f, *dst_modules[i], calibration.neuron_importance(*f));
+                }
+            }
+            return pruned;
+        }
+
+    } // namespace prune
+} // namespace thxx
@@ -0,0 +1,290 @@
+#pragma once
+
+/**
+   Dynamic batching for recognition servers
+
+   DynamicBatcher queues utterances submitted by many clients and recognizes them in padded batches
+   formed under a frame budget and a max-latency deadline. `wire` is a minimal binary protocol
+   over a local (unix domain) socket used by example/speech_recognition/server.cpp and loadgen.cpp.
+ */
+
+#include <torch/torch.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "net.hpp"
+
+namespace thxx {
+    namespace serve {
+
+        struct BatcherOptions {
+            /// the max number of utterances in a batch
+            std::int64_t max_batch = 32;
+            /// the max number of padded frames (batch x longest utterance) in a batch
+            std::int64_t max_frames = 16000;
+            /// seconds the oldest utterance can wait for a batch to fill up
+            double max_latency = 0.02;
+        };
+
+        /**
+           Queue of utterances (time, feat) recognized in dynamic batches by one worker thread.
+
+           A batch is taken from the front of the queue as soon as it is full (the next utterance exceeds
+           max_batch or max_frames) or the oldest utterance has waited for max_latency.
+           An utterance longer than max_frames alone is recognized as a batch of one.
+         */
+        class DynamicBatcher {
+        public:
+            using Result = std::vector<net::Hypothesis>;
+            /// e.g., TransformerImpl::recognize_batch of padded (batch, time, feat) on CPU and its lengths
+            using BatchFn = std::function<std::vector<Result>(torch::Tensor, at::IntList)>;
+            using Clock = std::chrono::steady_clock;
+
+            DynamicBatcher(BatchFn fn, BatcherOptions options = {})
+                : fn(std::move(fn)), options(options), worker([this]() { this->run(); }) {}
+
+            DynamicBatcher(const DynamicBatcher&) = delete;
+            DynamicBatcher& operator=(const DynamicBatcher&) = delete;
+
+            ~DynamicBatcher() {
+                this->stop();
+            }
+
+            std::future<Result> submit(torch::Tensor x) {
+                AT_ASSERT(x.dim() == 2); // (time, feat)
+                Request r;
+                // padded on CPU as a plain tensor
+                r.x = kernel::autograd::data(x).to(at::kCPU, at::kFloat);
+                r.arrival = Clock::now();
+                auto ret = r.result.get_future();
+                {
+                    std::lock_guard<std::mutex> lock(this->mutex);
+                    AT_ASSERT(!this->stopping);
+                    this->queue.push_back(std::move(r));
+                }
+                this->cv.notify_one();
+                return ret;
+            }
+
+            /// recognize the queued utterances and join the worker
+            void stop() {
+                {
+                    std::lock_guard<std::mutex> lock(this->mutex);
+                    this->stopping = true;
+                }
+                this->cv.notify_one();
+                if (this->worker.joinable()) {
+                    this->worker.join();
+                }
+            }
+
+            /// the number of batches recognized so far
+            std::int64_t n_batches() const {
+                return this->batches;
+            }
+
+        private:
+            struct Request {
+                torch::Tensor x;
+                std::promise<Result> result;
+                Clock::time_point arrival;
+            };
+
+            BatchFn fn;
+            BatcherOptions options;
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::deque<Request> queue;
+            bool stopping = false;
+            std::atomic<std::int64_t> batches{0};
+            // the last member to start after the others are initialized
+            std::thread worker;
+
+            /// the number of requests at the front of the queue that fit in the budget (at least 1)
+            size_t fit() const {
+                size_t n = 0;
+                std::int64_t max_len = 0;
+                for (const auto& r : this->queue) {
+                    auto len = std::max(max_len, r.x.size(0));
+                    auto over = static_cast<std::int64_t>(n + 1) > this->options.max_batch
+                        || static_cast<std::int64_t>(n + 1) * len > this->options.max_frames;
+                    if (n > 0 && over) break;
+                    max_len = len;
+                    ++n;
+                }
+                return n;
+            }
+
+            /// blocks until a batch is ready. empty after stop() and all the requests are taken
+            std::vector<Request> next_batch() {
+                std::unique_lock<std::mutex> lock(this->mutex);
+                while (true) {
+                    this->cv.wait(lock, [this]() { return this->stopping || !this->queue.empty(); });
+                    if (this->queue.empty()) return {};
+                    auto n = this->fit();
+                    auto full = n < this->queue.size() || static_cast<std::int64_t>(n) == this->options.max_batch;
+                    auto deadline = this->queue.front().arrival
+                        + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(this->options.max_latency));
+                    if (full || this->stopping || Clock::now() >= deadline) {
+                        std::vector<Request> batch;
+                        for (size_t i = 0; i < n; ++i) {
+                            batch.push_back(std::move(this->queue.front()));
+                            this->queue.pop_front();
+                        }
+                        return batch;
+                    }
+                    // wait for more utterances until the deadline
+                    this->cv.wait_until(lock, deadline);
+                }
+            }
+
+            void run() {
+                // grad mode is thread local
+                torch::NoGradGuard no_grad;
+                for (auto batch = this->next_batch(); !batch.empty(); batch = this->next_batch()) {
+                    // every failure (e.g., utterances of different feature dims) is reported to the batch
+                    try {
+                        std::vector<std::int64_t> lengths;
+                        std::int64_t max_len = 0;
+                        for (const auto& r : batch) {
+                            lengths.push_back(r.x.size(0));
+                            max_len = std::max(max_len, r.x.size(0));
+                        }
+                        auto n_feat = batch.front().x.size(1);
+                        auto x = at::zeros({static_cast<std::int64_t>(batch.size()), max_len, n_feat});
+                        for (size_t i = 0; i < batch.size(); ++i) {
+                            x[i].slice(0, 0, lengths[i]) = batch[i].x;
+                        }
+                        auto results = this->fn(torch::autograd::make_variable(x), lengths);
+                        AT_ASSERT(results.size() == batch.size());
+                        for (size_t i = 0; i < batch.size(); ++i) {
+                            batch[i].result.set_value(std::move(results[i]));
+                        }
+                    } catch (...) {
+                        for (auto& r : batch) {
+                            r.result.set_exception(std::current_exception());
+                        }
+                    }
+                    ++this->batches;
+                }
+            }
+        };
+
+
+        /**
+           binary messages over a stream socket. every integer is int64 in the host byte order.
+           writes to a closed peer fail (MSG_NOSIGNAL) instead of raising SIGPIPE.
+        */
+        namespace wire {
+            inline bool read_all(int fd, void* buf, size_t n) {
+                auto p = static_cast<char*>(buf);
+                while (n > 0) {
+                    auto r = ::read(fd, p, n);
+                    if (r <= 0) return false;
+                    p += r;
+                    n -= r;
+                }
+                return true;
+            }
+
+            inline bool write_all(int fd, const void* buf, size_t n) {
+                auto p = static_cast<const char*>(buf);
+                while (n > 0) {
+                    auto r = ::send(fd, p, n, MSG_NOSIGNAL);
+                    if (r <= 0) return false;
+                    p += r;
+                    n -= r;
+                }
+                return true;
+            }
+
+            /// request: n_frames, n_feat, float features[n_frames * n_feat]
+            inline bool send_features(int fd, at::Tensor x) {
+                auto f = x.to(at::kFloat).contiguous();
+                std::int64_t header[2] = {f.size(0), f.size(1)};
+                return write_all(fd, header, sizeof(header))
+                    && write_all(fd, f.data<float>(), sizeof(float) * f.numel());
+            }
+
+            /// returns an undefined tensor when the peer closed the connection or the header is not (1..max_frames, n_feat)
+            inline at::Tensor receive_features(int fd, std::int64_t n_feat, std::int64_t max_frames) {
+                std::int64_t header[2];
+                if (!read_all(fd, header, sizeof(header))) return {};
+                if (header[0] <= 0 || header[0] > max_frames || header[1] != n_feat) return {};
+                auto x = at::empty({header[0], header[1]}, at::kFloat);
+                if (!read_all(fd, x.data<float>(), sizeof(float) * x.numel())) return {};
+                return x;
+            }
+
+            /// response: the best hypothesis as score (double), n_tokens, tokens[n_tokens]. see rejected()
+            inline bool send_hypothesis(int fd, const net::Hypothesis& h) {
+                std::int64_t n = h.tokens.size();
+                return write_all(fd, &h.score, sizeof(h.score))
+                    && write_all(fd, &n, sizeof(n))
+                    && write_all(fd, h.tokens.data(), sizeof(std::int64_t) * n);
+            }
+
+            /// the response to a request that was not recognized: no tokens of -inf score
+            inline net::Hypothesis rejected() {
+                net::Hypothesis h;
+                h.score = -std::numeric_limits<double>::infinity();
+                return h;
+            }
+
+            inline bool receive_hypothesis(int fd, net::Hypothesis& h) {
+                std::int64_t n;
+                if (!read_all(fd, &h.score, sizeof(h.score)) || !read_all(fd, &n, sizeof(n))) return false;
+                h.tokens.resize(n);
+                return read_all(fd, h.tokens.data(), sizeof(std::int64_t) * n);
+            }
+
+            inline sockaddr_un unix_address(const std::string& path) {
+                sockaddr_un addr = {};
+                addr.sun_family = AF_UNIX;
+                AT_ASSERT(path.size() < sizeof(addr.sun_path));
+                path.copy(addr.sun_path, path.size());
+                return addr;
+            }
+
+            /// listening unix domain socket at `path` (an old socket file is removed). -1 on failure
+            inline int listen_unix(const std::string& path, int backlog = 128) {
+                auto fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+                if (fd < 0) return -1;
+                auto addr = unix_address(path);
+                ::unlink(path.c_str());
+                if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(fd, backlog) < 0) {
+                    ::close(fd);
+                    return -1;
+                }
+                return fd;
+            }
+
+            /// connected unix domain socket to `path`. -1 on failure
+            inline int connect_unix(const std::string& path) {
+                auto fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+                if (fd < 0) return -1;
+                auto addr = unix_address(path);
+                if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+                    ::close(fd);
+                    return -1;
+                }
+                return fd;
+            }
+        } // namespace wire
+    } // namespace serve
+} // namespace thxx
@@ -22,6 +22,23 @@ namespace thxx {
             }
         };
 
+        class TensorClose : public Catch::MatcherBase<at::Tensor> {
+        public:
+            at::Tensor a;
+            double rtol, atol;
+            TensorClose(at::Tensor a, double rtol=1e-5, double atol=1e-6) : a(a), rtol(rtol), atol(atol) {}
+
+            virtual bool match(const at::Tensor& b) const override {
+                return a.sizes() == b.sizes() && at::allclose(a, b, rtol, atol);
+            }
+
+            virtual std::string describe() const override {
+                std::ostringstream ss;
+                ss << "\nis not close to\n" << a;
+                return ss.str();
+            }
+        };
+
         class HasGrad : public Catch::MatcherBase<torch::nn::Module> {
         public:
             bool has;
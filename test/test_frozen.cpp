@@ -0,0 +1,104 @@
+#include <thxx/frozen.hpp>
+#include <thxx/testing.hpp>
+
+using namespace thxx;
+
+
+/// non-trivial LayerNorm parameters so that folding them is tested
+template <typename Model>
+void randomize_norms(Model& model) {
+    torch::NoGradGuard no_grad;
+    for (auto& p : model->named_parameters()) {
+        if (p.key().find("norm") != std::string::npos) {
+            p.value().uniform_(0.5, 1.5);
+        }
+    }
+}
+
+TEST_CASE("freeze", "[frozen]")
+{
+    namespace T = net::transformer;
+    std::int64_t n_input = 6;
+    std::int64_t n_output = 5;
+    T::Config conf;
+    conf.d_model = n_input;
+    conf.d_ff = 3;
+    conf.heads = 3;
+    conf.elayers = 2;
+    conf.dlayers = 2;
+    conf.max_len_ratio = 1.0;
+    conf.ctc_weight = 0.3;
+    // greedy search is speculative
+    conf.draft_dlayers = 1;
+    net::Transformer<T::Conv2dSubsampling> model(n_input, n_output, conf);
+    randomize_norms(model);
+    model->eval();
+    auto frozen_model = frozen::freeze(model);
+    CHECK(frozen_model.encoder.layers[0].self_attn.qkv.weight_t.size(1) == 3 * n_input);
+    // folded norms only normalize
+    CHECK_FALSE(frozen_model.encoder.layers[0].norm1.scale.defined());
+    CHECK(frozen_model.encoder.norm.scale.defined());
+
+    torch::NoGradGuard no_grad;
+    std::vector<std::int64_t> xlen = {30, 21};
+    auto x = torch::rand({2, 30, n_input});
+    auto [mem, mem_mask] = model->encode(x, xlen);
+    auto [fmem, fmem_mask] = frozen_model.encode(x, xlen);
+    CHECK(!fmem.is_variable());
+    CHECK_THAT(fmem, testing::TensorClose(kernel::autograd::data(mem), 1e-4, 1e-5));
+    CHECK_THAT(fmem_mask, testing::TensorEq(kernel::autograd::data(mem_mask)));
+
+    // two steps of one token and a step of two tokens
+    auto state = model->decoder->init_state(mem, mem_mask);
+    auto fstate = frozen_model.decoder.init_state(fmem, fmem_mask);
+    auto t = (torch::rand({2, 4}) * (n_output - 1)).to(at::kLong);
+    for (auto [begin, end] : {std::make_pair(0, 1), std::make_pair(1, 2), std::make_pair(2, 4)}) {
+        auto y = model->decoder->forward_incremental(t.slice(1, begin, end), state);
+        auto fy = frozen_model.decoder.forward_incremental(t.slice(1, begin, end), fstate);
+        CHECK_THAT(kernel::autograd::data(fy), testing::TensorClose(kernel::autograd::data(y), 1e-4, 1e-5));
+    }
+
+    for (auto ctc_decode : {false, true}) {
+        for (auto beam : {1, 3}) {
+            model->config.ctc_decode = frozen_model.config.ctc_decode = ctc_decode;
+            model->config.beam_size = frozen_model.config.beam_size = beam;
+            auto expected = model->recognize_batch(x, xlen);
+            auto results = frozen_model.recognize_batch(x, xlen);
+            REQUIRE(results.size() == expected.size());
+            for (size_t i = 0; i < results.size(); ++i) {
+                CHECK(results[i].front().tokens == expected[i].front().tokens);
+                CHECK(results[i].front().score == Approx(expected[i].front().score).epsilon(1e-4));
+            }
+        }
+    }
+}
+
+TEST_CASE("freeze PositonalEmbedding", "[frozen]")
+{
+    namespace T = net::transformer;
+    std::int64_t n_output = 7;
+    T::Config conf;
+    conf.d_model = 6;
+    conf.d_ff = 4;
+    conf.heads = 2;
+    conf.elayers = 1;
+    conf.dlayers = 1;
+    conf.fused_projection = true;
+    net::Transformer<T::PositonalEmbedding> model(n_output, n_output, conf);
+    randomize_norms(model);
+    model->eval();
+    auto frozen_model = frozen::freeze(model);
+
+    torch::NoGradGuard no_grad;
+    auto x = (torch::rand({2, 5}) * (n_output - 1)).to(at::kLong);
+    auto [mem, mem_mask] = model->encode(x, {5, 3});
+    auto [fmem, fmem_mask] = frozen_model.encode(x, {5, 3});
+    CHECK_THAT(fmem, testing::TensorClose(kernel::autograd::data(mem), 1e-4, 1e-5));
+    // token inputs are not recognized by recognize_batch
+    auto decoder = &frozen_model.decoder;
+    auto expected = net::autoregressive_search(model->decoder, mem, mem_mask, model->sos, model->eos, conf);
+    auto results = net::autoregressive_search(decoder, fmem, fmem_mask, model->sos, model->eos, conf);
+    for (size_t i = 0; i < results.size(); ++i) {
+        CHECK(results[i].front().tokens == expected[i].front().tokens);
+    }
+}
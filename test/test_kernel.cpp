@@ -0,0 +1,244 @@
+#include <thxx/testing.hpp>
+#include <thxx/kernel.hpp>
+#include <thxx/net.hpp>
+
+using namespace thxx;
+
+
+TEST_CASE("attention", "[kernel]")
+{
+    net::MultiHeadedAttention att(2, 6, 0.0);
+    std::vector<at::Tensor> masks = {
+        net::pad_mask({3, 70}).unsqueeze(-2),
+        net::pad_mask({3, 70}).unsqueeze(-2).__and__(net::subsequent_mask(70).unsqueeze(0)),
+        // non-contiguous views are read by strides
+        net::subsequent_mask(80).slice(0, 5, 75).slice(1, 0, 70).unsqueeze(0),
+        net::pad_mask({3, 70}).unsqueeze(-2).expand({2, 70, 70})
+    };
+    for (auto m : masks) {
+        auto q = torch::rand({2, 2, 70, 3}).set_requires_grad(true);
+        auto k = torch::rand({2, 2, 70, 3}).set_requires_grad(true);
+        auto v = torch::rand({2, 2, 70, 3}).set_requires_grad(true);
+        auto expected = att->attention(q, k, v, m);
+        auto go = torch::rand_like(expected);
+        (expected * go).sum().backward();
+        auto dq = q.grad().clone();
+        auto dk = k.grad().clone();
+        auto dv = v.grad().clone();
+        q.grad().zero_();
+        k.grad().zero_();
+        v.grad().zero_();
+
+        auto actual = kernel::attention(q, k, v, m);
+        CHECK_THAT(actual, testing::TensorClose(expected));
+        (actual * go).sum().backward();
+        CHECK_THAT(q.grad(), testing::TensorClose(dq, 1e-4, 1e-5));
+        CHECK_THAT(k.grad(), testing::TensorClose(dk, 1e-4, 1e-5));
+        CHECK_THAT(v.grad(), testing::TensorClose(dv, 1e-4, 1e-5));
+    }
+}
+
+TEST_CASE("varlen_attention", "[kernel]")
+{
+    net::MultiHeadedAttention att(2, 6, 0.0);
+    std::vector<std::int64_t> lengths = {3, 70, 1};
+    auto offsets = net::length_offsets(lengths);
+    auto q = torch::rand({74, 2, 3}).set_requires_grad(true);
+    auto k = torch::rand({74, 2, 3}).set_requires_grad(true);
+    auto v = torch::rand({74, 2, 3}).set_requires_grad(true);
+
+    // reference: each sequence separately as (1, heads, time, d_k)
+    std::vector<at::Tensor> ys;
+    for (size_t i = 0; i < lengths.size(); ++i) {
+        auto split = [&](at::Tensor t) { return t.slice(0, offsets[i], offsets[i + 1]).transpose(0, 1).unsqueeze(0); };
+        ys.push_back(att->attention(split(q), split(k), split(v), {})[0].transpose(0, 1));
+    }
+    auto expected = torch::cat(ys, 0);
+    auto go = torch::rand_like(expected);
+    (expected * go).sum().backward();
+    auto dq = q.grad().clone();
+    auto dk = k.grad().clone();
+    auto dv = v.grad().clone();
+    q.grad().zero_();
+    k.grad().zero_();
+    v.grad().zero_();
+
+    auto actual = kernel::varlen_attention(q, k, v, offsets);
+    CHECK_THAT(actual, testing::TensorClose(expected));
+    (actual * go).sum().backward();
+    CHECK_THAT(q.grad(), testing::TensorClose(dq, 1e-4, 1e-5));
+    CHECK_THAT(k.grad(), testing::TensorClose(dk, 1e-4, 1e-5));
+    CHECK_THAT(v.grad(), testing::TensorClose(dv, 1e-4, 1e-5));
+}
+
+TEST_CASE("attention dropout", "[kernel]")
+{
+    auto q = torch::rand({2, 2, 5, 3}).set_requires_grad(true);
+    auto k = torch::rand({2, 2, 7, 3}).set_requires_grad(true);
+    auto v = torch::rand({2, 2, 7, 3}).set_requires_grad(true);
+    torch::manual_seed(0);
+    auto y1 = kernel::attention(q, k, v, {}, 0.5, true);
+    torch::manual_seed(0);
+    auto y2 = kernel::attention(q, k, v, {}, 0.5, true);
+    CHECK_THAT(y1, testing::TensorEq(y2));
+    CHECK_FALSE(at::allclose(y1, kernel::attention(q, k, v, {}, 0.5, false)));
+    y1.sum().backward();
+    CHECK(q.grad().defined());
+    CHECK(k.grad().defined());
+    CHECK(v.grad().defined());
+}
+
+TEST_CASE("layer_norm", "[kernel]")
+{
+    // long enough for SIMD lanes and the scalar tail
+    for (std::int64_t n : {3, 8, 37}) {
+        net::LayerNorm norm(n);
+        norm->fused = false;
+        {
+            torch::NoGradGuard no_grad;
+            norm->scale.uniform_();
+            norm->bias.uniform_();
+        }
+        auto x = torch::rand({2, 5, n}).set_requires_grad(true);
+        auto r = torch::rand({2, 5, n}).set_requires_grad(true);
+        auto gy = torch::rand({2, 5, n});
+        auto gv = torch::rand({2, 5, n});
+
+        auto v = x + r;
+        auto expected = norm->forward(v);
+        ((expected * gy).sum() + (v * gv).sum()).backward();
+        std::vector<at::Tensor> grads = {x.grad().clone(), r.grad().clone(),
+                                         norm->scale.grad().clone(), norm->bias.grad().clone()};
+        for (auto p : {x, r, norm->scale, norm->bias}) {
+            p.grad().zero_();
+        }
+
+        auto [y, v_] = kernel::layer_norm(x, r, norm->scale, norm->bias);
+        CHECK_THAT(y, testing::TensorClose(expected, 1e-4, 1e-5));
+        CHECK_THAT(v_, testing::TensorClose(v));
+        ((y * gy).sum() + (v_ * gv).sum()).backward();
+        CHECK_THAT(x.grad(), testing::TensorClose(grads[0], 1e-4, 1e-4));
+        CHECK_THAT(r.grad(), testing::TensorClose(grads[1], 1e-4, 1e-4));
+        CHECK_THAT(norm->scale.grad(), testing::TensorClose(grads[2], 1e-4, 1e-4));
+        CHECK_THAT(norm->bias.grad(), testing::TensorClose(grads[3], 1e-4, 1e-4));
+
+        auto [y1, v1] = kernel::layer_norm(x, {}, norm->scale, norm->bias);
+        CHECK_FALSE(v1.defined());
+        CHECK_THAT(y1, testing::TensorClose(norm->forward(x), 1e-4, 1e-5));
+
+        // no affine transform without gamma and beta
+        net::LayerNorm plain(n);
+        plain->fused = false;
+        x.grad().zero_();
+        auto plain_y = plain->forward(x);
+        (plain_y * gy).sum().backward();
+        auto gx = x.grad().clone();
+        x.grad().zero_();
+        auto [y2, v2] = kernel::layer_norm(x, {}, {}, {});
+        CHECK_THAT(y2, testing::TensorClose(plain_y, 1e-4, 1e-5));
+        (y2 * gy).sum().backward();
+        CHECK_THAT(x.grad(), testing::TensorClose(gx, 1e-4, 1e-4));
+    }
+}
+
+TEST_CASE("pointwise_chain", "[kernel]")
+{
+    namespace P = kernel::pointwise;
+    auto x = (torch::randn({3, 7, 5}) * 2).set_requires_grad(true);
+    auto gy = torch::rand({3, 7, 5});
+    auto expected = torch::tanh(torch::sigmoid(torch::relu(x)));
+    (expected * gy).sum().backward();
+    auto gx = x.grad().clone();
+    x.grad().zero_();
+
+    std::vector<P::Op> ops = {{P::Kind::dropout}, {P::Kind::relu}, {P::Kind::sigmoid}, {P::Kind::tanh}};
+    auto y = kernel::pointwise_chain(x, ops);
+    CHECK_THAT(y, testing::TensorClose(expected));
+    (y * gy).sum().backward();
+    CHECK_THAT(x.grad(), testing::TensorClose(gx));
+
+    // dropout of the same seed is replayed in backward
+    x.grad().zero_();
+    ops = {{P::Kind::dropout, 0.5, 42}};
+    auto d = kernel::pointwise_chain(x, ops);
+    auto kept = (d != 0).to(at::kFloat);
+    CHECK_THAT(d, testing::TensorClose(x * kept * 2));
+    CHECK(kept.mean().item<float>() == Approx(0.5).margin(0.2));
+    CHECK_THAT(kernel::pointwise_chain(x, ops), testing::TensorEq(d));
+    (d * gy).sum().backward();
+    CHECK_THAT(x.grad(), testing::TensorClose(gy * kept * 2));
+}
+
+TEST_CASE("checkpoint", "[kernel]")
+{
+    torch::nn::Dropout dropout(0.5);
+    auto w = torch::rand({8}).set_requires_grad(true);
+    auto x = (torch::rand({4, 8}) + 1).set_requires_grad(true);
+    auto fn = [&](const std::vector<at::Tensor>& xs) {
+        return std::vector<at::Tensor>{dropout->forward(xs[0] * w)};
+    };
+    torch::manual_seed(0);
+    auto y = kernel::checkpoint(fn, {x})[0];
+    REQUIRE(y.requires_grad());
+    y.sum().backward();
+    // the same dropout mask is replayed in backward
+    auto keep = (y != 0).to(at::kFloat) * 2;
+    CHECK_THAT(x.grad(), testing::TensorClose(keep * w));
+    CHECK_THAT(w.grad(), testing::TensorClose((keep * x).sum(0)));
+}
+
+TEST_CASE("quantized_linear", "[kernel]")
+{
+    // 37 input features run both SIMD and scalar tails
+    net::Linear linear(37, 11);
+    linear->eval();
+    torch::NoGradGuard no_grad;
+    auto x = torch::randn({2, 3, 37});
+    auto expected = linear->forward(x);
+    net::quantize_dynamic(*linear);
+    REQUIRE(linear->quantized.defined());
+    CHECK(linear->quantized.weight.scalar_type() == at::kChar);
+    auto actual = linear->forward(x);
+    CHECK(actual.sizes() == expected.sizes());
+    CHECK(((actual - expected).norm() / expected.norm()).template item<float>() < 0.02);
+    // fp32 weight is used for training
+    linear->train();
+    CHECK_THAT(linear->forward(x), testing::TensorClose(expected));
+
+    // more than a block of rows and output channels with tails of the tiles
+    auto w = kernel::quantize_per_channel(torch::randn({70, 37}));
+    auto x2 = torch::randn({67, 37});
+    auto y2 = kernel::quantized_linear(x2, w, at::Tensor());
+    auto w2 = torch::autograd::make_variable(w.weight.to(at::kFloat) * w.scale.unsqueeze(1));
+    auto expected2 = x2.matmul(w2.t());
+    CHECK(((y2 - expected2).norm() / expected2.norm()).template item<float>() < 0.02);
+}
+
+TEST_CASE("linear_label_smoothing", "[kernel]")
+{
+    net::Linear f(6, 11);
+    auto h = torch::rand({13, 6}).set_requires_grad(true);
+    auto t = (torch::rand({13}) * 11).to(at::kLong);
+    t[2] = -1;
+    t[7] = -1;
+
+    auto p = f->forward(h);
+    auto expected = net::label_smoothing_kl_div(p, t, 0.1, -1);
+    expected.backward();
+    auto dh = h.grad().clone();
+    auto dw = f->weight.grad().clone();
+    auto db = f->bias.grad().clone();
+    h.grad().zero_();
+    f->zero_grad();
+
+    // chunks of 5 rows with the last partial one
+    auto [loss, correct] = kernel::linear_label_smoothing(h, f->weight, f->bias, t, 0.1, -1, 5);
+    CHECK_THAT(loss, testing::TensorClose(expected));
+    auto valid = t != -1;
+    auto n_correct = (p.argmax(1) == t).__and__(valid).sum().template item<std::int64_t>();
+    CHECK(correct.template item<std::int64_t>() == n_correct);
+    loss.backward();
+    CHECK_THAT(h.grad(), testing::TensorClose(dh, 1e-4, 1e-6));
+    CHECK_THAT(f->weight.grad(), testing::TensorClose(dw, 1e-4, 1e-6));
+    CHECK_THAT(f->bias.grad(), testing::TensorClose(db, 1e-4, 1e-6));
+}
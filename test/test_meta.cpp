@@ -90,3 +90,50 @@ TEST_CASE( "sequential and its submodules", "[meta]" ) {
     CHECK_THAT( seq->named_children()["1"]->parameters()[0], testing::TensorEq(l2->weight) );
     CHECK_THAT( seq->named_children()["1"]->parameters()[1], testing::TensorEq(l2->bias) );
 }
+
+TEST_CASE( "sequential fuses pointwise stages", "[meta]" ) {
+    static_assert(detail::is_pointwise<torch::nn::Dropout>::value);
+    static_assert(detail::is_pointwise<Lambda<Relu>>::value);
+    static_assert(detail::is_pointwise<Lambda<Tanh>>::value);
+    // only the functors are recognized
+    static_assert(!detail::is_pointwise<decltype(lambda(torch::relu))>::value);
+    static_assert(!detail::is_pointwise<torch::nn::Linear>::value);
+
+    auto l1 = torch::nn::Linear(4, 6);
+    auto dropout = torch::nn::Dropout(0.5);
+    auto relu = lambda(Relu());
+    Lambda<Tanh> tanh;
+    auto l2 = torch::nn::Linear(6, 3);
+    auto seq = sequential(l1, dropout, relu, tanh, l2);
+    CHECK( seq->children().size() == 5 );
+
+    // eval: the same outputs and gradients as the stages one by one
+    seq->eval();
+    auto x = torch::randn({2, 5, 4}).set_requires_grad(true);
+    auto expected = l2->forward(torch::tanh(torch::relu(dropout->forward(l1->forward(x)))));
+    expected.sum().backward();
+    auto gx = x.grad().clone();
+    auto gw = l1->weight.grad().clone();
+    x.grad().zero_();
+    l1->weight.grad().zero_();
+    auto y = seq->forward(x);
+    CHECK_THAT( y, testing::TensorClose(expected) );
+    y.sum().backward();
+    CHECK_THAT( x.grad(), testing::TensorClose(gx) );
+    CHECK_THAT( l1->weight.grad(), testing::TensorClose(gw) );
+
+    // train: dropped units have no output and no gradient
+    auto pw = sequential(dropout, relu);
+    pw->train();
+    auto z = torch::rand({4, 100}).add_(0.1).set_requires_grad(true);
+    auto h = pw->forward(z);
+    h.sum().backward();
+    auto kept = (h != 0).to(at::kFloat);
+    CHECK_THAT( h, testing::TensorClose(z * kept * 2) );
+    CHECK_THAT( z.grad(), testing::TensorClose(kept * 2) );
+
+    // other functions are applied as they are
+    auto square = lambda(static_cast<at::Tensor (*)(const at::Tensor&)>([](const at::Tensor& t) { return t * t; }));
+    auto f = sequential(relu, square, lambda(torch::relu));
+    CHECK_THAT( f->forward(x), testing::TensorClose(torch::relu(x) * torch::relu(x)) );
+}
@@ -1,6 +1,10 @@
 #include <thxx/testing.hpp>
 #include <thxx/net.hpp>
 
+#include <map>
+#include <numeric>
+#include <thread>
+
 using namespace thxx;
 using namespace thxx::net;
 
@@ -49,6 +53,34 @@ TEST_CASE("pad_mask", "[net]")
     }
 }
 
+TEST_CASE("shift_targets", "[net]")
+{
+    std::vector<std::int64_t> ls = {2, 5, 1};
+    auto t = torch::autograd::make_variable((at::rand({3, 5}) * 10).to(at::kLong));
+    std::int64_t sos = 11, eos = 12, ignore = -1;
+    auto [t_in, t_out] = shift_targets(t, ls, sos, eos, ignore);
+
+    // reference per-sample construction
+    auto e_in = t.clone().fill_(ignore);
+    auto e_out = t.clone().fill_(ignore);
+    for (size_t i = 0; i < ls.size(); ++i)
+    {
+        auto n = ls[i];
+        e_in[i][0] = sos;
+        e_in[i].slice(0, 1, n) = t[i].slice(0, 0, n - 1);
+        e_out[i].slice(0, 0, n - 1) = t[i].slice(0, 1, n);
+        e_out[i][n - 1] = eos;
+    }
+    CHECK_THAT(t_in, testing::TensorEq(e_in));
+    CHECK_THAT(t_out, testing::TensorEq(e_out));
+
+    // an empty target is all padding
+    auto [z_in, z_out] = shift_targets(t.slice(0, 0, 2), {0, 5}, sos, eos, ignore);
+    CHECK_THAT(z_in[0], testing::TensorEq(e_in[0].fill_(ignore)));
+    CHECK_THAT(z_out[0], testing::TensorEq(e_out[0].fill_(ignore)));
+    CHECK_THAT(z_in[1], testing::TensorEq(t_in[1]));
+}
+
 TEST_CASE("subsequent_mask", "[net]")
 {
     auto m = subsequent_mask(3);
@@ -56,6 +88,20 @@ TEST_CASE("subsequent_mask", "[net]")
     CHECK_THAT(m, testing::TensorEq(p));
 }
 
+TEST_CASE("MaskCache", "[net]")
+{
+    auto& cache = net::detail::MaskCache::instance();
+    auto small = subsequent_mask(5);
+    auto large = subsequent_mask(300);
+    // grown beyond the initial size
+    CHECK_THAT(large, testing::TensorEq(at::ones({300, 300}, at::kByte).tril_()));
+    CHECK_THAT(small, testing::TensorEq(at::ones({5, 5}, at::kByte).tril_()));
+    // slices of the same storage
+    auto again = subsequent_mask(7);
+    CHECK(again.data<std::uint8_t>() == subsequent_mask(3).data<std::uint8_t>());
+    CHECK_THAT(cache.positions(4, torch::kCPU), testing::TensorEq(at::arange(4, at::kLong)));
+}
+
 TEST_CASE("LayerNorm", "[net]")
 {
     LayerNorm norm(3);
@@ -63,7 +109,7 @@ TEST_CASE("LayerNorm", "[net]")
 
     auto x_ = (x - x.mean(-1, true)) / x.std(-1, true).unsqueeze(-1);
     auto y = norm->forward(x);
-    CHECK_THAT(y, testing::TensorEq(x_));
+    CHECK_THAT(y, testing::TensorClose(x_));
 
     // test grad
     y.sum().backward();
@@ -83,7 +129,15 @@ TEST_CASE("MultiHeadedAttention", "[net]")
     auto ret = att->forward(x, x, x, m);
     ret.sum().backward();
     CHECK_THAT(*att, testing::HasGrad(true));
-    // std::cout << att->attn[0][0] << std::endl;
+
+    // attention weights are captured only on request
+    torch::Tensor attn;
+    att->eval();
+    auto y = att->forward(x, x, x, m, &attn);
+    REQUIRE(attn.defined());
+    CHECK(attn.sizes() == at::IntList({2, 2, 5, 5}));
+    CHECK(attn[0].slice(-1, 3).sum().template item<float>() == 0);
+    CHECK_THAT(y, testing::TensorClose(att->forward(x, x, x, m)));
 }
 
 TEST_CASE("label_smoothing_kl_div", "[net]")
@@ -98,6 +152,14 @@ TEST_CASE("label_smoothing_kl_div", "[net]")
     auto loss = label_smoothing_kl_div(p, t, 0.1, -1);
     loss.backward();
     CHECK_THAT(*f, testing::HasGrad(true));
+
+    // the dense definition
+    auto ignore = 3;
+    auto true_dist = torch::full_like(p, 0.1 / n_output);
+    true_dist.scatter_(1, t.unsqueeze(1), 0.9);
+    auto kl = torch::kl_div(p.log_softmax(1), true_dist, Reduction::None).sum(1);
+    auto expected = kl.masked_fill(t == ignore, 0).sum() / (t != ignore).sum().to(at::kFloat);
+    CHECK_THAT(label_smoothing_kl_div(p, t, 0.1, ignore), testing::TensorClose(expected));
 }
 
 TEST_CASE("transformer", "[net]")
@@ -179,3 +241,625 @@ TEST_CASE("transformer", "[net]")
         CHECK_THAT( *model, testing::HasGrad(true) );
     }
 }
+
+TEST_CASE("Metrics", "[net]")
+{
+    namespace T = transformer;
+    T::Config conf;
+    conf.d_model = 6;
+    conf.d_ff = 4;
+    conf.heads = 3;
+    conf.elayers = 1;
+    conf.dlayers = 1;
+    conf.dropout_rate = 0.0;
+    auto n_output = 7;
+    Transformer<T::PositonalEmbedding> model(n_output, n_output, conf);
+    model->eval();
+    torch::NoGradGuard no_grad;
+
+    double loss_sum = 0, acc_sum = 0;
+    std::int64_t tokens = 0;
+    for (std::vector<std::int64_t> len : {std::vector<std::int64_t>{3, 5}, std::vector<std::int64_t>{4, 2, 6}}) {
+        auto n = static_cast<std::int64_t>(len.size());
+        auto x = (torch::rand({n, 6}) * (n_output - 2)).to(at::kLong);
+        auto [loss, acc] = model->forward(x, len, x, len);
+        auto n_tokens = std::accumulate(len.begin(), len.end(), std::int64_t(0));
+        loss_sum += loss.item<double>() * n_tokens;
+        acc_sum += acc.item<double>() * n_tokens;
+        tokens += n_tokens;
+    }
+    CHECK(model->metrics.steps == 2);
+    CHECK(model->metrics.tokens == tokens);
+    CHECK(model->metrics.loss() == Approx(loss_sum / tokens));
+    CHECK(model->metrics.accuracy() == Approx(acc_sum / tokens));
+
+    model->metrics.reset();
+    CHECK(model->metrics.tokens == 0);
+    CHECK(model->metrics.accuracy() == 0);
+}
+
+TEST_CASE("Decoder::forward_incremental", "[net]")
+{
+    namespace T = transformer;
+    T::Config conf;
+    conf.d_model = 6;
+    conf.d_ff = 4;
+    conf.heads = 3;
+    conf.dlayers = 2;
+    auto n_output = 5;
+    auto mem = torch::rand({2, 7, conf.d_model});
+    auto mem_mask = pad_mask({4, 7}).unsqueeze(-2);
+    auto t = (torch::rand({2, 4}) * n_output).to(at::kLong);
+    auto tm = subsequent_mask(4).unsqueeze(0);
+
+    T::Decoder f(n_output, conf);
+    f->eval();
+    torch::NoGradGuard no_grad;
+    auto [expected, _m] = f->forward(t, tm, mem, mem_mask);
+
+    // one token per step
+    auto state = f->init_state(mem, mem_mask);
+    std::vector<torch::Tensor> ys;
+    for (std::int64_t i = 0; i < t.size(1); ++i) {
+        ys.push_back(f->forward_incremental(t.slice(1, i, i + 1), state));
+    }
+    CHECK(state.offset == t.size(1));
+    CHECK_THAT(torch::cat(ys, 1), testing::TensorClose(expected));
+
+    // several tokens per step
+    state = f->init_state(mem, mem_mask);
+    auto y1 = f->forward_incremental(t.slice(1, 0, 1), state);
+    auto y2 = f->forward_incremental(t.slice(1, 1, 4), state);
+    CHECK_THAT(torch::cat({y1, y2}, 1), testing::TensorClose(expected));
+}
+
+TEST_CASE("checkpoint_layers", "[net]")
+{
+    namespace T = transformer;
+    T::Config conf;
+    conf.d_model = 6;
+    conf.d_ff = 4;
+    conf.heads = 3;
+    conf.elayers = 3;
+    conf.dlayers = 3;
+    conf.dropout_rate = 0.0;
+    auto n_input = 8;
+    auto n_output = 5;
+    auto x = torch::rand({2, 20, n_input});
+    auto x_mask = pad_mask({15, 20}).unsqueeze(-2);
+    auto t = (torch::rand({2, 4}) * n_output).to(at::kLong);
+    // padded causal mask of the batch as TransformerImpl::forward builds
+    auto t_mask = pad_mask({4, 3}).unsqueeze(-2).__and__(subsequent_mask(4).unsqueeze(0));
+
+    T::Encoder<T::Conv2dSubsampling> encoder(n_input, conf);
+    T::Decoder decoder(n_output, conf);
+    auto run = [&](std::int64_t k) {
+        encoder->config.checkpoint_layers = k;
+        decoder->config.checkpoint_layers = k;
+        encoder->zero_grad();
+        decoder->zero_grad();
+        auto [h, h_mask] = encoder->forward(x, x_mask);
+        auto [y, y_mask] = decoder->forward(t, t_mask, h, h_mask);
+        y.sum().backward();
+        std::vector<torch::Tensor> ret = {y.detach()};
+        for (auto& p : encoder->parameters()) ret.push_back(p.grad().clone());
+        for (auto& p : decoder->parameters()) ret.push_back(p.grad().clone());
+        return ret;
+    };
+    auto expected = run(0);
+    for (std::int64_t k : {1, 2}) {
+        auto actual = run(k);
+        REQUIRE(actual.size() == expected.size());
+        for (size_t i = 0; i < actual.size(); ++i) {
+            CHECK_THAT(actual[i], testing::TensorClose(expected[i], 1e-4, 1e-5));
+        }
+    }
+}
+
+TEST_CASE("Encoder::forward_packed", "[net]")
+{
+    namespace T = transformer;
+    T::Config conf;
+    conf.d_model = 6;
+    conf.d_ff = 4;
+    conf.heads = 3;
+    conf.elayers = 2;
+    auto n_input = 8;
+    std::vector<std::int64_t> lengths = {20, 33, 9};
+    auto x = torch::zeros({3, 33, n_input});
+    for (size_t i = 0; i < lengths.size(); ++i) {
+        x[i].slice(0, 0, lengths[i]) = torch::rand({lengths[i], n_input});
+    }
+
+    T::Encoder<T::Conv2dSubsampling> f(n_input, conf);
+    f->eval();
+    torch::NoGradGuard no_grad;
+    auto [y, offsets] = f->forward_packed(pack_padded(x, lengths), length_offsets(lengths));
+    REQUIRE(offsets.size() == lengths.size() + 1);
+    CHECK(y.size(0) == offsets.back());
+    for (size_t i = 0; i < lengths.size(); ++i) {
+        // the same as an utterance without padding
+        auto xi = x[i].slice(0, 0, lengths[i]).unsqueeze(0);
+        auto [expected, m] = f->forward(xi, pad_mask({lengths[i]}).unsqueeze(-2));
+        CHECK_THAT(y.slice(0, offsets[i], offsets[i + 1]), testing::TensorClose(expected[0]));
+    }
+    // padded encoding has the same lengths and frames
+    auto [yp, yp_mask] = f->forward(x, pad_mask(lengths).unsqueeze(-2));
+    for (size_t i = 0; i < lengths.size(); ++i) {
+        auto n = offsets[i + 1] - offsets[i];
+        CHECK(yp_mask[i].sum().item<std::int64_t>() == n);
+        CHECK_THAT(yp[i].slice(0, 0, n), testing::TensorClose(y.slice(0, offsets[i], offsets[i + 1]), 1e-4, 1e-5));
+    }
+
+    auto padded = pad_packed(y, offsets);
+    CHECK(padded.size(0) == 3);
+    CHECK_THAT(pack_padded(padded, {offsets[1], offsets[2] - offsets[1], offsets[3] - offsets[2]}),
+               testing::TensorClose(y));
+}
+
+TEST_CASE("chunk_mask", "[net]")
+{
+    auto m = transformer::chunk_mask(5, 2, 1);
+    for (std::int64_t i = 0; i < m.size(0); ++i)
+    {
+        for (std::int64_t j = 0; j < m.size(1); ++j)
+        {
+            std::uint8_t b = j / 2 <= i / 2 && j / 2 >= i / 2 - 1 ? 1 : 0;
+            CHECK(m[i][j].template item<std::uint8_t>() == b);
+        }
+    }
+}
+
+TEST_CASE("PositionalEncoding beyond max_len", "[net]")
+{
+    transformer::PositionalEncoding short_pe(6, 0.0, 10);
+    transformer::PositionalEncoding long_pe(6, 0.0, 30);
+    short_pe->eval();
+    long_pe->eval();
+    auto x = torch::rand({1, 8, 6});
+    CHECK_THAT(short_pe->forward(x, 20), testing::TensorClose(long_pe->forward(x, 20)));
+    CHECK_THAT(short_pe->forward(x, 5), testing::TensorClose(long_pe->forward(x, 5)));
+}
+
+TEST_CASE("PositionalEncodingTable", "[net]")
+{
+    namespace T = transformer;
+    T::PositionalEncoding pe(6, 0.0, 10);
+    CHECK(pe->buffers().empty());
+
+    auto& table = T::PositionalEncodingTable::instance();
+    auto a = table.get(0, 4, 6, at::kFloat, torch::kCPU);
+    auto b = table.get(2, 2, 6, at::kFloat, torch::kCPU);
+    // views of one shared table
+    CHECK(a.data<float>() + 2 * 6 == b.data<float>());
+    CHECK_THAT(b, testing::TensorClose(T::positional_encoding(2, 2, 6)));
+
+    // positions beyond the cache are computed on the fly
+    auto n = T::PositionalEncodingTable::max_cached;
+    auto c = table.get(n - 1, 3, 6, at::kFloat, torch::kCPU);
+    CHECK_THAT(c.slice(1, 0, 1), testing::TensorClose(table.get(n - 1, 1, 6, at::kFloat, torch::kCPU)));
+}
+
+TEST_CASE("Conv2dSubsampling", "[net]")
+{
+    namespace T = transformer;
+    auto n_freq = 40;
+    auto x = torch::rand({2, 53, n_freq});
+    auto m = pad_mask({53, 30}).unsqueeze(-2);
+    for (std::int64_t rate : {4, 6, 8}) {
+        T::Conv2dSubsampling f(n_freq, 8, 0.0, rate);
+        CHECK(f->stride == rate);
+        auto [y, ym] = f->forward(x, m);
+        CHECK(y.size(1) == f->output_length(53));
+        CHECK(ym.size(2) == y.size(1));
+        // frames convolving no padded input
+        CHECK(ym[0].sum().item<std::int64_t>() == f->output_length(53));
+        CHECK(ym[1].sum().item<std::int64_t>() == f->output_length(30));
+
+        // reference in (b, c, t, f) layout
+        auto h = x.unsqueeze(1);
+        for (auto& conv : f->convs) {
+            h = conv->forward(h).relu();
+        }
+        h = h.transpose(1, 2).contiguous().view({2, h.size(2), -1});
+        CHECK_THAT(f->subsample(x), testing::TensorClose(f->out->forward(h)));
+    }
+}
+
+TEST_CASE("Encoder::forward_chunk", "[net]")
+{
+    namespace T = transformer;
+    T::Config conf;
+    conf.d_model = 6;
+    conf.d_ff = 4;
+    conf.heads = 3;
+    conf.elayers = 2;
+    conf.stream_chunk = 2;
+    conf.stream_left_chunks = 1;
+    auto n_input = 8;
+    // 11 subsampled frames: 5 complete chunks and 1 flushed frame
+    auto x = torch::rand({1, 47, n_input});
+
+    T::Encoder<T::Conv2dSubsampling> f(n_input, conf);
+    f->eval();
+    torch::NoGradGuard no_grad;
+    auto [expected, mask] = f->forward(x, pad_mask({47}).unsqueeze(-2));
+    CHECK(mask.size(1) == 1);
+
+    T::EncoderStreamState state;
+    std::vector<torch::Tensor> ys;
+    std::int64_t begin = 0;
+    for (std::int64_t n : {11, 13, 1, 22}) {
+        auto last = begin + n == x.size(1);
+        ys.push_back(f->forward_chunk(x.slice(1, begin, begin + n), state, last));
+        begin += n;
+        // memory is bounded by the look-back
+        CHECK(state.k[0].size(2) <= conf.stream_chunk * conf.stream_left_chunks);
+        CHECK(state.buffer.size(1) < f->input_layer->context);
+    }
+    CHECK(state.offset == expected.size(1));
+    CHECK_THAT(torch::cat(ys, 1), testing::TensorClose(expected));
+}
+
+TEST_CASE("beam_search", "[net]")
+{
+    namespace T = transformer;
+    std::int64_t n_input = 6;
+    std::int64_t n_output = 5;
+    T::Config conf;
+    conf.d_model = n_input;
+    conf.d_ff = 3;
+    conf.heads = 3;
+    conf.beam_size = 3;
+    Transformer<T::Conv2dSubsampling> model(n_input, n_output, conf);
+    model->eval();
+    torch::NoGradGuard no_grad;
+    auto n_best = model->recognize(torch::rand({30, n_input}));
+    REQUIRE(n_best.size() > 0);
+    CHECK(n_best.size() <= static_cast<size_t>(conf.beam_size));
+    for (size_t i = 0; i < n_best.size(); ++i) {
+        CHECK(n_best[i].tokens.front() == model->sos);
+        CHECK(n_best[i].tokens.back() == model->eos);
+        if (i > 0) {
+            CHECK(n_best[i - 1].score >= n_best[i].score);
+        }
+    }
+}
+
+TEST_CASE("ctc_greedy_search", "[net]")
+{
+    std::vector<std::int64_t> best = {1, 1, 0, 2, 2, 0, 2, 3};
+    auto logp = torch::full({1, 8, 4}, -10.0);
+    for (size_t t = 0; t < best.size(); ++t) {
+        logp[0][t][best[t]] = 0;
+    }
+    // the last frame is padding
+    auto h = ctc_greedy_search(logp, {7}, 0, 9, 9).front();
+    CHECK(h.tokens == std::vector<std::int64_t>({9, 1, 2, 2, 9}));
+    CHECK(h.score == Approx(0.0));
+}
+
+TEST_CASE("ctc_prefix_beam_search", "[net]")
+{
+    std::int64_t n_time = 3, n_class = 3;
+    auto logp = torch::rand({n_time, n_class}).log_softmax(-1);
+    // exact probability of each prefix by enumerating all the alignments
+    std::map<std::vector<std::int64_t>, double> exact;
+    for (std::int64_t a = 0; a < 27; ++a) {
+        std::vector<std::int64_t> prefix;
+        std::int64_t prev = 0;
+        double lp = 0;
+        for (std::int64_t t = 0, c = a; t < n_time; ++t, c /= n_class) {
+            auto k = c % n_class;
+            if (k != 0 && k != prev) prefix.push_back(k);
+            prev = k;
+            lp += logp[t][k].item<double>();
+        }
+        exact[prefix] += std::exp(lp);
+    }
+    auto best = std::max_element(exact.begin(), exact.end(),
+                                 [](const auto& a, const auto& b) { return a.second < b.second; });
+
+    auto n_best = ctc_prefix_beam_search(logp, 0, 9, 9, 27);
+    REQUIRE(n_best.size() == exact.size());
+    auto tokens = n_best.front().tokens;
+    CHECK(std::vector<std::int64_t>(tokens.begin() + 1, tokens.end() - 1) == best->first);
+    CHECK(n_best.front().score == Approx(std::log(best->second)));
+
+    // the last class of a prefix is extended even if it is out of the top classes of a frame
+    auto repeat = torch::tensor({0.3f, 0.6f, 0.1f, 0.05f, 0.47f, 0.48f}).view({2, 3}).log();
+    auto h = ctc_prefix_beam_search(repeat, 0, 9, 9, 1).front();
+    CHECK(h.tokens == std::vector<std::int64_t>({9, 1, 9}));
+    CHECK(h.score == Approx(std::log(0.6 * (0.05 + 0.47))));
+}
+
+TEST_CASE("ctc", "[net]")
+{
+    namespace T = transformer;
+    std::int64_t n_input = 6;
+    std::int64_t n_output = 5;
+    T::Config conf;
+    conf.d_model = n_input;
+    conf.d_ff = 3;
+    conf.heads = 3;
+    conf.elayers = 1;
+    conf.dlayers = 1;
+    conf.ctc_weight = 0.3;
+    Transformer<T::Conv2dSubsampling> model(n_input, n_output, conf);
+    auto x = torch::rand({2, 30, n_input});
+    auto t = (torch::rand({2, 4}) * (n_output - 2) + 1).to(at::kLong);
+    auto [loss, acc] = model->forward(x, {30, 21}, t, {4, 3});
+    loss.backward();
+    CHECK_THAT(*model->ctc, testing::HasGrad(true));
+
+    model->eval();
+    torch::NoGradGuard no_grad;
+    for (auto beam : {1, 3}) {
+        model->config.ctc_decode = true;
+        model->config.beam_size = beam;
+        auto results = model->recognize_batch(x, {30, 21});
+        REQUIRE(results.size() == 2);
+        for (const auto& n_best : results) {
+            REQUIRE(!n_best.empty());
+            CHECK(n_best.front().tokens.front() == model->sos);
+            CHECK(n_best.front().tokens.back() == model->eos);
+        }
+    }
+}
+
+TEST_CASE("early exit", "[net]")
+{
+    namespace T = transformer;
+    std::int64_t n_input = 6;
+    std::int64_t n_output = 5;
+    T::Config conf;
+    conf.d_model = n_input;
+    conf.d_ff = 3;
+    conf.heads = 3;
+    conf.elayers = 5;
+    conf.dlayers = 1;
+    conf.dropout_rate = 0.0;
+    conf.ctc_weight = 0.3;
+    conf.exit_interval = 2;
+    conf.layer_drop = 0.5;
+    conf.checkpoint_layers = 2;
+    Transformer<T::Conv2dSubsampling> model(n_input, n_output, conf);
+    auto& encoder = model->encoder;
+    // after the 2nd and the 4th layers (not after the last one)
+    REQUIRE(encoder->exits.size() == 2);
+    CHECK(encoder->exit_index(1) == 0);
+    CHECK(encoder->exit_index(3) == 1);
+    CHECK(encoder->exit_index(4) == -1);
+
+    auto x = torch::rand({2, 30, n_input});
+    auto t = (torch::rand({2, 4}) * (n_output - 2) + 1).to(at::kLong);
+    auto [loss, acc] = model->forward(x, {30, 21}, t, {4, 3});
+    loss.backward();
+    for (auto& e : encoder->exits) {
+        CHECK_THAT(*e, testing::HasGrad(true));
+    }
+
+    // every layer is skipped
+    auto x_mask = pad_mask({30, 21}).unsqueeze(-2);
+    encoder->config.layer_drop = 1.0;
+    {
+        auto [h, h_mask] = encoder->forward(x, x_mask);
+        auto [e, e_mask] = encoder->input_layer->forward(x, x_mask);
+        CHECK_THAT(h, testing::TensorClose(encoder->norm->forward(e)));
+    }
+
+    model->eval();
+    torch::NoGradGuard no_grad;
+    auto [full, full_mask] = encoder->forward(x, x_mask);
+    auto [e, e_mask] = encoder->input_layer->forward(x, x_mask);
+    for (std::int64_t i = 0; i < 2; ++i) {
+        e = std::get<0>(encoder->layers[i]->forward(e, e_mask));
+    }
+    auto first_exit = encoder->norm->forward(e);
+    // any confidence exceeds a tiny threshold and nothing exceeds 1
+    encoder->config.exit_threshold = 1e-6;
+    CHECK_THAT(std::get<0>(encoder->forward(x, x_mask)), testing::TensorClose(first_exit));
+    encoder->config.exit_threshold = 1.0;
+    CHECK_THAT(std::get<0>(encoder->forward(x, x_mask)), testing::TensorClose(full));
+    auto c = T::exit_confidence(encoder->exits[0]->forward(first_exit), e_mask);
+    CHECK(c > 1.0 / n_output);
+    CHECK(c <= 1.0);
+
+    // the same exits on packed sequences (Config::unpadded) as on each utterance without padding
+    std::vector<std::int64_t> xlen = {30, 21};
+    for (float threshold : {1e-6f, 1.0f}) {
+        encoder->config.exit_threshold = threshold;
+        auto [y, offsets] = encoder->forward_packed(pack_padded(x, xlen), length_offsets(xlen));
+        for (size_t i = 0; i < xlen.size(); ++i) {
+            auto xi = x[i].slice(0, 0, xlen[i]).unsqueeze(0);
+            auto expected = std::get<0>(encoder->forward(xi, pad_mask({xlen[i]}).unsqueeze(-2)));
+            CHECK_THAT(y.slice(0, offsets[i], offsets[i + 1]), testing::TensorClose(expected[0]));
+        }
+    }
+
+    // the CTC head only learns the last layer
+    model->config.ctc_decode = true;
+    model->config.exit_threshold = 0.5;
+    CHECK_THROWS(model->recognize_batch(x, {30, 21}));
+}
+
+TEST_CASE("max_output_length", "[net]")
+{
+    transformer::Config conf;
+    // input frames without max_len_ratio (encoded frames if unknown)
+    CHECK(max_output_length(5, conf, 20) == 20);
+    CHECK(max_output_length(5, conf) == 5);
+    conf.max_len_ratio = 0.5;
+    CHECK(max_output_length(5, conf, 20) == 2);
+    CHECK(max_output_length(1, conf, 20) == 1);
+}
+
+TEST_CASE("recognize_batch", "[net]")
+{
+    namespace T = transformer;
+    std::int64_t n_input = 6;
+    std::int64_t n_output = 5;
+    T::Config conf;
+    conf.d_model = n_input;
+    conf.d_ff = 3;
+    conf.heads = 3;
+    conf.max_len_ratio = 2.0;
+    Transformer<T::Conv2dSubsampling> model(n_input, n_output, conf);
+    model->eval();
+    torch::NoGradGuard no_grad;
+
+    std::vector<std::int64_t> xlen = {20, 30};
+    auto x = torch::zeros({2, 30, n_input});
+    x[0].slice(0, 0, xlen[0]) = torch::rand({xlen[0], n_input});
+    x[1] = torch::rand({xlen[1], n_input});
+    auto batch = model->recognize_batch(x, xlen);
+    REQUIRE(batch.size() == 2);
+    for (size_t i = 0; i < batch.size(); ++i) {
+        auto single = model->recognize(x[i].slice(0, 0, xlen[i]));
+        CHECK(batch[i].front().tokens == single.front().tokens);
+        CHECK(batch[i].front().tokens.back() == model->eos);
+        // (subsampled frames) * max_len_ratio + sos + eos
+        auto n = ((xlen[i] - 1) / 2 - 1) / 2;
+        CHECK(batch[i].front().tokens.size() <= static_cast<size_t>(2 * n + 2));
+    }
+}
+
+TEST_CASE("speculative_greedy_search", "[net]")
+{
+    namespace T = transformer;
+    std::int64_t n_input = 6;
+    std::int64_t n_output = 5;
+    T::Config conf;
+    conf.d_model = n_input;
+    conf.d_ff = 3;
+    conf.heads = 3;
+    conf.draft_dlayers = 1;
+    conf.draft_d_ff = 2;
+    conf.max_len_ratio = 2.0;
+    conf.min_len_ratio = 0.5;
+    Transformer<T::Conv2dSubsampling> model(n_input, n_output, conf);
+    CHECK(model->draft->layers.size() == 1);
+    CHECK(model->decoder->layers.size() == static_cast<size_t>(conf.dlayers));
+
+    // the draft is trained without changing the encoder
+    std::vector<std::int64_t> xlen = {20, 30};
+    std::vector<std::int64_t> ylen = {3, 2};
+    auto x = torch::rand({2, 30, n_input});
+    auto y = torch::full({2, 3}, 1, at::kLong);
+    auto [loss, acc] = model->forward(x, xlen, y, ylen);
+    loss.backward();
+    // metrics keep the main decoder only
+    CHECK(model->draft_metrics.steps == 1);
+    CHECK(model->metrics.loss() + model->draft_metrics.loss() == Approx(loss.item<double>()));
+    for (auto& p : model->draft->parameters()) {
+        CHECK(p.grad().defined());
+    }
+
+    model->eval();
+    torch::NoGradGuard no_grad;
+    auto [mem, mem_mask] = model->encode(x, xlen);
+    auto expected = greedy_search(model->decoder, mem, mem_mask, model->sos, model->eos, conf);
+    for (auto k : {1, 3, 100}) {
+        conf.speculative_tokens = k;
+        auto results = speculative_search(model->decoder, model->draft, mem, mem_mask, model->sos, model->eos, conf);
+        // the main decoder drafting itself accepts every token
+        auto self = speculative_search(model->decoder, model->decoder, mem, mem_mask, model->sos, model->eos, conf);
+        REQUIRE(results.size() == expected.size());
+        for (size_t i = 0; i < results.size(); ++i) {
+            CHECK(results[i].front().tokens == expected[i].tokens);
+            CHECK(results[i].front().score == Approx(expected[i].score).epsilon(1e-4));
+            CHECK(self[i].front().tokens == expected[i].tokens);
+        }
+    }
+    model->config.speculative_tokens = 3;
+    auto batch = model->recognize_batch(x, xlen);
+    for (size_t i = 0; i < batch.size(); ++i) {
+        CHECK(batch[i].front().tokens == expected[i].tokens);
+    }
+
+    // truncated states continue as if the rest were never fed
+    auto t = (torch::rand({2, 4}) * (n_output - 1)).to(at::kLong);
+    auto state = model->decoder->init_state(mem, mem_mask);
+    model->decoder->forward_incremental(t, state);
+    state.truncate(2);
+    CHECK(state.offset == 2);
+    auto z = model->decoder->forward_incremental(t.slice(1, 2, 3), state);
+    auto ref_state = model->decoder->init_state(mem, mem_mask);
+    auto ref = model->decoder->forward_incremental(t.slice(1, 0, 3), ref_state);
+    CHECK_THAT(z.select(1, -1), testing::TensorClose(ref.select(1, -1), 1e-5, 1e-6));
+}
+
+TEST_CASE("concurrent recognize", "[net]")
+{
+    namespace T = transformer;
+    std::int64_t n_input = 6;
+    T::Config conf;
+    conf.d_model = n_input;
+    conf.d_ff = 3;
+    conf.heads = 3;
+    conf.beam_size = 2;
+    conf.max_len_ratio = 1.0;
+    Transformer<T::Conv2dSubsampling> model(n_input, 5, conf);
+    model->eval();
+
+    std::vector<torch::Tensor> xs;
+    std::vector<std::vector<std::int64_t>> expected;
+    for (std::int64_t i = 0; i < 4; ++i) {
+        torch::NoGradGuard no_grad;
+        xs.push_back(torch::rand({20 + i, n_input}));
+        expected.push_back(model->recognize(xs.back()).front().tokens);
+    }
+
+    // threads share one set of parameters
+    std::vector<std::vector<std::int64_t>> results(xs.size());
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < xs.size(); ++i) {
+        workers.emplace_back([&, i]() {
+            torch::NoGradGuard no_grad;
+            for (int n = 0; n < 3; ++n) {
+                results[i] = model->recognize(xs[i]).front().tokens;
+            }
+        });
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    CHECK(results == expected);
+}
+
+TEST_CASE("fused_projection", "[net]")
+{
+    namespace T = transformer;
+    auto x = torch::rand({2, 5, 6});
+    auto m = pad_mask({3, 5}).unsqueeze(-2);
+    auto y = torch::rand({2, 4, 6});
+    auto ym = pad_mask({4, 2}).unsqueeze(-2).__and__(subsequent_mask(4).unsqueeze(0));
+
+    T::EncoderLayer e1(6, 3, 4, 0.0);
+    T::EncoderLayer e2(6, 3, 4, 0.0, true);
+    T::DecoderLayer d1(6, 3, 4, 0.0);
+    T::DecoderLayer d2(6, 3, 4, 0.0, true);
+    CHECK(e2->self_attn->linear_qkv->weight.size(0) == 18);
+    CHECK(d2->src_attn->linear_kv->weight.size(0) == 12);
+    {
+        // load a checkpoint of separate projections into packed ones
+        std::stringstream es, ds;
+        torch::save(e1, es);
+        torch::save(d1, ds);
+        torch::load(e2, es);
+        torch::load(d2, ds);
+        CHECK_THAT(std::get<0>(e2->forward(x, m)), testing::TensorClose(std::get<0>(e1->forward(x, m))));
+        CHECK_THAT(std::get<0>(d2->forward(y, ym, x, m)), testing::TensorClose(std::get<0>(d1->forward(y, ym, x, m))));
+    }
+    {
+        // and vice versa
+        T::EncoderLayer e3(6, 3, 4, 0.0);
+        std::stringstream es;
+        torch::save(e2, es);
+        torch::load(e3, es);
+        CHECK_THAT(std::get<0>(e3->forward(x, m)), testing::TensorClose(std::get<0>(e1->forward(x, m))));
+    }
+    auto [h, _hm] = e2->forward(x, m);
+    h.sum().backward();
+    CHECK_THAT(*e2, testing::HasGrad(true));
+}
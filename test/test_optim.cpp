@@ -0,0 +1,42 @@
+#include <thxx/optim.hpp>
+#include <thxx/testing.hpp>
+
+using namespace thxx;
+
+
+TEST_CASE("MixedPrecision", "[optim]")
+{
+    auto w = torch::ones({4}).set_requires_grad(true);
+    optim::MixedPrecision mp({w}, {1024, 2, 2});
+    torch::optim::SGD sgd(mp.master_parameters, 0.5);
+
+    // gradients are unscaled into the fp32 master weights
+    mp.zero_grad();
+    mp.scale((w * 2).sum()).backward();
+    CHECK(mp.step(sgd));
+    CHECK_THAT(mp.master_parameters[0].grad(), testing::TensorClose(torch::full({4}, 2)));
+    CHECK_THAT(w, testing::TensorClose(torch::zeros({4})));
+
+    // overflow skips the update and decreases the scale
+    mp.zero_grad();
+    mp.scale((w * 1e36).sum()).backward();
+    CHECK_FALSE(mp.step(sgd));
+    CHECK(mp.loss_scale == 512);
+    CHECK_THAT(w, testing::TensorClose(torch::zeros({4})));
+
+    // the scale grows after growth_interval good steps
+    for (int i = 0; i < 2; ++i) {
+        mp.zero_grad();
+        mp.scale(w.sum()).backward();
+        CHECK(mp.step(sgd));
+    }
+    CHECK(mp.loss_scale == 1024);
+
+    // finite gradients are not an overflow even if their sum is
+    auto v = torch::ones({4}).set_requires_grad(true);
+    optim::MixedPrecision mp2({v}, {1, 2, 2});
+    torch::optim::SGD sgd2(mp2.master_parameters, 0);
+    mp2.zero_grad();
+    mp2.scale((v * 3e38).sum()).backward();
+    CHECK(mp2.step(sgd2));
+}
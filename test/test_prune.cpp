@@ -0,0 +1,107 @@
+#include <thxx/prune.hpp>
+#include <thxx/testing.hpp>
+
+using namespace thxx;
+
+
+namespace {
+    namespace T = net::transformer;
+
+    T::Config config() {
+        T::Config conf;
+        conf.d_model = 6;
+        conf.d_ff = 4;
+        conf.heads = 3;
+        conf.elayers = 2;
+        conf.dlayers = 1;
+        conf.max_len_ratio = 1.0;
+        return conf;
+    }
+
+    /// calibrate by the loss of random targets
+    void calibrate(net::Transformer<T::Conv2dSubsampling>& model, prune::Calibration& calibration,
+                   torch::Tensor x, std::vector<std::int64_t> xlen) {
+        auto t = (torch::rand({x.size(0), 4}) * 4).to(at::kLong);
+        std::vector<std::int64_t> tlen(x.size(0), 4);
+        model->zero_grad();
+        std::get<0>(model->forward(x, xlen, t, tlen)).backward();
+        calibration.accumulate();
+    }
+}
+
+TEST_CASE("Calibration", "[prune]")
+{
+    auto conf = config();
+    net::Transformer<T::Conv2dSubsampling> model(6, 5, conf);
+    model->eval();
+    auto x = torch::rand({1, 30, 6});
+    prune::Calibration calibration(*model);
+    auto& attn = *model->encoder->layers[0]->self_attn;
+    auto& pff = *model->decoder->layers[0]->pff;
+    // weight norms before calibration
+    CHECK(calibration.head_importance(attn).pow(2).sum().item<float>()
+          == Approx(attn.linear_out->weight.pow(2).sum().item<float>()));
+    calibrate(model, calibration, x, {30});
+    CHECK(calibration.count() == 1);
+    auto h = calibration.head_importance(attn);
+    CHECK(h.sizes() == at::IntList({conf.heads}));
+    CHECK(h.min().item<float>() >= 0);
+    // |dL/dm| of a head mask m equals the inner product of its linear_out columns and their gradient
+    auto w = attn.linear_out->weight.slice(1, attn.d_k, 2 * attn.d_k);
+    auto g = attn.linear_out->weight.grad().slice(1, attn.d_k, 2 * attn.d_k);
+    CHECK(h[1].item<float>() == Approx((w * g).sum().abs().item<float>()));
+    auto n = calibration.neuron_importance(pff);
+    CHECK(n.sizes() == at::IntList({conf.d_ff}));
+    CHECK(n.min().item<float>() >= 0);
+}
+
+TEST_CASE("prune", "[prune]")
+{
+    auto conf = config();
+    conf.fused_projection = true;
+    net::Transformer<T::Conv2dSubsampling> model(6, 5, conf);
+    model->eval();
+    {
+        // silence the head 1 of every attention and the neurons 0 and 2 of every feed-forward layer
+        torch::NoGradGuard no_grad;
+        for (auto& m : model->modules()) {
+            if (auto a = std::dynamic_pointer_cast<net::MultiHeadedAttentionImpl>(m)) {
+                a->linear_out->weight.slice(1, a->d_k, 2 * a->d_k).zero_();
+            } else if (auto f = std::dynamic_pointer_cast<T::PositionwiseFeedforwardImpl>(m)) {
+                auto w_2 = std::get<1>(T::feedforward_linears(*f));
+                w_2->weight.select(1, 0).zero_();
+                w_2->weight.select(1, 2).zero_();
+            }
+        }
+    }
+    auto x = torch::rand({2, 30, 6});
+    std::vector<std::int64_t> xlen = {30, 25};
+    prune::Calibration calibration(*model);
+    calibrate(model, calibration, x, xlen);
+    auto pruned = prune::prune(model, calibration, 2, 2);
+    CHECK(pruned->config.heads == 2);
+    CHECK(pruned->config.d_head == 2);
+    CHECK(pruned->config.d_ff == 2);
+    CHECK(pruned->encoder->layers[0]->self_attn->linear_qkv->weight.sizes() == at::IntList({12, 6}));
+    CHECK(pruned->encoder->layers[0]->self_attn->linear_out->weight.sizes() == at::IntList({6, 4}));
+
+    // the silenced heads and neurons do not change anything
+    torch::NoGradGuard no_grad;
+    auto [mem, mem_mask] = model->encode(x, xlen);
+    auto [pmem, pmem_mask] = pruned->encode(x, xlen);
+    CHECK_THAT(pmem, testing::TensorClose(mem, 1e-4, 1e-5));
+    auto expected = model->recognize_batch(x, xlen);
+    auto results = pruned->recognize_batch(x, xlen);
+    for (size_t i = 0; i < results.size(); ++i) {
+        CHECK(results[i].front().tokens == expected[i].front().tokens);
+    }
+
+    // a checkpoint is loadable into the pruned config
+    std::stringstream ss;
+    torch::save(pruned, ss);
+    net::Transformer<T::Conv2dSubsampling> loaded(6, 5, pruned->config);
+    torch::load(loaded, ss);
+    loaded->eval();
+    auto [lmem, lmem_mask] = loaded->encode(x, xlen);
+    CHECK_THAT(lmem, testing::TensorClose(pmem));
+}
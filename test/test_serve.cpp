@@ -0,0 +1,117 @@
+#include <thxx/serve.hpp>
+#include <thxx/testing.hpp>
+
+#include <cmath>
+#include <mutex>
+
+using namespace thxx;
+
+
+TEST_CASE("DynamicBatcher", "[serve]")
+{
+    std::mutex mutex;
+    std::vector<std::int64_t> batch_sizes;
+    auto fn = [&](torch::Tensor x, at::IntList lengths) {
+        // Catch assertions are not thread safe
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            batch_sizes.push_back(x.size(0));
+        }
+        std::vector<serve::DynamicBatcher::Result> ret;
+        for (std::int64_t i = 0; i < x.size(0); ++i) {
+            net::Hypothesis h;
+            // the first feature of each utterance identifies it
+            h.score = x[i][0][0].item<double>();
+            h.tokens.push_back(lengths[i]);
+            ret.push_back({h});
+        }
+        return ret;
+    };
+
+    serve::BatcherOptions options;
+    options.max_batch = 4;
+    options.max_frames = 30;
+    options.max_latency = 0.05;
+    serve::DynamicBatcher batcher(fn, options);
+
+    std::vector<std::future<serve::DynamicBatcher::Result>> futures;
+    std::vector<std::int64_t> lengths = {10, 5, 10, 3, 2, 40, 1};
+    for (size_t i = 0; i < lengths.size(); ++i) {
+        futures.push_back(batcher.submit(torch::full({lengths[i], 2}, static_cast<double>(i))));
+    }
+    for (size_t i = 0; i < lengths.size(); ++i) {
+        auto r = futures[i].get();
+        REQUIRE(r.size() == 1);
+        CHECK(r.front().score == static_cast<double>(i));
+        CHECK(r.front().tokens.front() == lengths[i]);
+    }
+    std::int64_t total = 0;
+    for (auto b : batch_sizes) {
+        CHECK(b <= options.max_batch);
+        total += b;
+    }
+    CHECK(total == static_cast<std::int64_t>(lengths.size()));
+    CHECK(batcher.n_batches() == static_cast<std::int64_t>(batch_sizes.size()));
+
+    // a lonely utterance is recognized after the deadline
+    auto begin = std::chrono::steady_clock::now();
+    batcher.submit(torch::zeros({3, 2})).get();
+    auto waited = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    CHECK(waited >= options.max_latency * 0.9);
+}
+
+TEST_CASE("DynamicBatcher failures", "[serve]")
+{
+    auto fn = [](torch::Tensor x, at::IntList) {
+        return std::vector<serve::DynamicBatcher::Result>(x.size(0), {net::Hypothesis()});
+    };
+    serve::BatcherOptions options;
+    // the first two utterances make a full batch
+    options.max_batch = 2;
+    options.max_latency = 0.5;
+    serve::DynamicBatcher batcher(fn, options);
+    // utterances of different feature dims cannot be padded into one batch
+    auto a = batcher.submit(torch::zeros({3, 2}));
+    auto b = batcher.submit(torch::zeros({3, 5}));
+    CHECK_THROWS(a.get());
+    CHECK_THROWS(b.get());
+    // the worker is still alive
+    CHECK(batcher.submit(torch::zeros({3, 2})).get().size() == 1);
+}
+
+TEST_CASE("wire", "[serve]")
+{
+    int fds[2];
+    REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    auto x = at::rand({7, 3});
+    REQUIRE(serve::wire::send_features(fds[0], x));
+    auto y = serve::wire::receive_features(fds[1], 3, 7);
+    CHECK_THAT(y, testing::TensorEq(x));
+    // headers of other feature dims or too many frames are rejected
+    REQUIRE(serve::wire::send_features(fds[0], at::rand({7, 4})));
+    CHECK(!serve::wire::receive_features(fds[1], 3, 7).defined());
+    int gds[2];
+    REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, gds) == 0);
+    REQUIRE(serve::wire::send_features(gds[0], at::rand({8, 3})));
+    CHECK(!serve::wire::receive_features(gds[1], 3, 7).defined());
+    ::close(gds[0]);
+    ::close(gds[1]);
+
+    net::Hypothesis h;
+    h.score = -1.5;
+    h.tokens = {4, 1, 2, 4};
+    REQUIRE(serve::wire::send_hypothesis(fds[1], h));
+    net::Hypothesis g;
+    REQUIRE(serve::wire::receive_hypothesis(fds[0], g));
+    CHECK(g.score == h.score);
+    CHECK(g.tokens == h.tokens);
+
+    CHECK(std::isinf(serve::wire::rejected().score));
+    CHECK(serve::wire::rejected().tokens.empty());
+
+    ::close(fds[0]);
+    CHECK(!serve::wire::receive_features(fds[1], 3, 7).defined());
+    // no SIGPIPE
+    CHECK(!serve::wire::send_hypothesis(fds[1], h));
+    ::close(fds[1]);
+}